@@ -0,0 +1,819 @@
+/* bench_client.c
+ *
+ * Multi-threaded HTTP load generator
+ *
+ * Each thread drives its share of the connections with its own epoll
+ * instance. Two load models are supported:
+ *
+ *  - Closed loop (default): every connection sends its next request as soon
+ *    as the previous response has been received. The offered load adapts to
+ *    the server, so latency is measured from the moment a request is sent.
+ *
+ *  - Open loop (-r RATE): requests are scheduled at a constant rate,
+ *    independently of the responses. A request that cannot be sent on time
+ *    because all connections are busy waits for one, and its latency is
+ *    measured from its scheduled time rather than from when it was actually
+ *    sent. This corrects for coordinated omission: a stalled server is
+ *    charged for the requests it prevented the client from sending.
+ *
+ *  - Replay (-l LOG): the requests of an access log are sent open loop at
+ *    their logged arrival times, optionally sped up or slowed down (-x).
+ *    See replay.c for the log formats. With -g DIR, the docroot of the log
+ *    is created instead, with files of the logged sizes.
+ *
+ * Usage: bench_client [-H host] [-p port] [-t threads] [-c connections]
+ *                     [-d seconds] [-r rate] [-k] [-u url | -f url-file] [-j]
+ *                     [-l access-log [-x speed] [-g docroot [-z size]]]
+ *
+ * A URL file has one "path [weight]" entry per line; requests pick a path at
+ * random in proportion to the weights (default 1). Lines starting with '#'
+ * are ignored.
+*/
+#define _GNU_SOURCE     /* For strcasestr() */
+
+#include "../utils/tlpi_hdr.h"
+#include "../utils/inet_sockets.h"
+#include "../utils/histogram.h"
+#include "../utils/utils.h"
+#include "replay.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_URLS 65536
+#define REQ_BUF_SIZE 2048
+#define RESP_BUF_SIZE 16384     /* Largest response header accepted */
+#define MAX_EVENTS 256
+#define CLOSED_LOOP_POLL_MS 100
+#define DEFAULT_DURATION_S 10
+#define REPLAY_GRACE_S 5        /* Time given to the last replayed requests to complete */
+#define REPLAY_UNTIMED_RATE 100 /* Default rate of log entries without a time */
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+typedef struct {
+    char *path;
+    double cum_weight;          /* Sum of the weights of this and the previous URLs */
+} url_t;
+
+/* Command line options */
+typedef struct {
+    const char *host;
+    const char *service;
+    unsigned int num_threads;
+    unsigned int num_conns;
+    unsigned int duration_s;
+    double rate;                /* Requests per second over all threads. 0 for closed loop */
+    int keepalive;
+    int json;
+    url_t *urls;
+    unsigned int num_urls;
+    replay_entry *entries;      /* Requests to replay, or NULL */
+    size_t num_entries;
+    double speed;               /* Replay speed multiplier */
+} config_t;
+
+enum { CONN_IDLE, CONN_WRITING, CONN_READING };
+
+typedef struct conn {
+    int fd;                     /* -1 if not connected */
+    int state;
+    char req[REQ_BUF_SIZE];
+    size_t req_len;
+    size_t req_off;             /* Bytes of the request sent so far */
+    char buf[RESP_BUF_SIZE];
+    size_t buf_len;             /* Bytes of the response header received so far */
+    int hdr_done;
+    int status;                 /* Status code of the response */
+    long long body_left;        /* Body bytes still expected, or -1 if the body ends at EOF */
+    int server_close;           /* The server closes the connection after the response */
+    uint64_t intended_ns;       /* Time the request was scheduled */
+    uint64_t sent_ns;           /* Time the request was sent */
+    struct conn *next_idle;
+} conn_t;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    const config_t *cfg;
+    conn_t *conns;
+    unsigned int num_conns;
+    conn_t *idle;               /* Stack of idle connections */
+    unsigned int num_busy;      /* Connections with a request in progress */
+    int epfd;
+    int tfd;                    /* Timer firing when the next request is due (open loop) */
+    uint64_t interval_ns;       /* Time between two requests of this thread (open loop) */
+    uint64_t next_due_ns;       /* Scheduled time of the next request (open loop), UINT64_MAX if none */
+    size_t next_entry;          /* Next request to replay. Threads take every num_threads'th one */
+    uint64_t seed;
+
+    hist_t latency;             /* From the scheduled time of the requests */
+    hist_t service;             /* From the time the requests were sent */
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t connects;
+    uint64_t unsent;            /* Scheduled requests never sent before the end of the run */
+    uint64_t bytes;
+    uint64_t status[6];         /* Responses by status code class, [0] for unparsable ones */
+} worker_t;
+
+
+/* ========================== GLOBALS ============================ */
+
+
+static uint64_t start_ns;
+static uint64_t end_ns;
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static void usage(const char *prog);
+static void load_urls(config_t *cfg, const char *file);
+static const char *pick_url(worker_t *w);
+static const char *next_path(worker_t *w);
+static void schedule_next(worker_t *w);
+static void *worker_run(void *arg);
+static int conn_start(worker_t *w, conn_t *c, uint64_t intended_ns, const char *path);
+static void conn_write(worker_t *w, conn_t *c);
+static void conn_read(worker_t *w, conn_t *c);
+static int conn_parse_header(conn_t *c);
+static void conn_done(worker_t *w, conn_t *c);
+static void conn_fail(worker_t *w, conn_t *c);
+static void conn_close(worker_t *w, conn_t *c);
+static void report_text(const config_t *cfg, worker_t *workers, double elapsed_s);
+static void report_json(const config_t *cfg, worker_t *workers, double elapsed_s);
+
+
+int
+main(int argc, char *argv[])
+{
+    config_t cfg = {
+        .host = "localhost", .service = "http", .num_threads = 1, .num_conns = 10,
+        .duration_s = 0, .rate = 0, .keepalive = 0, .json = 0, .urls = NULL, .num_urls = 0,
+        .entries = NULL, .num_entries = 0, .speed = 1
+    };
+    const char *url = "/", *url_file = NULL, *log_file = NULL, *docroot = NULL;
+    long long default_size = 4096;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:t:c:d:r:ku:f:jl:x:g:z:")) != -1) {
+        switch (opt) {
+            case 'H': cfg.host = optarg; break;
+            case 'p': cfg.service = optarg; break;
+            case 't': cfg.num_threads = getInt(optarg, GN_GT_0, "threads"); break;
+            case 'c': cfg.num_conns = getInt(optarg, GN_GT_0, "connections"); break;
+            case 'd': cfg.duration_s = getInt(optarg, GN_GT_0, "duration"); break;
+            case 'r': cfg.rate = getInt(optarg, GN_NONNEG, "rate"); break;
+            case 'k': cfg.keepalive = 1; break;
+            case 'u': url = optarg; break;
+            case 'f': url_file = optarg; break;
+            case 'j': cfg.json = 1; break;
+            case 'l': log_file = optarg; break;
+            case 'x':
+                cfg.speed = strtod(optarg, NULL);
+                if (cfg.speed <= 0)
+                    cmdLineErr("Invalid speed: %s\n", optarg);
+                break;
+            case 'g': docroot = optarg; break;
+            case 'z': default_size = getLong(optarg, GN_NONNEG, "size"); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc)
+        usage(argv[0]);
+    if (cfg.num_conns < cfg.num_threads)
+        cfg.num_threads = cfg.num_conns;
+
+    if (log_file != NULL) {
+        cfg.entries = replay_load(log_file, (cfg.rate > 0) ? cfg.rate : REPLAY_UNTIMED_RATE, &cfg.num_entries);
+        if (cfg.entries == NULL)
+            fatal("main(): Failed to load %s", log_file);
+
+        if (docroot != NULL) {
+            int num_files = replay_make_docroot(cfg.entries, cfg.num_entries, docroot, default_size);
+            if (num_files == -1)
+                fatal("main(): Failed to create docroot %s", docroot);
+            printf("Created %d files in %s for %zu requests\n", num_files, docroot, cfg.num_entries);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    else if (docroot != NULL) {
+        usage(argv[0]);
+    }
+    else if (url_file != NULL) {
+        load_urls(&cfg, url_file);
+    }
+    else {
+        cfg.urls = (url_t *) malloc(sizeof(*cfg.urls));
+        if (cfg.urls == NULL)
+            errExit("main(): malloc()");
+        cfg.urls[0].path = (char *) url;
+        cfg.urls[0].cum_weight = 1;
+        cfg.num_urls = 1;
+    }
+
+    /* A server closing a connection while we write must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    worker_t *workers = (worker_t *) calloc(cfg.num_threads, sizeof(*workers));
+    if (workers == NULL)
+        errExit("main(): calloc()");
+
+    start_ns = get_monotonic_ns();
+    if (cfg.duration_s > 0)
+        end_ns = start_ns + (uint64_t) cfg.duration_s * 1000000000;
+    else if (cfg.entries != NULL)
+        end_ns = start_ns + (uint64_t) (cfg.entries[cfg.num_entries - 1].time_ns / cfg.speed)
+                 + (uint64_t) REPLAY_GRACE_S * 1000000000;
+    else
+        end_ns = start_ns + (uint64_t) DEFAULT_DURATION_S * 1000000000;
+
+    unsigned int i;
+    for (i = 0; i < cfg.num_threads; i++) {
+        worker_t *w = &workers[i];
+        w->id = i;
+        w->cfg = &cfg;
+        w->num_conns = cfg.num_conns / cfg.num_threads + (i < cfg.num_conns % cfg.num_threads);
+        w->seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (cfg.entries != NULL) {
+            w->next_entry = i;
+            w->next_due_ns = (i < cfg.num_entries) ? start_ns + cfg.entries[i].time_ns / cfg.speed : UINT64_MAX;
+        }
+        else if (cfg.rate > 0) {
+            w->interval_ns = (uint64_t) (1e9 * cfg.num_threads / cfg.rate);
+            /* Interleave the schedules of the threads */
+            w->next_due_ns = start_ns + w->interval_ns * i / cfg.num_threads;
+        }
+        hist_init(&w->latency);
+        hist_init(&w->service);
+
+        int s = pthread_create(&w->thread, NULL, worker_run, w);
+        if (s != 0)
+            errExitEN(s, "main(): pthread_create()");
+    }
+
+    for (i = 0; i < cfg.num_threads; i++) {
+        int s = pthread_join(workers[i].thread, NULL);
+        if (s != 0)
+            errExitEN(s, "main(): pthread_join()");
+    }
+
+    double elapsed_s = (get_monotonic_ns() - start_ns) / 1e9;
+    if (cfg.json)
+        report_json(&cfg, workers, elapsed_s);
+    else
+        report_text(&cfg, workers, elapsed_s);
+
+    exit(EXIT_SUCCESS);
+}
+
+static void
+usage(const char *prog)
+{
+    usageErr("%s [-H host] [-p port] [-t threads] [-c connections] [-d seconds]\n"
+             "        [-r rate] [-k] [-u url | -f url-file] [-j]\n"
+             "        [-l access-log [-x speed] [-g docroot [-z size]]]\n"
+             "    -H  server host (default localhost)\n"
+             "    -p  server port or service (default http)\n"
+             "    -t  client threads (default 1)\n"
+             "    -c  connections, over all threads (default 10)\n"
+             "    -d  duration of the run in seconds (default 10)\n"
+             "    -r  open loop: requests per second over all threads (default 0, closed loop)\n"
+             "    -k  reuse connections (HTTP/1.1 keep-alive)\n"
+             "    -u  URL path to request (default /)\n"
+             "    -f  file of \"path [weight]\" lines to pick the URL paths from\n"
+             "    -j  report in JSON\n"
+             "    -l  replay the GET requests of an access log at their logged times\n"
+             "        (entries without a time at -r requests per second, default %d)\n"
+             "    -x  replay speed multiplier (default 1)\n"
+             "    -g  create the docroot of the access log in this directory and exit\n"
+             "    -z  size of the files whose size is not logged (default 4096)\n",
+             prog, REPLAY_UNTIMED_RATE);
+}
+
+
+/* ========================== URLS ============================ */
+
+
+static void
+load_urls(config_t *cfg, const char *file)
+{
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL)
+        errExit("load_urls(): fopen(%s)", file);
+
+    cfg->urls = (url_t *) malloc(MAX_URLS * sizeof(*cfg->urls));
+    if (cfg->urls == NULL)
+        errExit("load_urls(): malloc()");
+
+    char line[REQ_BUF_SIZE], path[REQ_BUF_SIZE];
+    double total = 0;
+    while (fgets(line, sizeof(line), fp) != NULL && cfg->num_urls < MAX_URLS) {
+        double weight = 1;
+        int n = sscanf(line, "%s %lf", path, &weight);
+        if (n < 1 || path[0] == '#')
+            continue;
+        if (weight <= 0)
+            continue;
+
+        total += weight;
+        cfg->urls[cfg->num_urls].path = strdup(path);
+        if (cfg->urls[cfg->num_urls].path == NULL)
+            errExit("load_urls(): strdup()");
+        cfg->urls[cfg->num_urls].cum_weight = total;
+        cfg->num_urls++;
+    }
+    fclose(fp);
+
+    if (cfg->num_urls == 0)
+        fatal("load_urls(): No URLs in %s", file);
+}
+
+/* Pick a URL at random in proportion to the weights */
+static const char *
+pick_url(worker_t *w)
+{
+    const config_t *cfg = w->cfg;
+    if (cfg->num_urls == 1)
+        return cfg->urls[0].path;
+
+    /* xorshift64 */
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 7;
+    w->seed ^= w->seed << 17;
+    double x = (w->seed >> 11) * (1.0 / (1ULL << 53)) * cfg->urls[cfg->num_urls - 1].cum_weight;
+
+    unsigned int lo = 0, hi = cfg->num_urls - 1;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (cfg->urls[mid].cum_weight <= x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return cfg->urls[lo].path;
+}
+
+/* Return the URL path of the next request */
+static const char *
+next_path(worker_t *w)
+{
+    if (w->cfg->entries != NULL)
+        return w->cfg->entries[w->next_entry].path;
+    return pick_url(w);
+}
+
+/* Advance the schedule of an open loop run past the request just sent */
+static void
+schedule_next(worker_t *w)
+{
+    const config_t *cfg = w->cfg;
+
+    if (cfg->entries == NULL) {
+        w->next_due_ns += w->interval_ns;
+        return;
+    }
+
+    w->next_entry += cfg->num_threads;
+    if (w->next_entry < cfg->num_entries)
+        w->next_due_ns = start_ns + cfg->entries[w->next_entry].time_ns / cfg->speed;
+    else
+        w->next_due_ns = UINT64_MAX;
+}
+
+
+/* ========================== WORKER ============================ */
+
+
+static void *
+worker_run(void *arg)
+{
+    worker_t *w = (worker_t *) arg;
+    int open_loop = (w->interval_ns > 0 || w->cfg->entries != NULL);
+
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd == -1)
+        errExit("worker_run(): epoll_create1()");
+
+    /* epoll_wait() only has a millisecond timeout: wake up on time for the
+       next scheduled request with a timer instead */
+    if (open_loop) {
+        w->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (w->tfd == -1)
+            errExit("worker_run(): timerfd_create()");
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->tfd, &ev) == -1)
+            errExit("worker_run(): epoll_ctl()");
+    }
+
+    w->conns = (conn_t *) calloc(w->num_conns, sizeof(*w->conns));
+    if (w->conns == NULL)
+        errExit("worker_run(): calloc()");
+
+    unsigned int i;
+    for (i = 0; i < w->num_conns; i++) {
+        conn_t *c = &w->conns[i];
+        c->fd = -1;
+        c->state = CONN_IDLE;
+        c->next_idle = w->idle;
+        w->idle = c;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t now;
+    while ((now = get_monotonic_ns()) < end_ns) {
+        int timeout_ms;
+
+        if (open_loop) {
+            /* Send the requests that are due, oldest first, on the idle connections */
+            while (w->next_due_ns <= now && w->idle != NULL) {
+                conn_t *c = w->idle;
+                w->idle = c->next_idle;
+                if (conn_start(w, c, w->next_due_ns, next_path(w)) == -1)
+                    break;          /* Retry on the next wakeup */
+                schedule_next(w);
+            }
+
+            /* The replay is over once its last request completes */
+            if (w->next_due_ns == UINT64_MAX && w->num_busy == 0)
+                break;
+
+            timeout_ms = CLOSED_LOOP_POLL_MS;
+            if (w->next_due_ns > now && w->next_due_ns != UINT64_MAX) {
+                struct itimerspec its = {
+                    .it_interval = { 0, 0 },
+                    .it_value = { w->next_due_ns / 1000000000, w->next_due_ns % 1000000000 }
+                };
+                if (timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+                    errExit("worker_run(): timerfd_settime()");
+            }
+            /* Else backlogged: wait for a connection to become idle */
+        }
+        else {
+            while (w->idle != NULL) {
+                conn_t *c = w->idle;
+                w->idle = c->next_idle;
+                if (conn_start(w, c, now, pick_url(w)) == -1)
+                    break;          /* Retry on the next wakeup */
+            }
+            timeout_ms = CLOSED_LOOP_POLL_MS;
+        }
+
+        uint64_t left_ms = (end_ns - now + 999999) / 1000000;
+        if (timeout_ms > left_ms)
+            timeout_ms = left_ms;
+
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout_ms);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("worker_run(): epoll_wait()");
+        }
+
+        int j;
+        for (j = 0; j < n; j++) {
+            conn_t *c = (conn_t *) events[j].data.ptr;
+            if (c == NULL) {
+                uint64_t expirations;
+                if (read(w->tfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+                    errExit("worker_run(): read() from timerfd");
+            }
+            else if (c->state == CONN_WRITING)
+                conn_write(w, c);
+            else if (c->state == CONN_READING)
+                conn_read(w, c);
+        }
+    }
+
+    /* Requests scheduled before the end but never sent */
+    if (w->cfg->entries != NULL) {
+        if (w->next_entry < w->cfg->num_entries)
+            w->unsent = (w->cfg->num_entries - w->next_entry - 1) / w->cfg->num_threads + 1;
+    }
+    else if (open_loop && w->next_due_ns < end_ns) {
+        w->unsent = (end_ns - w->next_due_ns) / w->interval_ns + 1;
+    }
+
+    for (i = 0; i < w->num_conns; i++) {
+        if (w->conns[i].fd != -1)
+            close(w->conns[i].fd);
+    }
+    if (open_loop)
+        close(w->tfd);
+    close(w->epfd);
+    free(w->conns);
+
+    return NULL;
+}
+
+
+/* ========================== CONNECTIONS ============================ */
+
+
+/* Send a request for 'path' scheduled at 'intended_ns' on idle connection
+   'c', connecting it first if needed. Returns 0 on success, or -1 if the
+   connection failed, in which case 'c' is idle again. */
+static int
+conn_start(worker_t *w, conn_t *c, uint64_t intended_ns, const char *path)
+{
+    if (c->fd == -1) {
+        c->fd = inetConnect(w->cfg->host, w->cfg->service, SOCK_STREAM);
+        if (c->fd == -1) {
+            w->errors++;
+            c->next_idle = w->idle;
+            w->idle = c;
+            return -1;
+        }
+        w->connects++;
+
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        int flags = fcntl(c->fd, F_GETFL);
+        if (flags == -1 || fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+            errExit("conn_start(): fcntl()");
+
+        struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+            errExit("conn_start(): epoll_ctl()");
+    }
+
+    c->req_len = snprintf(c->req, sizeof(c->req), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                          path, w->cfg->host, w->cfg->keepalive ? "keep-alive" : "close");
+    if (c->req_len >= sizeof(c->req))
+        fatal("conn_start(): URL too long");
+    c->req_off = 0;
+    c->buf_len = 0;
+    c->hdr_done = 0;
+    c->status = 0;
+    c->intended_ns = intended_ns;
+    c->sent_ns = get_monotonic_ns();
+    c->state = CONN_WRITING;
+    w->num_busy++;
+
+    /* The socket buffer is almost always empty: try to send right away */
+    conn_write(w, c);
+    return 0;
+}
+
+static void
+conn_write(worker_t *w, conn_t *c)
+{
+    while (c->req_off < c->req_len) {
+        ssize_t n = write(c->fd, c->req + c->req_off, c->req_len - c->req_off);
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+                epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                return;
+            }
+            conn_fail(w, c);
+            return;
+        }
+        c->req_off += n;
+    }
+
+    c->state = CONN_READING;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+        errExit("conn_write(): epoll_ctl()");
+}
+
+static void
+conn_read(worker_t *w, conn_t *c)
+{
+    for (;;) {
+        char discard[RESP_BUF_SIZE];
+        char *dst = c->hdr_done ? discard : c->buf + c->buf_len;
+        size_t room = c->hdr_done ? sizeof(discard) : sizeof(c->buf) - 1 - c->buf_len;
+        if (room == 0) {
+            conn_fail(w, c);        /* Header too large */
+            return;
+        }
+
+        ssize_t n = read(c->fd, dst, room);
+        if (n == -1) {
+            if (errno == EAGAIN)
+                return;
+            conn_fail(w, c);
+            return;
+        }
+
+        if (n == 0) {
+            /* EOF ends a response without Content-Length */
+            if (c->hdr_done && c->body_left == -1) {
+                c->server_close = 1;
+                conn_done(w, c);
+            }
+            else {
+                conn_fail(w, c);
+            }
+            return;
+        }
+        w->bytes += n;
+
+        if (!c->hdr_done) {
+            c->buf_len += n;
+            c->buf[c->buf_len] = '\0';
+            int body_read = conn_parse_header(c);
+            if (body_read == -1)
+                continue;
+            n = body_read;
+        }
+
+        if (c->body_left >= 0) {
+            c->body_left -= n;
+            if (c->body_left <= 0) {
+                conn_done(w, c);
+                return;
+            }
+        }
+    }
+}
+
+/* Parse the response header once it is complete. Returns the number of body
+   bytes received along with the header, or -1 if the header is incomplete. */
+static int
+conn_parse_header(conn_t *c)
+{
+    char *end = strstr(c->buf, "\r\n\r\n");
+    if (end == NULL)
+        return -1;
+    end += 4;
+    end[-2] = '\0';     /* Restrict the searches below to the header */
+
+    int minor = 0;
+    if (sscanf(c->buf, "HTTP/1.%d %d", &minor, &c->status) != 2)
+        c->status = 0;
+
+    char *p = strcasestr(c->buf, "\r\nContent-Length:");
+    c->body_left = (p != NULL) ? strtoll(p + 17, NULL, 10) : -1;
+
+    p = strcasestr(c->buf, "\r\nConnection:");
+    if (p != NULL)
+        c->server_close = (strncasecmp(p + 13 + strspn(p + 13, " \t"), "close", 5) == 0);
+    else
+        c->server_close = (minor == 0);     /* HTTP/1.0 closes by default */
+
+    c->hdr_done = 1;
+    return c->buf + c->buf_len - end;
+}
+
+/* Record a complete response and make the connection idle */
+static void
+conn_done(worker_t *w, conn_t *c)
+{
+    uint64_t now = get_monotonic_ns();
+    hist_record(&w->latency, now - c->intended_ns);
+    hist_record(&w->service, now - c->sent_ns);
+    w->completed++;
+    w->status[(c->status >= 100 && c->status < 600) ? c->status / 100 : 0]++;
+
+    if (c->server_close || !w->cfg->keepalive)
+        conn_close(w, c);
+
+    w->num_busy--;
+    c->state = CONN_IDLE;
+    c->next_idle = w->idle;
+    w->idle = c;
+}
+
+static void
+conn_fail(worker_t *w, conn_t *c)
+{
+    w->errors++;
+    conn_close(w, c);
+    w->num_busy--;
+    c->state = CONN_IDLE;
+    c->next_idle = w->idle;
+    w->idle = c;
+}
+
+static void
+conn_close(worker_t *w, conn_t *c)
+{
+    if (c->fd == -1)
+        return;
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+
+/* ========================== REPORTS ============================ */
+
+
+typedef struct {
+    hist_t latency;
+    hist_t service;
+    uint64_t completed, errors, connects, unsent, bytes;
+    uint64_t status[6];
+} totals_t;
+
+static totals_t *
+sum_workers(const config_t *cfg, worker_t *workers)
+{
+    totals_t *t = (totals_t *) calloc(1, sizeof(*t));
+    if (t == NULL)
+        errExit("sum_workers(): calloc()");
+    hist_init(&t->latency);
+    hist_init(&t->service);
+
+    unsigned int i, s;
+    for (i = 0; i < cfg->num_threads; i++) {
+        worker_t *w = &workers[i];
+        hist_merge(&t->latency, &w->latency);
+        hist_merge(&t->service, &w->service);
+        t->completed += w->completed;
+        t->errors += w->errors;
+        t->connects += w->connects;
+        t->unsent += w->unsent;
+        t->bytes += w->bytes;
+        for (s = 0; s < 6; s++)
+            t->status[s] += w->status[s];
+    }
+    return t;
+}
+
+static void
+report_text(const config_t *cfg, worker_t *workers, double elapsed_s)
+{
+    totals_t *t = sum_workers(cfg, workers);
+
+    if (cfg->entries != NULL)
+        printf("Replay of %zu requests at %gx speed, %u connections, %u threads, keep-alive %s\n",
+               cfg->num_entries, cfg->speed, cfg->num_conns, cfg->num_threads, cfg->keepalive ? "on" : "off");
+    else if (cfg->rate > 0)
+        printf("Open loop at %.0f req/s, %u connections, %u threads, keep-alive %s\n",
+               cfg->rate, cfg->num_conns, cfg->num_threads, cfg->keepalive ? "on" : "off");
+    else
+        printf("Closed loop, %u connections, %u threads, keep-alive %s\n",
+               cfg->num_conns, cfg->num_threads, cfg->keepalive ? "on" : "off");
+
+    printf("Duration: %.2f s\n", elapsed_s);
+    printf("Requests: %llu completed, %llu errors, %llu unsent, %llu connections opened\n",
+           (unsigned long long) t->completed, (unsigned long long) t->errors,
+           (unsigned long long) t->unsent, (unsigned long long) t->connects);
+    printf("Responses: 2xx=%llu 3xx=%llu 4xx=%llu 5xx=%llu other=%llu\n",
+           (unsigned long long) t->status[2], (unsigned long long) t->status[3],
+           (unsigned long long) t->status[4], (unsigned long long) t->status[5],
+           (unsigned long long) (t->status[0] + t->status[1]));
+    printf("Throughput: %.1f req/s, %.2f MB/s\n", t->completed / elapsed_s, t->bytes / elapsed_s / 1e6);
+
+    if (cfg->rate > 0 || cfg->entries != NULL) {
+        hist_print(stdout, "Latency (from schedule)", &t->latency);
+        hist_print(stdout, "Latency (from send, uncorrected)", &t->service);
+    }
+    else {
+        hist_print(stdout, "Latency", &t->service);
+    }
+
+    free(t);
+}
+
+static void
+print_json_hist(const char *name, const hist_t *h, int last)
+{
+    printf("  \"%s\": {\"count\": %llu, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+           "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}%s\n",
+           name, (unsigned long long) h->count, hist_mean(h) / 1e3,
+           hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+           hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3,
+           h->max / 1e3, last ? "" : ",");
+}
+
+static void
+report_json(const config_t *cfg, worker_t *workers, double elapsed_s)
+{
+    totals_t *t = sum_workers(cfg, workers);
+
+    printf("{\n");
+    printf("  \"mode\": \"%s\",\n", (cfg->entries != NULL) ? "replay" : (cfg->rate > 0) ? "open" : "closed");
+    printf("  \"speed\": %g,\n", cfg->speed);
+    printf("  \"rate\": %.0f,\n", cfg->rate);
+    printf("  \"connections\": %u,\n", cfg->num_conns);
+    printf("  \"threads\": %u,\n", cfg->num_threads);
+    printf("  \"keepalive\": %s,\n", cfg->keepalive ? "true" : "false");
+    printf("  \"duration_s\": %.3f,\n", elapsed_s);
+    printf("  \"completed\": %llu,\n", (unsigned long long) t->completed);
+    printf("  \"errors\": %llu,\n", (unsigned long long) t->errors);
+    printf("  \"unsent\": %llu,\n", (unsigned long long) t->unsent);
+    printf("  \"connects\": %llu,\n", (unsigned long long) t->connects);
+    printf("  \"status\": {\"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, \"5xx\": %llu, \"other\": %llu},\n",
+           (unsigned long long) t->status[2], (unsigned long long) t->status[3],
+           (unsigned long long) t->status[4], (unsigned long long) t->status[5],
+           (unsigned long long) (t->status[0] + t->status[1]));
+    printf("  \"requests_per_s\": %.1f,\n", t->completed / elapsed_s);
+    printf("  \"bytes_per_s\": %.0f,\n", t->bytes / elapsed_s);
+    print_json_hist("latency", (cfg->rate > 0 || cfg->entries != NULL) ? &t->latency : &t->service, 0);
+    print_json_hist("service_time", &t->service, 1);
+    printf("}\n");
+
+    free(t);
+}
@@ -0,0 +1,411 @@
+/* microbench.c
+ *
+ * Microbenchmarks of the request hot path
+ *
+ * Each benchmark is calibrated to run for about MIN_RUN_NS, then repeated
+ * REPEATS times; the median time per operation is reported, along with the
+ * number of heap allocations per operation. Allocations are counted by
+ * interposing malloc(), calloc() and realloc() on the glibc allocator.
+ *
+ * Results can be saved to a baseline file (-w) and later runs compared
+ * against it (-b), so that a change to one of these functions can be
+ * measured:
+ *
+ *     $ ./bench/microbench -w baseline.txt
+ *     ... change the code, rebuild ...
+ *     $ ./bench/microbench -b baseline.txt
+ *
+ * The internal functions of request.c are reached through request_internal.h.
+*/
+#define _GNU_SOURCE     /* For memfd_create() */
+
+#include "../utils/tlpi_hdr.h"
+#include "../utils/utils.h"
+#include "../threadpool/threadpool.h"
+#include "../server/request_internal.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define MIN_RUN_NS 100000000    /* Calibrated duration of one run */
+#define REPEATS 5               /* Runs per benchmark; the median is reported */
+#define MAX_BENCHES 64
+
+
+/* ========================== ALLOCATION COUNTING ============================ */
+
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t num_allocs;     /* Allocations by all threads */
+
+void *
+malloc(size_t size)
+{
+    __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+typedef struct {
+    const char *name;
+    void (*setup)(long arg);
+    void (*run)(long arg, uint64_t iters);
+    void (*teardown)(long arg);
+    long arg;
+} bench_t;
+
+typedef struct {
+    char name[128];
+    double ns_per_op;
+    double allocs_per_op;
+} result_t;
+
+
+/* ========================== FIXTURES ============================ */
+
+
+static const char request_text[] =
+    "GET /images/logo.jpg HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static const char *filenames[] = {
+    "./index.html", "./images/logo.jpg", "./css/site.css", "./docs/readme.txt",
+    "./photos/2020/beach.jpeg", "./archive.tar.gz", "./noext", "./a.b.c.html"
+};
+#define NUM_FILENAMES (sizeof(filenames) / sizeof(filenames[0]))
+
+static int request_fd = -1;     /* memfd holding 'request_text' */
+static threadpool bench_pool;
+static unsigned long jobs_done;
+
+
+/* ========================== BENCHMARKS ============================ */
+
+
+/* Prevent the compiler from optimizing away a result */
+#define KEEP(x) __asm__ __volatile__("" : : "g"(x) : "memory")
+
+static void
+request_fd_setup(long arg)
+{
+    request_fd = memfd_create("request", MFD_CLOEXEC);
+    if (request_fd == -1 || write(request_fd, request_text, sizeof(request_text) - 1) == -1)
+        errExit("request_fd_setup()");
+}
+
+static void
+request_fd_teardown(long arg)
+{
+    close(request_fd);
+}
+
+/* Read the whole request line by line */
+static void
+bench_read_lines(long arg, uint64_t iters)
+{
+    rbuf_t *rbuf = readBufAlloc(request_fd, BUF_SIZE);
+    char buf[BUF_SIZE];
+    uint64_t i;
+    for (i = 0; i < iters; i++) {
+        lseek(request_fd, 0, SEEK_SET);
+        readBufInit(request_fd, rbuf);
+        while (readLineFromBuf(rbuf, buf, BUF_SIZE) > 0)
+            KEEP(buf[0]);
+    }
+    free(rbuf);
+}
+
+/* Read the request line, then parse and free the headers */
+static void
+bench_parse_hdr(long arg, uint64_t iters)
+{
+    rbuf_t *rbuf = readBufAlloc(request_fd, BUF_SIZE);
+    char buf[BUF_SIZE];
+    uint64_t i;
+    for (i = 0; i < iters; i++) {
+        lseek(request_fd, 0, SEEK_SET);
+        readBufInit(request_fd, rbuf);
+        readLineFromBuf(rbuf, buf, BUF_SIZE);
+        int error;
+        hdr_t **hdr_pp = request_parse_hdr(rbuf, request_fd, &error);
+        KEEP(hdr_pp);
+        request_destroy_hdr(hdr_pp);
+    }
+    free(rbuf);
+}
+
+static void
+bench_trimwhitespace(long arg, uint64_t iters)
+{
+    static const char value[] = "   keep-alive  \t";
+    char buf[sizeof(value)];
+    uint64_t i;
+    for (i = 0; i < iters; i++) {
+        memcpy(buf, value, sizeof(value));
+        KEEP(trimwhitespace(buf));
+    }
+}
+
+static void
+bench_filename_ext(long arg, uint64_t iters)
+{
+    uint64_t i;
+    for (i = 0; i < iters; i++)
+        KEEP(get_filename_ext(filenames[i % NUM_FILENAMES]));
+}
+
+static void
+bench_content_type(long arg, uint64_t iters)
+{
+    char content_type[MAX_LEN];
+    uint64_t i;
+    for (i = 0; i < iters; i++) {
+        response_get_content_type((char *) filenames[i % NUM_FILENAMES], content_type);
+        KEEP(content_type[0]);
+    }
+}
+
+static void
+bench_format_header(long arg, uint64_t iters)
+{
+    char resp[BUF_SIZE];
+    uint64_t i;
+    for (i = 0; i < iters; i++) {
+        response_format_header(resp, "text/html", (int) (i & 0xfffff), 1);
+        KEEP(resp[0]);
+    }
+}
+
+static void
+pool_setup(long num_threads)
+{
+    thpool_attr attr;
+    thpool_attr_init(&attr);
+    bench_pool = thpool_init(num_threads, 1024, &attr);
+    if (bench_pool == NULL)
+        fatal("pool_setup(): thpool_init() failed");
+}
+
+static void
+pool_teardown(long num_threads)
+{
+    thpool_destroy(bench_pool);
+}
+
+static void
+noop_job(void *arg)
+{
+    __atomic_add_fetch(&jobs_done, 1, __ATOMIC_RELAXED);
+}
+
+/* Submit one job and wait for it to complete */
+static void
+bench_pool_roundtrip(long num_threads, uint64_t iters)
+{
+    uint64_t i;
+    for (i = 0; i < iters; i++) {
+        if (thpool_add_work(bench_pool, noop_job, NULL) == -1)
+            fatal("bench_pool_roundtrip(): thpool_add_work() failed");
+        thpool_wait(bench_pool);
+    }
+}
+
+/* Submit jobs in bursts of 64 and wait for each burst. Time is per job. */
+static void
+bench_pool_burst(long num_threads, uint64_t iters)
+{
+    uint64_t i;
+    for (i = 0; i < iters; i++) {
+        if (thpool_add_work(bench_pool, noop_job, NULL) == -1)
+            fatal("bench_pool_burst(): thpool_add_work() failed");
+        if (i % 64 == 63)
+            thpool_wait(bench_pool);
+    }
+    thpool_wait(bench_pool);
+}
+
+static const bench_t benches[] = {
+    { "readLineFromBuf/request",        request_fd_setup, bench_read_lines, request_fd_teardown, 0 },
+    { "request_parse_hdr/request",      request_fd_setup, bench_parse_hdr, request_fd_teardown, 0 },
+    { "trimwhitespace",                 NULL, bench_trimwhitespace, NULL, 0 },
+    { "get_filename_ext",               NULL, bench_filename_ext, NULL, 0 },
+    { "response_get_content_type",      NULL, bench_content_type, NULL, 0 },
+    { "response_format_header",         NULL, bench_format_header, NULL, 0 },
+    { "thpool_roundtrip/1",             pool_setup, bench_pool_roundtrip, pool_teardown, 1 },
+    { "thpool_roundtrip/2",             pool_setup, bench_pool_roundtrip, pool_teardown, 2 },
+    { "thpool_roundtrip/4",             pool_setup, bench_pool_roundtrip, pool_teardown, 4 },
+    { "thpool_roundtrip/8",             pool_setup, bench_pool_roundtrip, pool_teardown, 8 },
+    { "thpool_burst64/1",               pool_setup, bench_pool_burst, pool_teardown, 1 },
+    { "thpool_burst64/4",               pool_setup, bench_pool_burst, pool_teardown, 4 },
+    { "thpool_burst64/8",               pool_setup, bench_pool_burst, pool_teardown, 8 },
+};
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+
+/* ========================== RUNNER ============================ */
+
+
+static int
+compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void
+run_bench(const bench_t *b, result_t *r)
+{
+    if (b->setup != NULL)
+        b->setup(b->arg);
+
+    /* Find an iteration count that runs for about MIN_RUN_NS */
+    uint64_t iters = 1, elapsed_ns = 0;
+    for (;;) {
+        uint64_t start_ns = get_monotonic_ns();
+        b->run(b->arg, iters);
+        elapsed_ns = get_monotonic_ns() - start_ns;
+        if (elapsed_ns >= MIN_RUN_NS / 10)
+            break;
+        iters *= 10;
+    }
+    iters = iters * MIN_RUN_NS / (elapsed_ns > 0 ? elapsed_ns : 1) + 1;
+
+    double ns_per_op[REPEATS];
+    uint64_t allocs = 0;
+    int i;
+    for (i = 0; i < REPEATS; i++) {
+        uint64_t allocs_before = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED);
+        uint64_t start_ns = get_monotonic_ns();
+        b->run(b->arg, iters);
+        ns_per_op[i] = (double) (get_monotonic_ns() - start_ns) / iters;
+        allocs += __atomic_load_n(&num_allocs, __ATOMIC_RELAXED) - allocs_before;
+    }
+    qsort(ns_per_op, REPEATS, sizeof(ns_per_op[0]), compare_double);
+
+    snprintf(r->name, sizeof(r->name), "%s", b->name);
+    r->ns_per_op = ns_per_op[REPEATS / 2];
+    r->allocs_per_op = (double) allocs / (iters * REPEATS);
+
+    if (b->teardown != NULL)
+        b->teardown(b->arg);
+}
+
+/* Load results saved with -w. Returns the number of results loaded. */
+static int
+load_baseline(const char *file, result_t *baseline, int max)
+{
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL)
+        errExit("load_baseline(): fopen(%s)", file);
+
+    int n = 0;
+    char line[256];
+    while (n < max && fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%127s %lf %lf", baseline[n].name, &baseline[n].ns_per_op,
+                   &baseline[n].allocs_per_op) == 3)
+            n++;
+    }
+    fclose(fp);
+
+    return n;
+}
+
+static const result_t *
+find_result(const result_t *results, int n, const char *name)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        if (!strcmp(results[i].name, name))
+            return &results[i];
+    }
+    return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *baseline_file = NULL, *save_file = NULL, *filter = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:f:")) != -1) {
+        switch (opt) {
+            case 'b': baseline_file = optarg; break;
+            case 'w': save_file = optarg; break;
+            case 'f': filter = optarg; break;
+            default:
+                usageErr("%s [-b baseline-file] [-w save-file] [-f name-filter]\n", argv[0]);
+        }
+    }
+
+    result_t baseline[MAX_BENCHES];
+    int num_baseline = 0;
+    if (baseline_file != NULL)
+        num_baseline = load_baseline(baseline_file, baseline, MAX_BENCHES);
+
+    result_t results[MAX_BENCHES];
+    int num_results = 0;
+
+    printf("%-30s %12s %12s", "Benchmark", "ns/op", "allocs/op");
+    if (num_baseline > 0)
+        printf(" %12s %12s", "base ns/op", "change");
+    printf("\n");
+
+    unsigned int i;
+    for (i = 0; i < NUM_BENCHES; i++) {
+        if (filter != NULL && strstr(benches[i].name, filter) == NULL)
+            continue;
+
+        result_t *r = &results[num_results++];
+        run_bench(&benches[i], r);
+
+        printf("%-30s %12.1f %12.2f", r->name, r->ns_per_op, r->allocs_per_op);
+        const result_t *base = find_result(baseline, num_baseline, r->name);
+        if (base != NULL)
+            printf(" %12.1f %+11.1f%%", base->ns_per_op, 100.0 * (r->ns_per_op / base->ns_per_op - 1));
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (save_file != NULL) {
+        FILE *fp = fopen(save_file, "w");
+        if (fp == NULL)
+            errExit("main(): fopen(%s)", save_file);
+        fprintf(fp, "# name ns/op allocs/op\n");
+        int j;
+        for (j = 0; j < num_results; j++)
+            fprintf(fp, "%s %.3f %.3f\n", results[j].name, results[j].ns_per_op, results[j].allocs_per_op);
+        fclose(fp);
+    }
+
+    exit(EXIT_SUCCESS);
+}
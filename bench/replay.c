@@ -0,0 +1,309 @@
+/* replay.c
+ *
+ * Access logs as benchmark workloads
+ *
+ * Two log formats are read:
+ *
+ *  - The Combined Log Format written by the server (and by most other web
+ *    servers), e.g.
+ *        127.0.0.1 - - [18/Oct/2026:23:43:56 +0000] "GET / HTTP/1.1" 200 12 "-" "curl/7.88.1"
+ *    The timestamps only have a one second resolution, so the requests
+ *    logged within the same second are spread evenly over that second.
+ *
+ *  - The request line format printed by earlier versions of the server, e.g.
+ *        (127.0.0.1, 54321) GET / HTTP/1.1
+ *    These lines have neither a time nor a size: the requests are spaced
+ *    at a fixed rate.
+ *
+ * The docroot of a log can be recreated with files of the logged sizes, so
+ * that a replay exercises the same file size mix as the original traffic.
+*/
+#define _GNU_SOURCE     /* For strptime() and timegm() */
+
+#include "../utils/tlpi_hdr.h"
+#include "replay.h"
+#include <ctype.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define REPLAY_LINE_MAX 8192
+#define REPLAY_FILL_SIZE 65536  /* Write size when creating docroot files */
+
+
+/* Entry being loaded, with the information needed to time it */
+typedef struct {
+    replay_entry e;
+    time_t sec;                 /* Logged time, or -1 if none */
+    size_t idx;                 /* Line order, to keep the sort stable */
+} load_entry;
+
+
+static int
+compare_load_entry(const void *a, const void *b)
+{
+    const load_entry *x = (const load_entry *) a, *y = (const load_entry *) b;
+    if (x->sec != y->sec)
+        return (x->sec > y->sec) - (x->sec < y->sec);
+    return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+/* Parse one log line. Returns 0 if it is a GET request, or -1 otherwise. */
+static int
+replay_parse_line(char *line, load_entry *le)
+{
+    char method[16], path[REPLAY_LINE_MAX];
+    le->sec = -1;
+    le->e.size = -1;
+    le->e.status = 0;
+
+    char *req = strchr(line, '"');
+    if (req != NULL) {
+        /* Combined Log Format */
+        char *ts = strchr(line, '[');
+        if (ts != NULL && ts < req) {
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            if (strptime(ts + 1, "%d/%b/%Y:%H:%M:%S %z", &tm) != NULL)
+                le->sec = timegm(&tm) - tm.tm_gmtoff;
+        }
+
+        if (sscanf(req + 1, "%15s %8191s", method, path) != 2)
+            return -1;
+
+        char *end = strchr(req + 1, '"');
+        if (end != NULL) {
+            int status;
+            long long size;
+            int n = sscanf(end + 1, "%d %lld", &status, &size);
+            if (n >= 1)
+                le->e.status = status;
+            if (n == 2)
+                le->e.size = size;
+        }
+    }
+    else {
+        /* "(host, port) METHOD PATH VERSION" */
+        char *p = strchr(line, ')');
+        if (line[0] != '(' || p == NULL || sscanf(p + 1, "%15s %8191s", method, path) != 2)
+            return -1;
+    }
+
+    if (strcmp(method, "GET") || path[0] != '/')
+        return -1;
+
+    le->e.path = strdup(path);
+    if (le->e.path == NULL)
+        errExit("replay_parse_line(): strdup()");
+
+    return 0;
+}
+
+/* Load the GET requests of an access log, ordered by arrival time. Requests
+   without a logged time arrive at 'rate' requests per second. Returns the
+   requests, and their number in 'num_entries', or NULL on error. */
+replay_entry *
+replay_load(const char *file, double rate, size_t *num_entries)
+{
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL) {
+        errMsg("replay_load(): Failed to open %s", file);
+        return NULL;
+    }
+
+    load_entry *les = NULL;
+    size_t n = 0, size = 0;
+    char line[REPLAY_LINE_MAX];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (n == size) {
+            size = (size == 0) ? 1024 : 2 * size;
+            load_entry *tmp = (load_entry *) realloc(les, size * sizeof(*les));
+            if (tmp == NULL)
+                errExit("replay_load(): realloc()");
+            les = tmp;
+        }
+        if (replay_parse_line(line, &les[n]) == 0) {
+            les[n].idx = n;
+            n++;
+        }
+    }
+    fclose(fp);
+
+    if (n == 0) {
+        errMsg("replay_load(): No GET requests in %s", file);
+        free(les);
+        return NULL;
+    }
+
+    /* Per-thread log buffers may write lines slightly out of order */
+    qsort(les, n, sizeof(*les), compare_load_entry);
+
+    replay_entry *entries = (replay_entry *) malloc(n * sizeof(*entries));
+    if (entries == NULL)
+        errExit("replay_load(): malloc()");
+
+    uint64_t interval_ns = (uint64_t) (1e9 / rate);
+    size_t i = 0, untimed = 0;
+
+    /* Untimed entries sort first */
+    time_t first_sec = les[n - 1].sec;
+    for (i = 0; i < n; i++) {
+        if (les[i].sec != -1) {
+            first_sec = les[i].sec;
+            break;
+        }
+    }
+
+    i = 0;
+    while (i < n) {
+        if (les[i].sec == -1) {
+            les[i].e.time_ns = untimed++ * interval_ns;
+            entries[i] = les[i].e;
+            i++;
+            continue;
+        }
+
+        /* Spread the requests of one second evenly over it */
+        size_t j = i;
+        while (j < n && les[j].sec == les[i].sec)
+            j++;
+        size_t k;
+        for (k = i; k < j; k++) {
+            les[k].e.time_ns = (uint64_t) (les[k].sec - first_sec) * 1000000000
+                               + (k - i) * 1000000000 / (j - i);
+            entries[k] = les[k].e;
+        }
+        i = j;
+    }
+    free(les);
+
+    *num_entries = n;
+    return entries;
+}
+
+/* Create the directories leading to 'path' */
+static int
+make_parent_dirs(char *path)
+{
+    char *p;
+    for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int r = mkdir(path, 0755);
+        *p = '/';
+        if (r == -1 && errno != EEXIST)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+hex_digit(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Decode the %XX escapes of the request target 'uri' into 'path' of 'size'
+   bytes, up to the query string, as the server does before resolving it.
+   Returns the length of 'path', or -1 if an escape is invalid or encodes a
+   null byte (the server refuses those) or 'path' is too small. */
+static int
+decode_path(const char *uri, char *path, size_t size)
+{
+    size_t n = 0;
+    const char *p;
+    for (p = uri; *p != '\0' && *p != '?'; p++) {
+        int c = (unsigned char) *p;
+        if (c == '%') {
+            int hi = hex_digit((unsigned char) p[1]);
+            int lo = (hi == -1) ? -1 : hex_digit((unsigned char) p[2]);
+            if (lo == -1)
+                return -1;
+            c = (hi << 4) | lo;
+            if (c == '\0')
+                return -1;
+            p += 2;
+        }
+        if (n + 1 >= size)
+            return -1;
+        path[n++] = c;
+    }
+    path[n] = '\0';
+    return n;
+}
+
+/* Create a file of 'size' bytes */
+static int
+make_file(const char *path, long long size)
+{
+    static char fill[REPLAY_FILL_SIZE];
+    if (fill[0] == '\0')
+        memset(fill, 'x', sizeof(fill));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    while (size > 0) {
+        ssize_t n = write(fd, fill, min(size, (long long) sizeof(fill)));
+        if (n == -1) {
+            close(fd);
+            return -1;
+        }
+        size -= n;
+    }
+
+    return close(fd);
+}
+
+/* Create under 'dir' one file per logged path, of the largest size logged for
+   a successful response to it, or of 'default_size' if no size was logged.
+   Paths are percent-decoded as the server does, and those ending in '/'
+   get an index.html. Returns the number of files created,
+   or -1 on error. */
+int
+replay_make_docroot(const replay_entry *entries, size_t num_entries, const char *dir, long long default_size)
+{
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        errMsg("replay_make_docroot(): Failed to create %s", dir);
+        return -1;
+    }
+
+    /* Find the size of each path, creating files for the first occurrence of
+       each and growing them if a later occurrence is larger */
+    int num_files = 0;
+    size_t i;
+    for (i = 0; i < num_entries; i++) {
+        const replay_entry *e = &entries[i];
+        if (e->status != 0 && e->status != 200)
+            continue;
+
+        /* The file is named by the decoded path, which the server opens */
+        char decoded[PATH_MAX], path[PATH_MAX];
+        int len = decode_path(e->path, decoded, sizeof(decoded));
+        if (len <= 0 || strstr(decoded, "..") != NULL || len + strlen(dir) + 12 >= sizeof(path))
+            continue;
+        snprintf(path, sizeof(path), "%s%s%s", dir, decoded,
+                 (decoded[len - 1] == '/') ? "index.html" : "");
+
+        long long size = (e->size >= 0) ? e->size : default_size;
+        struct stat sbuf;
+        int exists = (stat(path, &sbuf) == 0);
+        if (exists && sbuf.st_size >= size)
+            continue;
+
+        if (make_parent_dirs(path) == -1 || make_file(path, size) == -1) {
+            errMsg("replay_make_docroot(): Failed to create %s", path);
+            return -1;
+        }
+        if (!exists)
+            num_files++;
+    }
+
+    return num_files;
+}
@@ -0,0 +1,24 @@
+/* replay.h
+
+   Header file for replay.c
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A GET request read from an access log */
+typedef struct {
+    char *path;                 /* URL path, with the query string if any */
+    uint64_t time_ns;           /* Arrival time, relative to the first request */
+    long long size;             /* Logged response body size, or -1 if unknown */
+    int status;                 /* Logged status code, or 0 if unknown */
+} replay_entry;
+
+replay_entry *replay_load(const char *file, double rate, size_t *num_entries);
+
+int replay_make_docroot(const replay_entry *entries, size_t num_entries, const char *dir, long long default_size);
+
+#endif
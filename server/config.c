@@ -0,0 +1,638 @@
+/* config.c
+ *
+ * Server settings
+ *
+ * Every setting has a long command line option and a config file key of the
+ * same name, and the most tuned ones a short option too. The settings are
+ * taken, in increasing order of precedence, from the defaults below, the
+ * config file given with -c, and the command line. Counts and sizes left at
+ * 0 ("auto") are then derived from the machine: the number of online CPUs
+ * and the kernel's limit on the listen backlog. The settings are checked
+ * together at startup, so that a bad value fails there rather than under
+ * load; -t checks and prints them without starting the server.
+ *
+ * The config file has one "name = value" per line. Blank lines and lines
+ * starting with '#' are ignored.
+*/
+#define _GNU_SOURCE     /* For getopt_long() */
+
+#include "../utils/tlpi_hdr.h"
+#include "../utils/affinity.h"
+#include "../utils/utils.h"
+#include "../utils/async_log.h"
+#include "../threadpool/threadpool.h"
+#include "config.h"
+#include <ctype.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#define CONFIG_LINE_MAX 1024
+#define CONFIG_SOMAXCONN_PATH "/proc/sys/net/core/somaxconn"
+
+/* Threads of a serving process writing to its logs besides the workers: the
+   event loop, the signal handling thread and the threads of the access, slow
+   and error logs, which report their own failures to the error log */
+#define CONFIG_OTHER_LOG_THREADS 5
+#define CONFIG_MAX_THREADS (ALOG_MAX_RINGS - CONFIG_OTHER_LOG_THREADS)
+
+
+/* ========================== OPTIONS ============================ */
+
+
+typedef enum {
+    CFG_UINT,           /* unsigned int within [min, max] */
+    CFG_SIZE,           /* size_t within [min, max], with an optional K, M or G suffix */
+    CFG_BOOL,           /* 0/1, no/yes, off/on, false/true */
+    CFG_STR,
+    CFG_SCHED,          /* fifo, any, sff or sff_aging */
+    CFG_AFFINITY,       /* none, physical or list */
+    CFG_ACTION          /* Command line only, no value */
+} config_type;
+
+typedef struct {
+    const char *name;
+    int short_opt;      /* 0 if none */
+    config_type type;
+    size_t offset;      /* Of the setting in server_config */
+    unsigned long long min, max;
+    const char *help;
+} config_opt;
+
+#define OPT(field) offsetof(server_config, field)
+
+static const config_opt options[] = {
+    { "config", 'c', CFG_STR, OPT(config_file), 0, 0,
+      "Read settings from this file" },
+    { "service", 'p', CFG_STR, OPT(service), 0, 0,
+      "Port or service name to listen on" },
+    { "backlog", 'b', CFG_UINT, OPT(backlog), 0, INT_MAX,
+      "Listen backlog (auto: net.core.somaxconn)" },
+    { "docroot", 'd', CFG_STR, OPT(docroot), 0, 0,
+      "Directory the files are served from" },
+    { "pack", 0, CFG_STR, OPT(pack), 0, 0,
+      "Serve from this archive built by tools/mkpack instead of the document root files. Reloaded on SIGHUP" },
+
+    { "worker-processes", 'P', CFG_UINT, OPT(worker_processes), 0, 1024,
+      "Serving processes. 1 serves in the main process, 0 starts one per CPU" },
+    { "threads", 'n', CFG_UINT, OPT(num_threads), 0, 4096,
+      "Worker threads per serving process (auto: CPUs per process)" },
+    { "max-jobs", 'q', CFG_UINT, OPT(max_num_jobs), 0, 1 << 24,
+      "Capacity of the job queue (auto: 25 per thread)" },
+    { "sched", 0, CFG_SCHED, OPT(sched), 0, 0,
+      "Job order: fifo, any, sff (shortest file first) or sff_aging" },
+    { "sched-max-wait-ms", 0, CFG_UINT, OPT(sched_max_wait_ms), 1, 3600000,
+      "Starvation bound of sff_aging" },
+    { "defer-accept-secs", 0, CFG_UINT, OPT(defer_accept_secs), 0, 3600,
+      "Wait this long for the request before accept() returns (sff policies)" },
+    { "affinity", 0, CFG_AFFINITY, OPT(affinity), 0, 0,
+      "Worker placement: none, physical or list" },
+    { "cpu-list", 0, CFG_STR, OPT(cpu_list), 0, 0,
+      "CPUs to pin workers to with affinity list, e.g. 0-3,8" },
+    { "max-spin-us", 0, CFG_UINT, OPT(max_spin_us), 0, 1000000,
+      "Longest time idle workers spin before blocking. 0 disables spinning" },
+    { "accept-batch", 0, CFG_UINT, OPT(accept_batch), 1, 65536,
+      "Maximum connections accepted per wakeup of the listening socket" },
+    { "perf-counters", 0, CFG_BOOL, OPT(perf_counters), 0, 1,
+      "Count cycles, instructions, cache misses and context switches per request" },
+
+    { "read-buf-size", 'B', CFG_SIZE, OPT(read_buf_size), 512, 16 << 20,
+      "Size of the read buffer of a connection, and so the longest request line and headers" },
+    { "slow-log-ring-size", 0, CFG_SIZE, OPT(slow_log_ring_size), 4096, 1 << 30,
+      "Per worker buffer of the slow request log; lines beyond it are dropped" },
+    { "rate-clients", 0, CFG_UINT, OPT(rate_clients), 1, 1 << 26,
+      "Client addresses tracked at once by the rate limiter" },
+
+    { "header-timeout-ms", 0, CFG_UINT, OPT(header_timeout_ms), 1, 3600000,
+      "Time to receive the request line and headers" },
+    { "body-timeout-ms", 0, CFG_UINT, OPT(body_timeout_ms), 1, 3600000,
+      "Time to receive a request body" },
+    { "idle-timeout-ms", 0, CFG_UINT, OPT(idle_timeout_ms), 1, 3600000,
+      "Time a keep-alive connection may wait for its next request" },
+    { "write-timeout-ms", 0, CFG_UINT, OPT(write_timeout_ms), 0, 3600000,
+      "Longest a write to a client may block without progress. 0 for no limit" },
+    { "timer-tick-ms", 0, CFG_UINT, OPT(timer_tick_ms), 1, 1000,
+      "Resolution of the connection timeouts" },
+    { "drain-timeout-ms", 0, CFG_UINT, OPT(drain_timeout_ms), 0, 3600000,
+      "Time given to in-flight requests to complete on shutdown" },
+    { "upgrade-timeout-ms", 0, CFG_UINT, OPT(upgrade_timeout_ms), 1, 3600000,
+      "Time given to a new binary started by SIGUSR2 to start serving" },
+    { "restart-delay-ms", 0, CFG_UINT, OPT(restart_delay_ms), 0, 3600000,
+      "Least time between starts of a serving process that keeps dying" },
+
+    { "shed-target-ms", 0, CFG_UINT, OPT(shed_target_ms), 0, 60000,
+      "Queueing delay above which new connections get a 503. 0 never sheds" },
+    { "shed-interval-ms", 0, CFG_UINT, OPT(shed_interval_ms), 1, 60000,
+      "Time the queueing delay must stay above shed-target-ms" },
+    { "rate-limit", 0, CFG_UINT, OPT(rate_limit), 0, 1000000000,
+      "Requests per second allowed per client address (429 above). 0 for no limit" },
+    { "rate-burst", 0, CFG_UINT, OPT(rate_burst), 1, 1000000000,
+      "Requests a client address may make at once" },
+
+    { "access-log", 0, CFG_STR, OPT(access_log_path), 0, 0,
+      "Access log file, or - for standard output" },
+    { "access-log-rotate-bytes", 0, CFG_SIZE, OPT(access_log_rotate_bytes), 0, SIZE_MAX,
+      "Size at which the access log is rotated. 0 never rotates" },
+    { "slow-log", 0, CFG_STR, OPT(slow_log_path), 0, 0,
+      "Slow request log file, or - for standard output" },
+    { "slow-log-ms", 0, CFG_UINT, OPT(slow_log_ms), 0, 3600000,
+      "Log the requests that take longer than this. 0 disables the slow request log" },
+    { "slow-log-rotate-bytes", 0, CFG_SIZE, OPT(slow_log_rotate_bytes), 0, SIZE_MAX,
+      "Size at which the slow request log is rotated. 0 never rotates" },
+    { "status-url", 0, CFG_STR, OPT(status_url), 0, 0,
+      "URL of the statistics page (?format=prometheus for Prometheus). Empty to disable" },
+    { "stat-headers", 0, CFG_BOOL, OPT(stat_headers), 0, 1,
+      "Add the Stat-req-* and Stat-thread-* headers to file responses" },
+
+    { "warmup", 0, CFG_BOOL, OPT(warmup), 0, 1,
+      "Load the files into the caches before accepting connections" },
+    { "warmup-manifest", 0, CFG_STR, OPT(warmup_manifest), 0, 0,
+      "File listing the paths to warm up, one per line. Empty for the whole document root" },
+    { "warmup-max-bytes", 0, CFG_SIZE, OPT(warmup_max_bytes), 0, SIZE_MAX,
+      "Most bytes the warmup reads into the page cache. 0 for no limit" },
+
+    { "daemon", 0, CFG_BOOL, OPT(daemon), 0, 1,
+      "Detach from the terminal and run in the background" },
+    { "pid-file", 0, CFG_STR, OPT(pid_file), 0, 0,
+      "Write the process ID of the server to this file. Empty for none" },
+    { "error-log", 0, CFG_STR, OPT(error_log), 0, 0,
+      "Error messages: a file, - for standard error, or syslog (auto: syslog with daemon)" },
+
+    { "test", 't', CFG_ACTION, OPT(check_only), 0, 0,
+      "Check the settings, print them and exit" },
+    { "help", 'h', CFG_ACTION, 0, 0, 0,
+      "Print this help and exit" },
+};
+
+#define NUM_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+static const char *sched_names[] = { "fifo", "any", "sff", "sff_aging" };
+static const char *affinity_names[] = { "none", "physical", "list" };
+
+
+static void
+config_defaults(server_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+
+    cfg->service = "http";
+    cfg->backlog = 0;
+    cfg->docroot = ".";
+    cfg->pack = "";
+
+    cfg->worker_processes = 1;
+    cfg->num_threads = 0;
+    cfg->max_num_jobs = 0;
+    cfg->sched = THPOOL_SCHED_FIFO;
+    cfg->sched_max_wait_ms = 200;
+    cfg->defer_accept_secs = 1;
+    cfg->affinity = AFFINITY_NONE;
+    cfg->cpu_list = "0-3";
+    cfg->max_spin_us = 50;
+    cfg->accept_batch = 64;
+    cfg->perf_counters = 0;
+
+    cfg->read_buf_size = BUF_SIZE;
+    cfg->slow_log_ring_size = 64*1024;
+    cfg->rate_clients = 65536;
+
+    cfg->header_timeout_ms = 10000;
+    cfg->body_timeout_ms = 10000;
+    cfg->idle_timeout_ms = 5000;
+    cfg->write_timeout_ms = 30000;
+    cfg->timer_tick_ms = 10;
+    cfg->drain_timeout_ms = 5000;
+    cfg->upgrade_timeout_ms = 10000;
+    cfg->restart_delay_ms = 1000;
+
+    cfg->shed_target_ms = 20;
+    cfg->shed_interval_ms = 100;
+    cfg->rate_limit = 0;
+    cfg->rate_burst = 50;
+
+    cfg->access_log_path = "-";
+    cfg->access_log_rotate_bytes = 64*1024*1024;
+    cfg->slow_log_path = "-";
+    cfg->slow_log_ms = 1000;
+    cfg->slow_log_rotate_bytes = 16*1024*1024;
+    cfg->status_url = "/server-status";
+    cfg->stat_headers = 0;
+
+    cfg->warmup = 0;
+    cfg->warmup_manifest = "";
+    cfg->warmup_max_bytes = 1024*1024*1024;
+
+    cfg->daemon = 0;
+    cfg->pid_file = "";
+    cfg->error_log = "";
+}
+
+
+/* ========================== PARSING ============================ */
+
+
+/* Look up a name among 'n' 'names'. Returns its index, or -1 if not found. */
+static int
+config_lookup(const char *value, const char **names, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        if (!strcasecmp(value, names[i]))
+            return i;
+    }
+    return -1;
+}
+
+/* Set option 'o' of 'cfg' to 'value'. 'where' prefixes the error messages.
+   Returns 0, or -1 if the value is invalid. */
+static int
+config_set(server_config *cfg, const config_opt *o, const char *value, const char *where)
+{
+    void *field = (char *) cfg + o->offset;
+    char *end;
+    unsigned long long n;
+
+    switch (o->type) {
+        case CFG_UINT:
+        case CFG_SIZE:
+            errno = 0;
+            n = strtoull(value, &end, 10);
+            int shift = 0;
+            if (o->type == CFG_SIZE && end != value) {
+                switch (toupper((unsigned char) *end)) {
+                    case 'K': shift = 10; end++; break;
+                    case 'M': shift = 20; end++; break;
+                    case 'G': shift = 30; end++; break;
+                }
+            }
+            if (errno != 0 || end == value || *end != '\0' || value[0] == '-') {
+                fprintf(stderr, "%s: %s: Invalid number '%s'\n", where, o->name, value);
+                return -1;
+            }
+            /* Checked before shifting, which could wrap around */
+            if (n > (o->max >> shift)) {
+                fprintf(stderr, "%s: %s: %s is out of range [%llu, %llu]\n", where, o->name, value, o->min, o->max);
+                return -1;
+            }
+            n <<= shift;
+            if (n < o->min || n > o->max) {
+                fprintf(stderr, "%s: %s: %llu is out of range [%llu, %llu]\n", where, o->name, n, o->min, o->max);
+                return -1;
+            }
+            if (o->type == CFG_UINT)
+                *(unsigned int *) field = n;
+            else
+                *(size_t *) field = n;
+            return 0;
+
+        case CFG_BOOL:
+            if (!strcmp(value, "1") || !strcasecmp(value, "yes") || !strcasecmp(value, "on") || !strcasecmp(value, "true"))
+                *(int *) field = 1;
+            else if (!strcmp(value, "0") || !strcasecmp(value, "no") || !strcasecmp(value, "off") || !strcasecmp(value, "false"))
+                *(int *) field = 0;
+            else {
+                fprintf(stderr, "%s: %s: Expected yes or no, not '%s'\n", where, o->name, value);
+                return -1;
+            }
+            return 0;
+
+        case CFG_STR:
+            *(const char **) field = strdup(value);
+            if (*(const char **) field == NULL) {
+                errMsg("config_set(): strdup()");
+                return -1;
+            }
+            return 0;
+
+        case CFG_SCHED:
+            n = config_lookup(value, sched_names, sizeof(sched_names) / sizeof(sched_names[0]));
+            if ((int) n == -1) {
+                fprintf(stderr, "%s: %s: Unknown policy '%s'\n", where, o->name, value);
+                return -1;
+            }
+            *(int *) field = n;
+            return 0;
+
+        case CFG_AFFINITY:
+            n = config_lookup(value, affinity_names, sizeof(affinity_names) / sizeof(affinity_names[0]));
+            if ((int) n == -1) {
+                fprintf(stderr, "%s: %s: Unknown placement '%s'\n", where, o->name, value);
+                return -1;
+            }
+            *(int *) field = n;
+            return 0;
+
+        case CFG_ACTION:
+            break;
+    }
+
+    fprintf(stderr, "%s: %s: Not a setting\n", where, o->name);
+    return -1;
+}
+
+/* Apply the settings of the config file 'path'. Returns 0, or -1 on error. */
+static int
+config_load(server_config *cfg, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        errMsg("config_load(): Failed to open config file %s", path);
+        return -1;
+    }
+
+    char line[CONFIG_LINE_MAX], where[PATH_MAX + 32];
+    int lineno = 0, ret = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        snprintf(where, sizeof(where), "%s:%d", path, lineno);
+
+        char *name = trimwhitespace(line);
+        if (name[0] == '\0' || name[0] == '#')
+            continue;
+
+        char *eq = strchr(name, '=');
+        if (eq == NULL) {
+            fprintf(stderr, "%s: Expected name = value\n", where);
+            ret = -1;
+            continue;
+        }
+        *eq = '\0';
+        name = trimwhitespace(name);
+        char *value = trimwhitespace(eq + 1);
+
+        const config_opt *o = NULL;
+        size_t i;
+        for (i = 0; i < NUM_OPTIONS; i++) {
+            if (!strcmp(options[i].name, name) && options[i].type != CFG_ACTION && options[i].offset != OPT(config_file))
+                o = &options[i];
+        }
+        if (o == NULL) {
+            fprintf(stderr, "%s: Unknown setting '%s'\n", where, name);
+            ret = -1;
+            continue;
+        }
+        if (config_set(cfg, o, value, where) == -1)
+            ret = -1;
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+static void
+config_usage(FILE *fp, const char *prog)
+{
+    fprintf(fp, "Usage: %s [options]\n\n", prog);
+    size_t i;
+    for (i = 0; i < NUM_OPTIONS; i++) {
+        const config_opt *o = &options[i];
+        char opt[64];
+        if (o->short_opt)
+            snprintf(opt, sizeof(opt), "-%c, --%s", o->short_opt, o->name);
+        else
+            snprintf(opt, sizeof(opt), "    --%s", o->name);
+        fprintf(fp, "  %-30s %s\n", opt, o->help);
+    }
+    fprintf(fp, "\nEvery option but -c, -t and -h can also be set in the config file as \"name = value\".\n"
+                "Run with -t to see the default and derived values.\n");
+}
+
+/* Fill 'cfg' from the defaults, the config file and the command line
+   arguments 'argv'. Exits after printing the help with -h. Returns 0, or -1
+   on error. */
+int
+config_parse(server_config *cfg, int argc, char *argv[])
+{
+    config_defaults(cfg);
+
+    struct option longopts[NUM_OPTIONS + 1];
+    char shortopts[2 * NUM_OPTIONS + 1];
+    size_t i, len = 0;
+    for (i = 0; i < NUM_OPTIONS; i++) {
+        longopts[i].name = options[i].name;
+        longopts[i].has_arg = (options[i].type == CFG_ACTION) ? no_argument : required_argument;
+        longopts[i].flag = NULL;
+        longopts[i].val = options[i].short_opt ? options[i].short_opt : 256 + i;
+        if (options[i].short_opt) {
+            shortopts[len++] = options[i].short_opt;
+            if (options[i].type != CFG_ACTION)
+                shortopts[len++] = ':';
+        }
+    }
+    memset(&longopts[NUM_OPTIONS], 0, sizeof(longopts[0]));
+    shortopts[len] = '\0';
+
+    /* The config file first, so that the command line overrides it */
+    int opt;
+    opterr = 0;
+    while ((opt = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
+        if (opt == 'c')
+            cfg->config_file = optarg;
+    }
+    if (cfg->config_file != NULL && config_load(cfg, cfg->config_file) == -1)
+        return -1;
+
+    optind = 0;         /* Rescan from the start */
+    opterr = 1;
+    int ret = 0;
+    while ((opt = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
+        const config_opt *o = NULL;
+        for (i = 0; i < NUM_OPTIONS; i++) {
+            if (opt == (options[i].short_opt ? options[i].short_opt : 256 + (int) i))
+                o = &options[i];
+        }
+        if (o == NULL) {
+            config_usage(stderr, argv[0]);
+            return -1;
+        }
+
+        if (o->short_opt == 'h') {
+            config_usage(stdout, argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        else if (o->type == CFG_ACTION) {
+            *(int *) ((char *) cfg + o->offset) = 1;
+        }
+        else if (o->short_opt != 'c' && config_set(cfg, o, optarg, "Command line") == -1) {
+            ret = -1;
+        }
+    }
+    if (optind < argc) {
+        fprintf(stderr, "Command line: Unexpected argument '%s'\n", argv[optind]);
+        config_usage(stderr, argv[0]);
+        return -1;
+    }
+
+    return ret;
+}
+
+
+/* ========================== VALIDATION ============================ */
+
+
+/* Return the kernel's limit on the listen backlog */
+static unsigned int
+config_somaxconn(void)
+{
+    unsigned int n = SOMAXCONN;
+    FILE *fp = fopen(CONFIG_SOMAXCONN_PATH, "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%u", &n) != 1)
+            n = SOMAXCONN;
+        fclose(fp);
+    }
+    return n;
+}
+
+/* Make the file path '*path_p' of a setting absolute, against the working
+directory (the directory the server is started in), so that it still names
+the same file once the server is in the document root. "-" and empty paths
+are left as they are. Returns 0, or -1 on error. */
+static int
+config_abs_path(const char **path_p)
+{
+    const char *path = *path_p;
+    if (path[0] == '\0' || path[0] == '/' || !strcmp(path, "-"))
+        return 0;
+
+    char cwd[PATH_MAX];
+    char *abs_path;
+    if (getcwd(cwd, sizeof(cwd)) == NULL || asprintf(&abs_path, "%s/%s", cwd, path) == -1)
+        return -1;
+    *path_p = abs_path;
+    return 0;
+}
+
+/* Derive the auto settings of 'cfg', and check that the settings go
+   together. Returns 0, or -1 if they don't. */
+int
+config_finish(server_config *cfg)
+{
+    int ret = 0;
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+    unsigned int somaxconn = config_somaxconn();
+
+    if (cfg->worker_processes == 0)
+        cfg->worker_processes = ncpus;
+    if (cfg->num_threads == 0)
+        cfg->num_threads = min(max(1, ncpus / (long) cfg->worker_processes), CONFIG_MAX_THREADS);
+    if (cfg->max_num_jobs == 0)
+        cfg->max_num_jobs = 25 * cfg->num_threads;
+    if (cfg->error_log[0] == '\0')
+        cfg->error_log = cfg->daemon ? "syslog" : "-";
+    if (cfg->backlog == 0)
+        cfg->backlog = somaxconn;
+    else if (cfg->backlog > somaxconn)
+        fprintf(stderr, "Warning: backlog %u is capped by net.core.somaxconn to %u\n", cfg->backlog, somaxconn);
+
+    /* Each thread writing to a log needs a ring buffer of its own, and the
+       lines of those beyond the last would be dropped */
+    if (cfg->num_threads > CONFIG_MAX_THREADS) {
+        fprintf(stderr, "threads: %u is more than the %d threads a log can be written by\n",
+                cfg->num_threads, CONFIG_MAX_THREADS);
+        ret = -1;
+    }
+
+    if (cfg->service[0] == '\0') {
+        fprintf(stderr, "service: Must not be empty\n");
+        ret = -1;
+    }
+
+    struct stat sbuf;
+    if (stat(cfg->docroot, &sbuf) == -1 || !S_ISDIR(sbuf.st_mode) || access(cfg->docroot, R_OK | X_OK) == -1) {
+        fprintf(stderr, "docroot: %s is not a readable directory\n", cfg->docroot);
+        ret = -1;
+    }
+
+    if (cfg->affinity == AFFINITY_LIST) {
+        int cpus[AFFINITY_MAX_CPUS];
+        if (affinity_parse_cpu_list(cfg->cpu_list, cpus, AFFINITY_MAX_CPUS) <= 0) {
+            fprintf(stderr, "cpu-list: Invalid CPU list '%s'\n", cfg->cpu_list);
+            ret = -1;
+        }
+    }
+
+    if (cfg->timer_tick_ms > cfg->header_timeout_ms || cfg->timer_tick_ms > cfg->idle_timeout_ms) {
+        fprintf(stderr, "timer-tick-ms: %u is coarser than the header or idle timeout\n", cfg->timer_tick_ms);
+        ret = -1;
+    }
+
+    if (cfg->status_url[0] != '\0' && cfg->status_url[0] != '/') {
+        fprintf(stderr, "status-url: '%s' must start with '/'\n", cfg->status_url);
+        ret = -1;
+    }
+
+    /* The logs are opened, and reopened and rotated, after the chdir():
+       a relative path would put them in the document root, where they
+       could be downloaded */
+    if (config_abs_path(&cfg->access_log_path) == -1 || config_abs_path(&cfg->slow_log_path) == -1) {
+        fprintf(stderr, "Failed to resolve the log paths: %s\n", strerror(errno));
+        ret = -1;
+    }
+
+    /* The archive is reloaded from the same path after the chdir() */
+    if (cfg->pack[0] != '\0') {
+        char *path = realpath(cfg->pack, NULL);
+        if (path == NULL || access(path, R_OK) == -1) {
+            fprintf(stderr, "pack: %s is not readable\n", cfg->pack);
+            ret = -1;
+        }
+        else {
+            cfg->pack = path;
+        }
+    }
+
+    /* The manifest is read after the chdir(): resolve it against the
+       directory the server is started in, like the other paths */
+    if (cfg->warmup && cfg->warmup_manifest[0] != '\0') {
+        char *path = realpath(cfg->warmup_manifest, NULL);
+        if (path == NULL || access(path, R_OK) == -1) {
+            fprintf(stderr, "warmup-manifest: %s is not readable\n", cfg->warmup_manifest);
+            ret = -1;
+        }
+        else {
+            cfg->warmup_manifest = path;
+        }
+    }
+
+    return ret;
+}
+
+/* Print the settings of 'cfg' in the config file format */
+void
+config_print(FILE *fp, const server_config *cfg)
+{
+    size_t i;
+    for (i = 0; i < NUM_OPTIONS; i++) {
+        const config_opt *o = &options[i];
+        const void *field = (const char *) cfg + o->offset;
+        switch (o->type) {
+            case CFG_UINT:
+                fprintf(fp, "%s = %u\n", o->name, *(const unsigned int *) field);
+                break;
+            case CFG_SIZE:
+                fprintf(fp, "%s = %zu\n", o->name, *(const size_t *) field);
+                break;
+            case CFG_BOOL:
+                fprintf(fp, "%s = %s\n", o->name, *(const int *) field ? "yes" : "no");
+                break;
+            case CFG_STR:
+                if (o->offset != OPT(config_file))
+                    fprintf(fp, "%s = %s\n", o->name, *(const char * const *) field);
+                break;
+            case CFG_SCHED:
+                fprintf(fp, "%s = %s\n", o->name, sched_names[*(const int *) field]);
+                break;
+            case CFG_AFFINITY:
+                fprintf(fp, "%s = %s\n", o->name, affinity_names[*(const int *) field]);
+                break;
+            case CFG_ACTION:
+                break;
+        }
+    }
+}
@@ -0,0 +1,86 @@
+/************************************************\
+ * Header file for config.c                     *
+\************************************************/
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Worker placement */
+enum { AFFINITY_NONE, AFFINITY_PHYSICAL, AFFINITY_LIST };
+
+/* Server settings. Sizes and counts of 0 marked "auto" are derived from the
+   machine by config_finish(). */
+typedef struct {
+    /* Listening socket and files */
+    const char *config_file;
+    const char *service;
+    unsigned int backlog;               /* auto: net.core.somaxconn */
+    const char *docroot;
+    const char *pack;                   /* Archive served instead of the document root files. Empty for none */
+
+    /* Processes and threads */
+    unsigned int worker_processes;      /* 0: one per CPU */
+    unsigned int num_threads;           /* auto: CPUs per serving process */
+    unsigned int max_num_jobs;          /* auto: 25 per thread */
+    int sched;                          /* THPOOL_SCHED_* */
+    unsigned int sched_max_wait_ms;
+    unsigned int defer_accept_secs;
+    int affinity;                       /* AFFINITY_* */
+    const char *cpu_list;
+    unsigned int max_spin_us;
+    unsigned int accept_batch;
+    int perf_counters;
+
+    /* Buffers and tables */
+    size_t read_buf_size;
+    size_t slow_log_ring_size;
+    unsigned int rate_clients;
+
+    /* Timeouts */
+    unsigned int header_timeout_ms;
+    unsigned int body_timeout_ms;
+    unsigned int idle_timeout_ms;
+    unsigned int write_timeout_ms;
+    unsigned int timer_tick_ms;
+    unsigned int drain_timeout_ms;
+    unsigned int upgrade_timeout_ms;
+    unsigned int restart_delay_ms;
+
+    /* Overload */
+    unsigned int shed_target_ms;
+    unsigned int shed_interval_ms;
+    unsigned int rate_limit;
+    unsigned int rate_burst;
+
+    /* Logs and statistics */
+    const char *access_log_path;
+    size_t access_log_rotate_bytes;
+    const char *slow_log_path;
+    unsigned int slow_log_ms;
+    size_t slow_log_rotate_bytes;
+    const char *status_url;
+    int stat_headers;
+
+    /* Warmup */
+    int warmup;
+    const char *warmup_manifest;        /* Empty walks the document root */
+    size_t warmup_max_bytes;
+
+    /* Daemon */
+    int daemon;
+    const char *pid_file;               /* Empty for none */
+    const char *error_log;              /* auto: syslog as a daemon, else standard error */
+
+    int check_only;                     /* Validate and print the settings, then exit */
+} server_config;
+
+int config_parse(server_config *cfg, int argc, char *argv[]);
+
+int config_finish(server_config *cfg);
+
+void config_print(FILE *fp, const server_config *cfg);
+
+#endif
@@ -0,0 +1,568 @@
+/* event_loop.c
+ *
+ * Connection event loop
+ *
+ * The main thread accepts connections and keeps them in an epoll set until
+ * a request arrives. It reads the request line and headers into the read
+ * buffer of the connection as they arrive, without blocking, and only hands
+ * the connection to the thread pool once they are complete, so that a client
+ * sending them slowly never holds a worker. Between requests of a keep-alive
+ * connection, the worker hands the connection back. A connection waiting for
+ * a request thus costs no thread, and its timeout
+ * (header timeout for a new connection, idle timeout between requests) is a
+ * timer in a hierarchical timer wheel: arming and cancelling it are O(1),
+ * and the loop only wakes up for the timers that are due.
+ *
+ * Workers hand connections back through a locked list and an eventfd, since
+ * only the loop thread touches the epoll set and the timer wheel.
+ *
+ * While the thread pool is overloaded (see thpool_is_overloaded()), the
+ * first request of new connections is answered with a 503 by the loop
+ * itself, so that the queue drains and the connections already being served
+ * keep a bounded latency.
+ *
+ * With a rate limit, every request is charged to the address of its client,
+ * and the loop answers those over their limit with a 429: the first request
+ * of a connection right after accept(), before the connection costs
+ * anything more, the next ones when they arrive on the connection.
+*/
+#define _GNU_SOURCE     /* For accept4() */
+
+#include "../utils/tlpi_hdr.h"
+#include "../utils/utils.h"
+#include "../utils/timer_wheel.h"
+#include "../utils/trace.h"
+#include "../utils/rate_limit.h"
+#include "event_loop.h"
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define EVENT_LOOP_MAX_EVENTS 256   /* Events handled per epoll_wait() */
+#define EVENT_LOOP_BATCH 256        /* Connections handed to the thread pool at once */
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+struct event_loop {
+    int lfd;                        /* Listening socket */
+    int epfd;
+    int efd;                        /* eventfd signalling returned connections or a stop request */
+    threadpool thpool;
+    event_loop_opts opts;
+    int stopping;                   /* event_loop_run() must return */
+    timer_wheel timers;             /* Timeouts of the connections waiting for a request */
+    rate_limiter *limiter;          /* NULL without a rate limit */
+    rate_limiter *own_limiter;      /* 'limiter' if created by this event loop, else NULL */
+
+    pthread_mutex_t returned_mtx;
+    conn_t *returned;               /* Connections handed back by workers */
+    int closing;                    /* Connections handed back are closed instead */
+
+    thpool_work batch[EVENT_LOOP_BATCH];    /* Connections with a request, to hand to the thread pool */
+    unsigned int num_batch;
+};
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static void event_loop_accept(event_loop *loop);
+static void event_loop_wait_request(event_loop *loop, conn_t *conn, uint64_t timeout_ns);
+static void event_loop_ready(event_loop *loop, conn_t *conn);
+static int event_loop_read_request(event_loop *loop, conn_t *conn);
+static int event_loop_headers_end(const char *p, size_t len, size_t *scanned_p);
+static void event_loop_take_returned(event_loop *loop);
+static void event_loop_queue(event_loop *loop, conn_t *conn);
+static void event_loop_dispatch(event_loop *loop);
+static void event_loop_expire(tw_timer *t, void *arg);
+static void event_loop_close_conn(conn_t *conn);
+
+
+/* ========================== EVENT LOOP ============================ */
+
+
+/* Create an event loop serving the connections of the non-blocking listening
+   socket 'lfd' with 'thpool'. Returns NULL on error. */
+event_loop *
+event_loop_create(int lfd, threadpool thpool, const event_loop_opts *opts)
+{
+    event_loop *loop = (event_loop *) calloc(1, sizeof(*loop));
+    if (loop == NULL) {
+        errMsg("event_loop_create(): Failed to allocate memory for event loop");
+        return NULL;
+    }
+    loop->lfd = lfd;
+    loop->thpool = thpool;
+    loop->opts = *opts;
+    if (loop->opts.accept_batch == 0)
+        loop->opts.accept_batch = 1;
+    if (loop->opts.tick_ms == 0)
+        loop->opts.tick_ms = 1;
+    tw_init(&loop->timers, (uint64_t) loop->opts.tick_ms * 1000000, get_monotonic_ns());
+
+    if (loop->opts.limiter != NULL) {
+        loop->limiter = loop->opts.limiter;
+    }
+    else if (loop->opts.rate_limit > 0) {
+        loop->own_limiter = rl_create(loop->opts.rate_limit, loop->opts.rate_burst, loop->opts.rate_clients, 0);
+        if (loop->own_limiter == NULL) {
+            free(loop);
+            return NULL;
+        }
+        loop->limiter = loop->own_limiter;
+    }
+
+    if (pthread_mutex_init(&loop->returned_mtx, NULL) > 0) {
+        errMsg("event_loop_create(): Failed to initialize mutex");
+        rl_destroy(loop->own_limiter);
+        free(loop);
+        return NULL;
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epfd == -1 || loop->efd == -1) {
+        errMsg("event_loop_create(): Failed to create epoll instance or eventfd");
+        goto fail;
+    }
+
+    /* A connection on a listening socket shared with other processes wakes
+       only one of them, instead of all of them racing for it */
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &loop->lfd };
+    if (loop->opts.shared_listener)
+        ev.events |= EPOLLEXCLUSIVE;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, lfd, &ev) == -1) {
+        errMsg("event_loop_create(): Failed to add listening socket to epoll set");
+        goto fail;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->efd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->efd, &ev) == -1) {
+        errMsg("event_loop_create(): Failed to add eventfd to epoll set");
+        goto fail;
+    }
+
+    return loop;
+
+fail:
+    if (loop->epfd != -1)
+        close(loop->epfd);
+    if (loop->efd != -1)
+        close(loop->efd);
+    pthread_mutex_destroy(&loop->returned_mtx);
+    rl_destroy(loop->own_limiter);
+    free(loop);
+    return NULL;
+}
+
+/* Accept connections and hand their requests to the thread pool until
+   event_loop_stop() is called */
+void
+event_loop_run(event_loop *loop)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    while (!__atomic_load_n(&loop->stopping, __ATOMIC_ACQUIRE)) {
+        int timeout_ms = tw_next_timeout_ms(&loop->timers, get_monotonic_ns());
+        int n = epoll_wait(loop->epfd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+        if (n == -1) {
+            if (errno != EINTR)
+                errMsg("event_loop_run(): epoll_wait(): Failed to wait for events");
+            continue;
+        }
+
+        int i;
+        for (i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &loop->lfd) {
+                event_loop_accept(loop);
+            }
+            else if (ptr == &loop->efd) {
+                uint64_t value;
+                if (read(loop->efd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+                    errMsg("event_loop_run(): Failed to read eventfd");
+                event_loop_take_returned(loop);
+            }
+            else {
+                event_loop_ready(loop, (conn_t *) ptr);
+            }
+        }
+
+        tw_advance(&loop->timers, get_monotonic_ns(), event_loop_expire, loop);
+        event_loop_dispatch(loop);
+    }
+}
+
+/* Make event_loop_run() return. May be called from any thread. */
+void
+event_loop_stop(event_loop *loop)
+{
+    __atomic_store_n(&loop->stopping, 1, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    if (write(loop->efd, &one, sizeof(one)) == -1)
+        errMsg("event_loop_stop(): Failed to write eventfd");
+}
+
+/* Called by a worker thread once it has served a request on 'conn'. If
+   'keep_alive' is set, the connection goes back to its event loop to wait
+   for the next request; otherwise, or if the event loop is shutting down,
+   it is closed and freed. */
+void
+event_loop_release(conn_t *conn, int keep_alive)
+{
+    event_loop *loop = conn->loop;
+
+    if (keep_alive) {
+        int queued = 0, wake = 0;
+        pthread_mutex_lock(&loop->returned_mtx);
+        if (!loop->closing) {
+            conn->next = loop->returned;
+            loop->returned = conn;
+            wake = (conn->next == NULL);    /* The loop drains the whole list per wakeup */
+            queued = 1;
+        }
+        pthread_mutex_unlock(&loop->returned_mtx);
+
+        if (queued) {
+            uint64_t one = 1;
+            if (wake && write(loop->efd, &one, sizeof(one)) == -1)
+                errMsg("event_loop_release(): Failed to write eventfd");
+            return;
+        }
+    }
+
+    event_loop_close_conn(conn);
+}
+
+/* Close the connections waiting for a request, and make the workers close
+   theirs once served instead of handing them back. Called on shutdown,
+   after event_loop_run() returned. Returns the number of connections closed. */
+int
+event_loop_close_idle(event_loop *loop)
+{
+    pthread_mutex_lock(&loop->returned_mtx);
+    loop->closing = 1;
+    conn_t *conn = loop->returned;
+    loop->returned = NULL;
+    pthread_mutex_unlock(&loop->returned_mtx);
+
+    int num_closed = 0;
+    while (conn != NULL) {
+        conn_t *next = conn->next;
+        event_loop_close_conn(conn);
+        conn = next;
+        num_closed++;
+    }
+
+    /* Every connection waiting for a request has a pending timer */
+    uint64_t num_pending = loop->timers.num_pending;
+    tw_expire_all(&loop->timers, event_loop_expire, loop);
+
+    /* The connections that had a request are still served */
+    event_loop_dispatch(loop);
+
+    return num_closed + num_pending;
+}
+
+void
+event_loop_destroy(event_loop *loop)
+{
+    if (loop == NULL)
+        return;
+
+    event_loop_close_idle(loop);
+    close(loop->epfd);
+    close(loop->efd);
+    pthread_mutex_destroy(&loop->returned_mtx);
+    rl_destroy(loop->own_limiter);
+    free(loop);
+}
+
+
+/* ========================== CONNECTIONS ============================ */
+
+
+/* Accept the pending connections. Those whose request line and headers have
+   already arrived go to the thread pool at once. */
+static void
+event_loop_accept(event_loop *loop)
+{
+    unsigned int num_accepted;
+    for (num_accepted = 0; num_accepted < loop->opts.accept_batch; num_accepted++) {
+        conn_t *conn = (conn_t *) malloc(sizeof(*conn));
+        if (conn == NULL) {
+            errMsg("event_loop_accept(): Failed to allocate memory for connection");
+            return;
+        }
+
+        /* Keep the peer address for the access log */
+        conn->addrlen = sizeof(conn->addr);
+        int cfd = accept4(loop->lfd, (struct sockaddr *) &conn->addr, &conn->addrlen, SOCK_CLOEXEC);
+        if (cfd == -1) {
+            free(conn);
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !__atomic_load_n(&loop->stopping, __ATOMIC_ACQUIRE))
+                errMsg("event_loop_accept(): Failed to accept connection");
+            return;
+        }
+        TRACE2(accept, cfd, &conn->addr);
+
+        /* Turn away clients over their rate before spending anything more
+           on them */
+        uint64_t now = get_monotonic_ns();
+        if (loop->limiter != NULL && !rl_allow(loop->limiter, (struct sockaddr *) &conn->addr, now)) {
+            request_rate_limited(cfd);
+            close(cfd);
+            free(conn);
+            continue;
+        }
+
+        conn->fd = cfd;
+        conn->loop = loop;
+        conn->rbuf = NULL;
+        conn->scanned = 0;
+        conn->num_requests = 0;
+        conn->cpu = -1;
+        conn->registered = 0;
+        conn->next = NULL;
+        tw_timer_init(&conn->timer);
+
+        /* A response is written in several calls (headers, then body). On a
+           keep-alive connection, Nagle's algorithm would hold back the last
+           one until the client's delayed ACK of the previous response. */
+        int one = 1;
+        if (setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+            errMsg("event_loop_accept(): setsockopt(): Failed to set TCP_NODELAY");
+
+        /* The workers write with blocking calls: bound how long a client
+           that stops reading can hold one */
+        if (loop->opts.write_timeout_ms > 0) {
+            struct timeval tv = { .tv_sec = loop->opts.write_timeout_ms / 1000,
+                                  .tv_usec = (loop->opts.write_timeout_ms % 1000) * 1000 };
+            if (setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+                errMsg("event_loop_accept(): setsockopt(): Failed to set SO_SNDTIMEO");
+        }
+
+        /* Hand the connection preferably to the worker on the CPU that
+           processed its packets, so that both share the same caches */
+        if (loop->opts.incoming_cpu) {
+            int cpu;
+            socklen_t optlen = sizeof(cpu);
+            if (getsockopt(cfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &optlen) == 0)
+                conn->cpu = cpu;
+        }
+
+        conn->deadline_ns = now + (uint64_t) loop->opts.header_timeout_ms * 1000000;
+
+        int ret = event_loop_read_request(loop, conn);
+        if (ret == 1)
+            event_loop_queue(loop, conn);
+        else if (ret == 0)
+            event_loop_wait_request(loop, conn, conn->deadline_ns);
+    }
+}
+
+/* Wait for the next request on 'conn', closing it at 'timeout_ns' */
+static void
+event_loop_wait_request(event_loop *loop, conn_t *conn, uint64_t timeout_ns)
+{
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+    if (epoll_ctl(loop->epfd, conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+        errMsg("event_loop_wait_request(): Failed to add connection to epoll set");
+        event_loop_close_conn(conn);
+        return;
+    }
+    conn->registered = 1;
+    tw_add(&loop->timers, &conn->timer, timeout_ns);
+}
+
+/* A connection waiting for a request became readable, or was closed by the peer */
+static void
+event_loop_ready(event_loop *loop, conn_t *conn)
+{
+    tw_cancel(&loop->timers, &conn->timer);
+
+    /* The header timeout of the next request of a keep-alive connection
+       starts when it begins to arrive */
+    if (conn->num_requests > 0 && conn->rbuf == NULL)
+        conn->deadline_ns = get_monotonic_ns() + (uint64_t) loop->opts.header_timeout_ms * 1000000;
+
+    int ret = event_loop_read_request(loop, conn);
+    if (ret == 1)
+        event_loop_queue(loop, conn);
+    else if (ret == 0)
+        event_loop_wait_request(loop, conn, conn->deadline_ns);
+}
+
+/* Read what has arrived of the request on 'conn' into its read buffer,
+   without blocking. Returns 1 once the request line and headers have all
+   arrived, 0 while they are still expected, or -1 if the connection was
+   closed, by the peer or because the headers don't fit the read buffer. */
+static int
+event_loop_read_request(event_loop *loop, conn_t *conn)
+{
+    if (conn->rbuf == NULL) {
+        conn->rbuf = readBufAlloc(conn->fd, loop->opts.read_buf_size);
+        if (conn->rbuf == NULL) {
+            errMsg("event_loop_read_request(): Failed to allocate memory for read buffer");
+            event_loop_close_conn(conn);
+            return -1;
+        }
+        conn->scanned = 0;
+    }
+
+    rbuf_t *rb = conn->rbuf;
+    for (;;) {
+        if (rb->cnt > 0 && event_loop_headers_end(rb->bufptr, rb->cnt, &conn->scanned))
+            return 1;
+
+        if (rb->cnt >= (int) rb->size) {
+            request_too_large(conn->fd);
+            event_loop_close_conn(conn);
+            return -1;
+        }
+
+        ssize_t n = readBufFill(rb);
+        if (n > 0)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* Idle connections don't hold a read buffer */
+            if (rb->cnt == 0) {
+                free(conn->rbuf);
+                conn->rbuf = NULL;
+            }
+            return 0;
+        }
+
+        /* Peers mostly close idle keep-alive connections */
+        event_loop_close_conn(conn);
+        return -1;
+    }
+}
+
+/* Search the 'len' bytes of a request at 'p' for the CRLFCRLF ending its
+   headers, starting at '*scanned_p', which is advanced past the bytes that
+   can't be part of it. Returns 1 if found, else 0. */
+static int
+event_loop_headers_end(const char *p, size_t len, size_t *scanned_p)
+{
+    if (memmem(p + *scanned_p, len - *scanned_p, "\r\n\r\n", 4) != NULL)
+        return 1;
+    *scanned_p = (len > 3) ? len - 3 : 0;
+    return 0;
+}
+
+/* Take the connections handed back by the workers */
+static void
+event_loop_take_returned(event_loop *loop)
+{
+    pthread_mutex_lock(&loop->returned_mtx);
+    conn_t *conn = loop->returned;
+    loop->returned = NULL;
+    pthread_mutex_unlock(&loop->returned_mtx);
+
+    uint64_t now = get_monotonic_ns();
+    while (conn != NULL) {
+        conn_t *next = conn->next;
+        conn->next = NULL;
+        conn->scanned = 0;
+
+        if (conn->rbuf != NULL && conn->rbuf->cnt > 0) {
+            /* The client pipelined its next request */
+            conn->deadline_ns = now + (uint64_t) loop->opts.header_timeout_ms * 1000000;
+            int ret = event_loop_read_request(loop, conn);
+            if (ret == 1)
+                event_loop_queue(loop, conn);
+            else if (ret == 0)
+                event_loop_wait_request(loop, conn, conn->deadline_ns);
+        }
+        else {
+            /* Idle connections don't hold a read buffer */
+            free(conn->rbuf);
+            conn->rbuf = NULL;
+            event_loop_wait_request(loop, conn, now + (uint64_t) loop->opts.idle_timeout_ms * 1000000);
+        }
+        conn = next;
+    }
+}
+
+/* Add a connection with a request to the batch handed to the thread pool */
+static void
+event_loop_queue(event_loop *loop, conn_t *conn)
+{
+    if (loop->opts.shed && conn->num_requests == 0 && thpool_is_overloaded(loop->thpool)) {
+        request_shed(conn->fd);
+        event_loop_close_conn(conn);
+        return;
+    }
+
+    /* The first request was charged on accept */
+    if (loop->limiter != NULL && conn->num_requests > 0
+            && !rl_allow(loop->limiter, (struct sockaddr *) &conn->addr, get_monotonic_ns())) {
+        request_rate_limited(conn->fd);
+        event_loop_close_conn(conn);
+        return;
+    }
+
+    if (loop->num_batch == EVENT_LOOP_BATCH)
+        event_loop_dispatch(loop);
+
+    thpool_work *work = &loop->batch[loop->num_batch++];
+    work->arg = conn;
+    work->key = 0;
+    work->cpu = conn->cpu;
+
+    if (loop->opts.size_based)
+        work->key = request_peek_size(conn->rbuf->bufptr, conn->rbuf->cnt);
+}
+
+/* Assign the whole batch of connections to the thread pool */
+static void
+event_loop_dispatch(event_loop *loop)
+{
+    unsigned int num_batch = loop->num_batch;
+    if (num_batch == 0)
+        return;
+    loop->num_batch = 0;
+
+    int num_added = thpool_add_work_batch(loop->thpool, request_handle, loop->batch, num_batch);
+    if (num_added < (int) num_batch) {
+        errMsg("event_loop_dispatch(): Failed to add work to thread pool");
+        if (num_added < 0)
+            num_added = 0;
+        while (num_added < num_batch) {
+            conn_t *conn = (conn_t *) loop->batch[num_added++].arg;
+            request_shed(conn->fd);
+            event_loop_close_conn(conn);
+        }
+    }
+}
+
+/* Timer callback: a connection waited too long for a request. One that
+   began to send it is told so, unless the event loop is shutting down. */
+static void
+event_loop_expire(tw_timer *t, void *arg)
+{
+    event_loop *loop = (event_loop *) arg;
+    conn_t *conn = (conn_t *) ((char *) t - offsetof(conn_t, timer));
+    if (conn->rbuf != NULL && conn->rbuf->cnt > 0 && !loop->closing)
+        request_timed_out(conn->fd);
+    event_loop_close_conn(conn);
+}
+
+static void
+event_loop_close_conn(conn_t *conn)
+{
+    TRACE2(close, conn->fd, conn->num_requests);
+    close(conn->fd);
+    free(conn->rbuf);
+    free(conn);
+}
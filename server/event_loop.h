@@ -0,0 +1,45 @@
+/************************************************\
+ * Header file for event_loop.c                 *
+\************************************************/
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "../threadpool/threadpool.h"
+#include "../utils/rate_limit.h"
+#include "request.h"
+
+typedef struct event_loop event_loop;
+
+/* Event loop options */
+typedef struct {
+    unsigned int accept_batch;      /* Maximum connections accepted per wakeup of the listening socket */
+    int size_based;                 /* Schedule requests by the size of their file (SFF policies) */
+    int incoming_cpu;               /* Prefer the worker on the CPU that processed the packets of a connection */
+    unsigned int header_timeout_ms; /* Time to receive the request line and headers */
+    size_t read_buf_size;           /* Size of the read buffer of a connection, which bounds its headers */
+    unsigned int idle_timeout_ms;   /* Time a keep-alive connection may wait for its next request */
+    unsigned int write_timeout_ms;  /* Longest a write to a client may block without progress. 0 for no limit */
+    unsigned int tick_ms;           /* Resolution of the timeouts */
+    int shed;                       /* Turn new connections away with a 503 while the thread pool is overloaded */
+    unsigned int rate_limit;        /* Requests per second allowed per client address. 0 for no limit */
+    unsigned int rate_burst;        /* Requests a client address may make at once */
+    unsigned int rate_clients;      /* Client addresses tracked at once by the rate limiter */
+    rate_limiter *limiter;          /* Limiter shared with other processes, used instead of one created from the
+                                       rate settings. NULL for none. Not destroyed with the event loop. */
+    int shared_listener;            /* Other processes accept on the listening socket too */
+} event_loop_opts;
+
+event_loop *event_loop_create(int lfd, threadpool thpool, const event_loop_opts *opts);
+
+void event_loop_run(event_loop *loop);
+
+void event_loop_stop(event_loop *loop);
+
+void event_loop_release(conn_t *conn, int keep_alive);
+
+int event_loop_close_idle(event_loop *loop);
+
+void event_loop_destroy(event_loop *loop);
+
+#endif
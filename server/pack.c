@@ -0,0 +1,247 @@
+/* pack.c
+ *
+ * Packed document root
+ *
+ * The files of a site are packed by tools/mkpack.c into one archive, with an
+ * index sorted by the hash of their path, the response header of each file
+ * (content type, length and ETag) and a gzip variant of the compressible
+ * ones. The server maps the archive read-only and looks files up in the
+ * index, so that serving a file takes no stat() or open(), and serves the
+ * bodies from the mapping or the archive's file descriptor.
+ *
+ * A site is deployed by building a new archive, renaming it over the old one
+ * and reloading it (pack_load(), on SIGHUP): the requests that started with
+ * the old archive finish with it, and it is unmapped once the last one
+ * releases it. A reference is held by every request using an archive, and
+ * one by pack_load() for the current archive; once the count drops to 0 the
+ * archive is retired for good, which is how pack_acquire() tells that the
+ * archive it found was replaced under it.
+*/
+#include "../utils/tlpi_hdr.h"
+#include "pack.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+struct pack {
+    unsigned int refs;          /* 0 once retired */
+    int fd;
+    const char *data;           /* Mapping of the whole archive */
+    size_t size;
+    const pack_entry *entries;
+    unsigned int num_entries;
+};
+
+
+/* ========================== GLOBALS ============================ */
+
+
+static pack_t *current;         /* Archive new requests are served from, or NULL */
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static pack_t *pack_open(const char *path);
+static int pack_check(pack_t *pack);
+static int pack_range_ok(const pack_t *pack, uint64_t off, uint64_t len);
+
+
+/* ========================== ARCHIVE ============================ */
+
+
+/* FNV-1a hash of the URL path 'path' of 'len' bytes */
+uint64_t
+pack_hash(const char *path, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) path[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Open the archive 'path' and serve the new requests from it. The archive
+   that was served until then is unmapped once its requests are done.
+   Returns 0, or -1 on error, in which case that archive is kept. */
+int
+pack_load(const char *path)
+{
+    pack_t *pack = pack_open(path);
+    if (pack == NULL)
+        return -1;
+
+    pack_t *old = __atomic_exchange_n(&current, pack, __ATOMIC_ACQ_REL);
+    if (old != NULL)
+        pack_release(old);
+    return 0;
+}
+
+/* Return the current archive with a reference the caller must release with
+   pack_release(), or NULL if no archive is loaded */
+pack_t *
+pack_acquire(void)
+{
+    for (;;) {
+        pack_t *pack = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+        if (pack == NULL)
+            return NULL;
+
+        /* Only take a reference while the archive is live: a count of 0
+           means that it was replaced and retired since it was loaded */
+        unsigned int refs = __atomic_load_n(&pack->refs, __ATOMIC_RELAXED);
+        while (refs > 0) {
+            if (__atomic_compare_exchange_n(&pack->refs, &refs, refs + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return pack;
+        }
+    }
+}
+
+/* Release a reference to 'pack'. The last one unmaps it. The structure
+   itself is not freed, since pack_acquire() may still read its count: that
+   is a few bytes per deploy. */
+void
+pack_release(pack_t *pack)
+{
+    if (pack == NULL || __atomic_sub_fetch(&pack->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    munmap((void *) pack->data, pack->size);
+    close(pack->fd);
+}
+
+/* Look up the file of URL path 'path' of 'len' bytes in 'pack'. Returns its
+   entry, or NULL if the archive has no such file. */
+const pack_entry *
+pack_lookup(const pack_t *pack, const char *path, size_t len)
+{
+    uint64_t hash = pack_hash(path, len);
+
+    /* First entry with the hash */
+    unsigned int lo = 0, hi = pack->num_entries;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (pack->entries[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < pack->num_entries && pack->entries[lo].hash == hash; lo++) {
+        const pack_entry *e = &pack->entries[lo];
+        if (e->path_len == len && !memcmp(pack->data + e->path_off, path, len))
+            return e;
+    }
+    return NULL;
+}
+
+/* Return the mapping of 'pack', which the offsets of its entries are into */
+const char *
+pack_data(const pack_t *pack)
+{
+    return pack->data;
+}
+
+/* Return the file descriptor of 'pack', for sendfile() */
+int
+pack_fd(const pack_t *pack)
+{
+    return pack->fd;
+}
+
+
+/* ========================== LOADING ============================ */
+
+
+static pack_t *
+pack_open(const char *path)
+{
+    pack_t *pack = (pack_t *) calloc(1, sizeof(*pack));
+    if (pack == NULL) {
+        errMsg("pack_open(): Failed to allocate memory for archive");
+        return NULL;
+    }
+
+    pack->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (pack->fd == -1) {
+        errMsg("pack_open(): Failed to open archive %s", path);
+        free(pack);
+        return NULL;
+    }
+
+    struct stat sbuf;
+    if (fstat(pack->fd, &sbuf) == -1 || sbuf.st_size < (off_t) sizeof(pack_header)) {
+        errMsg("pack_open(): %s is not an archive", path);
+        goto fail;
+    }
+    pack->size = sbuf.st_size;
+
+    void *data = mmap(NULL, pack->size, PROT_READ, MAP_SHARED, pack->fd, 0);
+    if (data == MAP_FAILED) {
+        errMsg("pack_open(): mmap(): Failed to map archive %s", path);
+        goto fail;
+    }
+    pack->data = (const char *) data;
+
+    if (pack_check(pack) == -1) {
+        errMsg("pack_open(): %s is not a valid archive", path);
+        munmap(data, pack->size);
+        goto fail;
+    }
+
+    pack->refs = 1;
+    return pack;
+
+fail:
+    close(pack->fd);
+    free(pack);
+    return NULL;
+}
+
+/* Check that the header and the entries of 'pack' only point within the
+   archive, so that serving from it can't read past the mapping. Returns 0,
+   or -1 if they don't. */
+static int
+pack_check(pack_t *pack)
+{
+    const pack_header *hdr = (const pack_header *) pack->data;
+    if (memcmp(hdr->magic, PACK_MAGIC, sizeof(hdr->magic)) || hdr->version != PACK_VERSION
+        || hdr->size != pack->size || hdr->entries_off % sizeof(uint64_t) != 0
+        || !pack_range_ok(pack, hdr->entries_off, (uint64_t) hdr->num_entries * sizeof(pack_entry))) {
+        return -1;
+    }
+
+    const pack_entry *entries = (const pack_entry *) (pack->data + hdr->entries_off);
+    unsigned int i, v;
+    for (i = 0; i < hdr->num_entries; i++) {
+        const pack_entry *e = &entries[i];
+        if (!pack_range_ok(pack, e->path_off, e->path_len) || (i > 0 && e->hash < entries[i - 1].hash))
+            return -1;
+        if (e->variants[PACK_IDENTITY].hdr_off == 0)
+            return -1;
+        for (v = 0; v < PACK_NUM_VARIANTS; v++) {
+            const pack_variant *var = &e->variants[v];
+            if (var->hdr_off == 0)
+                continue;
+            if (!pack_range_ok(pack, var->hdr_off, var->hdr_len) || !pack_range_ok(pack, var->body_off, var->body_len)
+                || memchr(var->etag, '\0', sizeof(var->etag)) == NULL)
+                return -1;
+        }
+    }
+
+    pack->entries = entries;
+    pack->num_entries = hdr->num_entries;
+    return 0;
+}
+
+static int
+pack_range_ok(const pack_t *pack, uint64_t off, uint64_t len)
+{
+    return off <= pack->size && len <= pack->size - off;
+}
@@ -0,0 +1,67 @@
+/************************************************\
+ * Header file for pack.c                       *
+\************************************************/
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Layout of an archive, built by tools/mkpack.c. All offsets are from the start
+of the file, and all integers in the byte order of the machine that built it.
+
+    pack_header
+    pack_entry[num_entries]     sorted by hash, then path
+    bodies
+    paths and response headers
+*/
+
+#define PACK_MAGIC      "HTTPPACK"
+#define PACK_VERSION    1
+#define PACK_ETAG_MAX   32          /* Longest ETag, with its quotes and terminating null byte */
+
+/* Variants of a file */
+enum { PACK_IDENTITY, PACK_GZIP, PACK_NUM_VARIANTS };
+
+typedef struct {
+    char magic[8];                  /* PACK_MAGIC, not null terminated */
+    uint32_t version;               /* PACK_VERSION */
+    uint32_t num_entries;
+    uint64_t entries_off;
+    uint64_t size;                  /* Size of the archive */
+} pack_header;
+
+typedef struct {
+    uint64_t hdr_off;               /* Response header up to and including the ETag, or 0 if there is no such variant */
+    uint64_t hdr_len;
+    uint64_t body_off;
+    uint64_t body_len;
+    char etag[PACK_ETAG_MAX];       /* Strong ETag, quoted */
+} pack_variant;
+
+typedef struct {
+    uint64_t hash;                  /* pack_hash() of the path */
+    uint64_t path_off;              /* URL path, e.g. /index.html, not null terminated */
+    uint64_t path_len;
+    pack_variant variants[PACK_NUM_VARIANTS];
+} pack_entry;
+
+typedef struct pack pack_t;
+
+uint64_t pack_hash(const char *path, size_t len);
+
+int pack_load(const char *path);
+
+pack_t *pack_acquire(void);
+
+void pack_release(pack_t *pack);
+
+const pack_entry *pack_lookup(const pack_t *pack, const char *path, size_t len);
+
+const char *pack_data(const pack_t *pack);
+
+int pack_fd(const pack_t *pack);
+
+#endif
@@ -1,65 +1,384 @@
+#define _GNU_SOURCE     /* For strcasestr() */
 
 #include "../utils/tlpi_hdr.h"
 #include "../utils/utils.h"
 #include "../utils/inet_sockets.h"
+#include "../utils/perf_counters.h"
+#include "../utils/trace.h"
+#include "../threadpool/threadpool.h"
+#include "request.h"
+#include "request_internal.h"
+#include "status.h"
+#include "event_loop.h"
+#include "pack.h"
 #include <sys/stat.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <linux/openat2.h>
+#include <sys/syscall.h>
 
-#define MAX_LEN 1024
+#define MAX_DISCARDED_BODY (64*1024)    /* Largest request body read and discarded to keep the connection */
+#define PACK_WRITEV_MAX (64*1024)       /* Largest body from the archive written along with the header */
+#define PATH_BUF_SIZE (MAX_LEN*4 + 16)  /* Request path, with room for index.html */
+
+
+/* ========================== GLOBALS ============================ */
+
+
+static int *active_fds;             /* Connection being served by each worker thread, or -1 */
+static unsigned int num_workers;
+static alog_t *alog;                /* Access log, or NULL */
+static alog_t *slow_alog;           /* Log of the requests slower than 'slow_ns', or NULL */
+static uint64_t slow_ns;
+static uint64_t body_timeout_ns;    /* Time to receive a request body */
+static size_t read_buf_size;        /* Size of the read buffer of a connection */
+static const char *status_path;     /* URL path of the statistics page, or NULL */
+static int stat_headers;            /* Add the Stat-req-* and Stat-thread-* headers to file responses */
+static int packed;                  /* Serve the files from the archive loaded with pack_load() */
+static int root_fd = -1;            /* Document root, which the request paths are resolved beneath */
+static int no_openat2;              /* The kernel has no openat2(): fall back to openat() */
+static uint64_t start_ns;           /* Time request handling was set up. Origin of the Stat-req-* times */
+static unsigned long num_completed; /* Requests whose file was ready to be sent */
+
+static __thread perfc_t perf;       /* Performance counters of this worker thread, if opened */
+static __thread unsigned int perf_events;   /* Bit mask of the events 'perf' counts */
 
 
 /* ========================== STRUCTURES ============================ */
 
 
-typedef struct hdr_t {
-    char *name;
-    char *value;
-    struct hdr_t *next;
-} hdr_t;
+/* State of the request being served, kept for the access log */
+typedef struct {
+    conn_t *conn;
+    int cfd;
+    char line[MAX_LEN*4];           /* Request line, without the line terminator */
+    const char *status;             /* Status code of the response, or NULL if none was sent */
+    long long bytes;                /* Size of the response body */
+    long long file_size;            /* Size of the file served, or -1 */
+    int is_static;                  /* Served with a file */
+    int keep_alive;                 /* The connection can carry another request */
+    char referer[MAX_LEN];
+    char user_agent[MAX_LEN];
+    char if_none_match[MAX_LEN];    /* ETags the client has, or empty */
+    int accept_gzip;                /* The client accepts gzip content encoding */
+    uint64_t phase_start_ns;        /* Start of the current phase */
+    status_timing timing;           /* Duration of the phases so far */
+} request_t;
 
 
 /* ========================== PROTOTYPES ============================ */
 
-static void request_get(int cfd, rbuf_t rbuf_p, char *uri);
-static hdr_t **request_parse_hdr(rbuf_t *rbuf_p, int cfd);
-static void request_destroy_hdr(hdr_t **hdr_pp);
-static void request_parse_uri(char *uri, char *filename);
-static void response_get(int cfd, char *filename);
-static void response_serve_static(int cfd, char *filename, int filesize);
-static void response_get_content_type(char *filename, char *content_type);
-static void request_error(int cfd, const char *status_code, const char *reason, const char *msg);
+static void request_serve(request_t *req);
+static void request_get(request_t *req, rbuf_t *rbuf_p, char *uri, int http11);
+static int request_discard_body(rbuf_t *rbuf_p, long long len);
+static int request_parse_uri(const char *uri, char *path, size_t size);
+static int request_hex_digit(int c);
+static int request_open(const char *path);
+static void request_log(request_t *req);
+static void request_log_slow(request_t *req, int id, uint64_t total_ns);
+static void request_peer_str(request_t *req, char *buf, size_t size, int with_port);
+static const char *request_timestamp(void);
+static void request_phase_end(request_t *req, status_phase phase);
+static void response_get(request_t *req, char *filename);
+static void response_serve_status(request_t *req, const char *query);
+static void response_serve_static(request_t *req, char *filename, int in_fd, int filesize);
+static void response_get_packed(request_t *req, const char *path, size_t len);
+static void response_serve_packed(request_t *req, const char *path, pack_t *pack, const pack_variant *var);
+static int response_stat_headers(request_t *req, char *buf, size_t size);
+static void request_error(request_t *req, const char *status_code, const char *reason, const char *msg);
+
+
+/*
+Set up request handling as described by 'opts' (see request.h). A line is
+written to the access log for every request served, and the server
+statistics are served at the status URL. If stat headers are enabled, file
+responses carry the timing and counts of the request and of the thread
+serving it in Stat-req-* and Stat-thread-* headers. Requests that take longer
+than the slow request threshold from their arrival in the job queue to the
+end of their response are written, with the duration of each of their
+phases, to the slow request log. If an archive is given, the files are
+served from it (see pack.c) instead of from the document root, the working
+directory.
+*/
+int
+request_init(const request_opts *opts)
+{
+    unsigned int num_threads = opts->num_threads;
+    active_fds = (int *) malloc(num_threads * sizeof(*active_fds));
+    if (active_fds == NULL) {
+        errMsg("request_init(): Failed to allocate memory for active connection table");
+        return -1;
+    }
+
+    unsigned int i;
+    for (i = 0; i < num_threads; i++) {
+        active_fds[i] = -1;
+    }
+    num_workers = num_threads;
+    alog = opts->access_log;
+    status_path = opts->status_url;
+    stat_headers = opts->stat_headers;
+    slow_alog = opts->slow_log;
+    slow_ns = (uint64_t) opts->slow_ms * 1000000;
+    body_timeout_ns = (uint64_t) opts->body_timeout_ms * 1000000;
+    read_buf_size = opts->read_buf_size ? opts->read_buf_size : BUF_SIZE;
+    start_ns = get_monotonic_ns();
+
+    root_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        errMsg("request_init(): Failed to open document root");
+        return -1;
+    }
+
+    if (opts->pack != NULL) {
+        if (pack_load(opts->pack) == -1) {
+            errMsg("request_init(): Failed to load archive %s", opts->pack);
+            return -1;
+        }
+        packed = 1;
+    }
+
+    if (status_init(num_threads) == -1) {
+        errMsg("request_init(): Failed to initialize server statistics");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+Shut down the connections currently being served so that the worker threads
+blocked reading from or writing to them return promptly. Used when a graceful
+shutdown runs past its deadline. Returns the number of connections aborted.
+*/
+int
+request_abort_all(void)
+{
+    int num_aborted = 0;
+    unsigned int i;
+    for (i = 0; i < num_workers; i++) {
+        int cfd = __atomic_load_n(&active_fds[i], __ATOMIC_ACQUIRE);
+        if (cfd >= 0 && shutdown(cfd, SHUT_RDWR) == 0) {
+            num_aborted++;
+        }
+    }
+
+    return num_aborted;
+}
+
+/*
+Write the prebuilt response 'resp' to a connection turned away without
+involving a worker. What the client has sent is read off first, since
+closing a socket with unread data resets the connection and the client
+might never see the response.
+*/
+static void
+request_refuse(int cfd, const char *resp, size_t len)
+{
+    char buf[BUF_SIZE];
+    while (recv(cfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    if (send(cfd, resp, len, MSG_DONTWAIT | MSG_NOSIGNAL) == -1 && errno != EPIPE && errno != ECONNRESET)
+        errMsg("request_refuse(): send(): Failed to write to socket");
+}
+
+/* Turn a connection away with a 503 while the server is overloaded */
+void
+request_shed(int cfd)
+{
+    static const char resp[] =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Server: Tzou's HTTP server\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: 97\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n\r\n"
+        "<!DOCTYPE html><html><body><h1><b>503 Service Unavailable</b></h1><p>Overloaded</p></body></html>";
+
+    request_refuse(cfd, resp, sizeof(resp) - 1);
+    status_record_shed();
+}
+
+/* Turn away a request of a client over its rate limit with a 429 */
+void
+request_rate_limited(int cfd)
+{
+    static const char resp[] =
+        "HTTP/1.1 429 Too Many Requests\r\n"
+        "Server: Tzou's HTTP server\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: 97\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n\r\n"
+        "<!DOCTYPE html><html><body><h1><b>429 Too Many Requests</b></h1><p>Rate limited</p></body></html>";
+
+    request_refuse(cfd, resp, sizeof(resp) - 1);
+    status_record_rate_limited();
+}
+
+/* Close a connection whose request headers did not arrive in time with a 408 */
+void
+request_timed_out(int cfd)
+{
+    static const char resp[] =
+        "HTTP/1.1 408 Request Timeout\r\n"
+        "Server: Tzou's HTTP server\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: 119\r\n"
+        "Connection: close\r\n\r\n"
+        "<!DOCTYPE html><html><body><h1><b>408 Request Timeout</b></h1><p>The request was not received in time</p></body></html>";
+
+    request_refuse(cfd, resp, sizeof(resp) - 1);
+}
+
+/* Close a connection whose request headers do not fit its read buffer with a 431 */
+void
+request_too_large(int cfd)
+{
+    static const char resp[] =
+        "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+        "Server: Tzou's HTTP server\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: 123\r\n"
+        "Connection: close\r\n\r\n"
+        "<!DOCTYPE html><html><body><h1><b>431 Request Header Fields Too Large</b></h1><p>The headers are too long</p></body></html>";
+
+    request_refuse(cfd, resp, sizeof(resp) - 1);
+}
+
+/*
+Thread pool hooks that open and close the performance counters of each worker
+thread. The counts of each request served are then added to the statistics.
+*/
+void
+request_thread_start(int id)
+{
+    if (perfc_open(&perf) == -1) {
+        errMsg("request_thread_start(): Worker %d runs without performance counters", id);
+        return;
+    }
+
+    perf_events = 0;
+    unsigned int e;
+    for (e = 0; e < PERFC_NUM_EVENTS; e++) {
+        if (perf.fds[e] != -1)
+            perf_events |= 1U << e;
+    }
+}
 
+void
+request_thread_exit(int id)
+{
+    if (perf.num_open > 0)
+        perfc_close(&perf);
+}
 
+/*
+Serve a request on a connection handed over by the event loop. 'arg' is the
+conn_t of the connection, which goes back to the event loop once the request
+is served if it is kept alive, or is closed and freed otherwise.
+*/
 void
 request_handle(void *arg)
 {
-    int cfd = (int) arg;
+    conn_t *conn = (conn_t *) arg;
+    int id = thpool_thread_id();
+
+    if (id >= 0 && id < num_workers)
+        __atomic_store_n(&active_fds[id], conn->fd, __ATOMIC_RELEASE);
+
+    request_t req;
+    req.conn = conn;
+    req.cfd = conn->fd;
+    req.line[0] = '\0';
+    req.status = NULL;
+    req.bytes = 0;
+    req.file_size = -1;
+    req.is_static = 0;
+    req.keep_alive = 0;
+    req.referer[0] = '\0';
+    req.user_agent[0] = '\0';
+    req.if_none_match[0] = '\0';
+    req.accept_gzip = 0;
+    memset(&req.timing, 0, sizeof(req.timing));
+
+    const thpool_job_info *job = thpool_current_job();
+    if (job != NULL)
+        status_timing_set(&req.timing, STATUS_PHASE_QUEUE, job->dispatch_ns - job->enqueue_ns);
+    req.phase_start_ns = get_monotonic_ns();
+    uint64_t arrival_ns = (job != NULL) ? job->enqueue_ns : req.phase_start_ns;
+
+    uint64_t counts_start[PERFC_NUM_EVENTS], counts[PERFC_NUM_EVENTS];
+    int counted = (perf.num_open > 0 && perfc_read(&perf, counts_start) == 0);
+
+    request_serve(&req);
+
+    if (id >= 0 && id < num_workers)
+        __atomic_store_n(&active_fds[id], -1, __ATOMIC_RELEASE);
+
+    conn->num_requests++;
+    TRACE3(done, conn->fd, req.bytes, req.keep_alive);
+    uint64_t total_ns = get_monotonic_ns() - arrival_ns;
+
+    if (counted && perfc_read(&perf, counts) == 0) {
+        unsigned int e;
+        for (e = 0; e < PERFC_NUM_EVENTS; e++)
+            counts[e] -= counts_start[e];
+        status_record_counters(id, counts, perf_events, !perf.exclude_kernel);
+    }
+    status_record(id, req.status, req.bytes, req.is_static, &req.timing);
+
+    if (alog != NULL && req.line[0] != '\0')
+        request_log(&req);
+    if (slow_alog != NULL && total_ns >= slow_ns)
+        request_log_slow(&req, id, total_ns);
+
+    event_loop_release(conn, req.keep_alive);
+}
 
-    rbuf_t rbuf;
+static void
+request_serve(request_t *req)
+{
+    conn_t *conn = req->conn;
     char buf[BUF_SIZE], method[MAX_LEN], uri[MAX_LEN*4], proto_ver[MAX_LEN];
-    struct sockaddr my_addr;  /* Socket address buffer */
-    socklen_t len = sizeof(my_addr); /* Size of socket address buffer */
-    char addr_str[IS_ADDR_STR_LEN];
 
-    /* Get peer socket address */
-    if (getpeername(cfd, &my_addr, &len) == -1) {
-        errMsg("request_handle(): getpeername(): Failed to get peer socket address");
+    /* The read buffer is kept while the client sends requests back to back,
+       for the bytes of the next one that were read along with this one */
+    if (conn->rbuf == NULL) {
+        conn->rbuf = readBufAlloc(req->cfd, read_buf_size);
+        if (conn->rbuf == NULL) {
+            errMsg("request_serve(): Failed to allocate memory for read buffer");
+            return;
+        }
     }
+    rbuf_t *rbuf_p = conn->rbuf;
+    rbuf_p->deadline_ns = conn->deadline_ns;
 
-    readBufInit(cfd, &rbuf);
-    if (readLineFromBuf(&rbuf, buf, BUF_SIZE) <= 0) {   // can use recv() sys call
-        /* Connection error. Peer may have closed socket. */
-        errMsg("request_handle(): readLineFromBuf(): Error reading from socket. Peer may have closed connection");
+    ssize_t n = readLineFromBuf(rbuf_p, buf, BUF_SIZE);
+    if (n == -1 && errno == ETIMEDOUT) {
+        request_error(req, "408", "Request Timeout", "The request was not received in time");
+        return;
+    }
+    if (n <= 0) {   // can use recv() sys call
+        /* Connection error. Peer may have closed socket, which is how keep-alive connections usually end. */
+        if (n == -1 || conn->num_requests == 0)
+            errMsg("request_handle(): readLineFromBuf(): Error reading from socket. Peer may have closed connection");
         return;
     }
 
     /* Parse request line */
     sscanf(buf, "%s %s %s", method, uri, proto_ver);
 
-    /* Print peer request line */
-    printf("%s %s", inetAddressStr(&my_addr, len, addr_str, IS_ADDR_STR_LEN), buf);
-    fflush(stdout);
+    /* Keep the request line for the access log */
+    size_t len = strcspn(buf, "\r\n");
+    if (len >= sizeof(req->line))
+        len = sizeof(req->line) - 1;
+    memcpy(req->line, buf, len);
+    req->line[len] = '\0';
 
     char tmp[MAX_LEN];
     strcpy(tmp, proto_ver);
@@ -67,47 +386,140 @@ request_handle(void *arg)
     char *ver = strtok(NULL, "/");
 
     if (strcmp(proto, "HTTP")) {
-        request_error(cfd, "400", "Bad Request", "Client sent a Non-HTTP request");
+        request_error(req, "400", "Bad Request", "Client sent a Non-HTTP request");
         errMsg("request_handle(): Client sent a Non-HTTP request");
         return;
     }
 
-    if (strcmp(ver, "1.0") && strcmp(ver, "1.1"))
+    if (ver == NULL || (strcmp(ver, "1.0") && strcmp(ver, "1.1")))
     {
-        request_error(cfd, "505", "HTTP Version Not Supported", "");
+        request_error(req, "505", "HTTP Version Not Supported", "");
         errMsg("request_handle(): 505 HTTP Version Not Supported");
         return;
     }
 
     if (!strcmp(method, "GET")) {
-        request_get(cfd, rbuf, uri);
+        request_get(req, rbuf_p, uri, !strcmp(ver, "1.1"));
     }
     else {
-        request_error(cfd, "501", "Not Implemented", "Server cannot fulfill the request method for now");
+        request_error(req, "501", "Not Implemented", "Server cannot fulfill the request method for now");
         errMsg("request_handle(): Unable to fulfill HTTP request method");
         return;
     }
+}
+
+/*
+Return the size of the file requested by the request line at the start of
+'data', the 'data_len' bytes read of a request, for use as a scheduling key. If
+the request is not a GET for a regular file, 0 is returned so that the
+request is served as soon as possible (it is either tiny or an error).
+*/
+unsigned long
+request_peek_size(const char *data, size_t data_len)
+{
+    char buf[MAX_LEN*4 + 2*MAX_LEN], method[MAX_LEN], uri[MAX_LEN*4], filename[PATH_BUF_SIZE];
+
+    data_len = min(data_len, sizeof(buf) - 1);
+    memcpy(buf, data, data_len);
+    buf[data_len] = '\0';
+
+    char *eol = strchr(buf, '\n');
+    if (eol == NULL)
+        return 0;
+    *eol = '\0';
+
+    if (sscanf(buf, "%1023s %4095s", method, uri) != 2 || strcmp(method, "GET"))
+        return 0;
+
+    int len = request_parse_uri(uri, filename, sizeof(filename));
+    if (len == -1)
+        return 0;
+
+    if (packed) {
+        unsigned long size = 0;
+        pack_t *pack = pack_acquire();
+        const pack_entry *e = (pack != NULL) ? pack_lookup(pack, filename, len) : NULL;
+        if (e != NULL)
+            size = e->variants[PACK_IDENTITY].body_len;
+        pack_release(pack);
+        return size;
+    }
+
+    /* Only a scheduling key: where a symbolic link leads doesn't matter */
+    struct stat sbuf;
+    if (fstatat(root_fd, filename + 1, &sbuf, 0) == -1 || !S_ISREG(sbuf.st_mode))
+        return 0;
 
-    close(cfd);
+    return sbuf.st_size;
 }
 
 static void
-request_get(int cfd, rbuf_t rbuf, char *uri)
+request_get(request_t *req, rbuf_t *rbuf_p, char *uri, int http11)
 {
-    char filename[MAX_LEN*4];
+    char filename[PATH_BUF_SIZE];
 
-    request_parse_uri(uri, filename);
+    int error;
+    hdr_t **hdr_pp = request_parse_hdr(rbuf_p, req->cfd, &error);
+    request_phase_end(req, STATUS_PHASE_PARSE);
+    if (error != 0) {
+        if (error == ETIMEDOUT)
+            request_error(req, "408", "Request Timeout", "The request headers were not received in time");
+        request_destroy_hdr(hdr_pp);
+        return;
+    }
+    TRACE2(parse_done, req->cfd, req->line);
 
-    hdr_t **hdr_pp = request_parse_hdr(&rbuf, cfd);
+    /* Keep the headers reported in the access log, and those that decide
+       whether the connection is kept alive: HTTP/1.1 connections are unless
+       the client asks to close them, HTTP/1.0 ones only if it asks to */
+    long long content_length = 0;
+    int keep_alive = http11;
+    hdr_t *hdr_p;
+    for (hdr_p = (hdr_pp != NULL) ? *hdr_pp : NULL; hdr_p != NULL; hdr_p = hdr_p->next) {
+        if (hdr_p->name == NULL || hdr_p->value == NULL)
+            continue;
+        if (!strcasecmp(hdr_p->name, "Referer"))
+            snprintf(req->referer, sizeof(req->referer), "%s", hdr_p->value);
+        else if (!strcasecmp(hdr_p->name, "User-Agent"))
+            snprintf(req->user_agent, sizeof(req->user_agent), "%s", hdr_p->value);
+        else if (!strcasecmp(hdr_p->name, "Connection"))
+            keep_alive = http11 ? !strcasestr(hdr_p->value, "close") : (strcasestr(hdr_p->value, "keep-alive") != NULL);
+        else if (!strcasecmp(hdr_p->name, "Content-Length"))
+            content_length = strtoll(hdr_p->value, NULL, 10);
+        else if (!strcasecmp(hdr_p->name, "Transfer-Encoding"))
+            content_length = -1;    /* Chunked bodies are not parsed: the connection can't be reused */
+        else if (!strcasecmp(hdr_p->name, "If-None-Match"))
+            snprintf(req->if_none_match, sizeof(req->if_none_match), "%s", hdr_p->value);
+        else if (!strcasecmp(hdr_p->name, "Accept-Encoding"))
+            req->accept_gzip = (strcasestr(hdr_p->value, "gzip") != NULL);
+    }
 
-    response_get(cfd, filename);
+    /* A GET request has no use for a body, but it must be consumed for the
+       next request on the connection to be read */
+    req->keep_alive = keep_alive && request_discard_body(rbuf_p, content_length) == 0;
+
+    /* Built-in statistics page */
+    size_t path_len = strcspn(uri, "?");
+    if (status_path != NULL && strlen(status_path) == path_len && !strncmp(uri, status_path, path_len)) {
+        response_serve_status(req, uri + path_len);
+    }
+    else {
+        int len = request_parse_uri(uri, filename, sizeof(filename));
+        if (len == -1)
+            request_error(req, "400", "Bad Request", "The requested path is not valid");
+        else if (packed)
+            response_get_packed(req, filename, len);
+        else
+            response_get(req, filename);
+    }
 
     request_destroy_hdr(hdr_pp);
 }
 
-static hdr_t **
-request_parse_hdr(rbuf_t *rbuf_p, int cfd)
+hdr_t **
+request_parse_hdr(rbuf_t *rbuf_p, int cfd, int *error_p)
 {   // Return 500 Internal Server Error for failed mallocs?
+    *error_p = 0;
     hdr_t **hdr_pp = (hdr_t **) malloc(sizeof(*hdr_pp));
     if (hdr_pp == NULL) {
         errMsg("request_parse_hdr(): Failed to allocate memory for pointer to hdr_t structures");
@@ -115,10 +527,13 @@ request_parse_hdr(rbuf_t *rbuf_p, int cfd)
     }
 
     char buf[BUF_SIZE];
-    hdr_t *hdr_p = *hdr_pp;
+    hdr_t *hdr_p = NULL;
+    *hdr_pp = NULL;
     int empty_list = 1;
     while (1) {
-        if (readLineFromBuf(rbuf_p, buf, BUF_SIZE) <= 0) {  // can use recv() sys call
+        ssize_t n = readLineFromBuf(rbuf_p, buf, BUF_SIZE);
+        if (n <= 0) {  // can use recv() sys call
+            *error_p = (n == -1 && errno == ETIMEDOUT) ? ETIMEDOUT : ECONNRESET;
             errMsg("request_handle(): readLineFromBuf(): Error reading from socket. Peer may have closed connection");
             return hdr_pp;
         }
@@ -128,7 +543,9 @@ request_parse_hdr(rbuf_t *rbuf_p, int cfd)
         }
 
         char *name = trimwhitespace(strtok(buf, ":"));
-        char *value = trimwhitespace(strtok(NULL, ":"));
+        char *value = strtok(NULL, "");     /* Values may contain ':' */
+        if (value != NULL)
+            value = trimwhitespace(value);
 
         if (name == NULL || value == NULL) {
             errMsg("request_parse_hdr(): Bad header field format");
@@ -174,7 +591,30 @@ request_parse_hdr(rbuf_t *rbuf_p, int cfd)
     return hdr_pp;
 }
 
-static void
+/* Read and drop a request body of 'len' bytes, within the body timeout.
+   Returns 0 if the connection is left at the start of the next request, or
+   -1 if it can't be (body too large, chunked, or not received in time). */
+static int
+request_discard_body(rbuf_t *rbuf_p, long long len)
+{
+    if (len == 0)
+        return 0;
+    if (len < 0 || len > MAX_DISCARDED_BODY)
+        return -1;
+
+    char buf[BUF_SIZE];
+    rbuf_p->deadline_ns = get_monotonic_ns() + body_timeout_ns;
+    while (len > 0) {
+        ssize_t n = readnFromBuf(rbuf_p, buf, min(len, (long long) sizeof(buf)));
+        if (n <= 0)
+            return -1;
+        len -= n;
+    }
+
+    return 0;
+}
+
+void
 request_destroy_hdr(hdr_t **hdr_pp)
 {
     if (hdr_pp == NULL)
@@ -192,70 +632,517 @@ request_destroy_hdr(hdr_t **hdr_pp)
     free(hdr_pp);
 }
 
+/*
+Decode and normalize the path of the request target 'uri' into 'path' of
+'size' bytes: the query string is dropped, the %XX escapes are decoded, empty
+and "." segments are removed and ".." segments remove the segment before
+them. A directory gets index.html. The result starts with '/' and never goes
+above the document root. Returns its length, or -1 if 'uri' is not a valid
+path, has an encoded null byte or goes above the root.
+*/
+static int
+request_parse_uri(const char *uri, char *path, size_t size)
+{
+    if (uri[0] != '/')
+        return -1;
+
+    /* Decode the %XX escapes of the path, up to the query string */
+    size_t n = 0;
+    const char *p;
+    for (p = uri; *p != '\0' && *p != '?'; p++) {
+        int c = (unsigned char) *p;
+        if (c == '%') {
+            int hi = request_hex_digit(p[1]);
+            int lo = (hi == -1) ? -1 : request_hex_digit(p[2]);
+            if (lo == -1)
+                return -1;
+            c = (hi << 4) | lo;
+            if (c == '\0')
+                return -1;
+            p += 2;
+        }
+        if (n + 1 >= size)
+            return -1;
+        path[n++] = c;
+    }
+
+    /* Normalize in place: every segment is written at or before where it
+       was read. 'w' is the end of the normalized path. */
+    size_t r = 0, w = 0;
+    int dir = 0;                    /* The path names a directory */
+    while (r < n) {
+        size_t start = r + 1, end = start;
+        while (end < n && path[end] != '/')
+            end++;
+        size_t seg_len = end - start;
+
+        dir = 1;
+        if (seg_len == 2 && path[start] == '.' && path[start + 1] == '.') {
+            /* Above the document root */
+            if (w == 0)
+                return -1;
+            do {
+                w--;
+            } while (path[w] != '/');
+        }
+        else if (seg_len > 0 && !(seg_len == 1 && path[start] == '.')) {
+            path[w++] = '/';
+            memmove(path + w, path + start, seg_len);
+            w += seg_len;
+            dir = 0;
+        }
+        r = end;
+    }
+
+    if (dir) {
+        if (w + sizeof("/index.html") > size)
+            return -1;
+        memcpy(path + w, "/index.html", sizeof("/index.html"));
+        w += sizeof("/index.html") - 1;
+    }
+    else {
+        path[w] = '\0';
+    }
+    return w;
+}
+
+/* Value of the hexadecimal digit 'c', or -1 */
+static int
+request_hex_digit(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+Open the file of the request path 'path' (see request_parse_uri()) for
+reading, relative to the document root. openat2() resolves it strictly
+beneath the root, so that a symbolic link pointing out of it fails with
+EXDEV, and refuses the /proc magic links. Kernels older than 5.6 have no
+openat2() and fall back to openat(), which follows such links; the path
+itself has no ".." either way. Returns a file descriptor, or -1.
+*/
+static int
+request_open(const char *path)
+{
+    /* O_NONBLOCK so that a FIFO doesn't block the worker: it is refused
+       after the fstat() */
+    int flags = O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+
+    if (!__atomic_load_n(&no_openat2, __ATOMIC_RELAXED)) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = syscall(SYS_openat2, root_fd, path + 1, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS)
+            return fd;
+        __atomic_store_n(&no_openat2, 1, __ATOMIC_RELAXED);
+    }
+    return openat(root_fd, path + 1, flags);
+}
+
+/*
+Append a line in the Combined Log Format to the access log. The peer address
+comes from accept() and is formatted numerically, and the timestamp is only
+reformatted once per second by each thread, so that logging costs no system
+call nor lock on the request path.
+*/
+static void
+request_log(request_t *req)
+{
+    char addr_str[INET6_ADDRSTRLEN] = "-";
+    request_peer_str(req, addr_str, sizeof(addr_str), 0);
+
+    char bytes_str[24] = "-";
+    if (req->bytes > 0)
+        snprintf(bytes_str, sizeof(bytes_str), "%lld", req->bytes);
+
+    alog_printf(alog, "%s - - [%s] \"%s\" %s %s \"%s\" \"%s\"\n",
+                addr_str, request_timestamp(), req->line, (req->status != NULL) ? req->status : "-", bytes_str,
+                (req->referer[0] != '\0') ? req->referer : "-",
+                (req->user_agent[0] != '\0') ? req->user_agent : "-");
+}
+
+/*
+Write a request that took 'total_ns' to the slow request log: when it was
+served, by which worker, the peer, the request line (empty if the peer never
+sent one), the status code, the size of the file and the bytes actually sent,
+and the time spent in each phase. A phase the request did not reach is "-".
+*/
+static void
+request_log_slow(request_t *req, int id, uint64_t total_ns)
+{
+    char addr_str[INET6_ADDRSTRLEN + 8] = "-";
+    request_peer_str(req, addr_str, sizeof(addr_str), 1);
+
+    char phases_str[STATUS_NUM_PHASES][24];
+    unsigned int p;
+    for (p = 0; p < STATUS_NUM_PHASES; p++) {
+        if (req->timing.timed & (1U << p))
+            snprintf(phases_str[p], sizeof(phases_str[p]), "%.3f", req->timing.ns[p] / 1e6);
+        else
+            strcpy(phases_str[p], "-");
+    }
+
+    alog_printf(slow_alog, "[%s] thread=%d peer=%s \"%s\" status=%s total_ms=%.3f "
+                "queue_ms=%s parse_ms=%s open_ms=%s send_ms=%s file_size=%lld bytes_sent=%lld\n",
+                request_timestamp(), id, addr_str, req->line, (req->status != NULL) ? req->status : "-",
+                total_ns / 1e6, phases_str[STATUS_PHASE_QUEUE], phases_str[STATUS_PHASE_PARSE],
+                phases_str[STATUS_PHASE_OPEN], phases_str[STATUS_PHASE_SEND], req->file_size, req->bytes);
+}
+
+/* Format the peer address numerically, followed by ":port" if 'with_port' is
+   set. 'buf' is left unchanged for other address families. */
 static void
-request_parse_uri(char *uri, char *filename)
+request_peer_str(request_t *req, char *buf, size_t size, int with_port)
 {
-    if (sprintf(filename, ".%s", uri) < 0) {
-        errMsg("request_parse_uri(): sprintf() failed");
+    char addr_str[INET6_ADDRSTRLEN];
+    struct sockaddr *addr = (struct sockaddr *) &req->conn->addr;
+    in_port_t port;
+    if (addr->sa_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *) addr)->sin_addr, addr_str, sizeof(addr_str));
+        port = ((struct sockaddr_in *) addr)->sin_port;
+    }
+    else if (addr->sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *) addr)->sin6_addr, addr_str, sizeof(addr_str));
+        port = ((struct sockaddr_in6 *) addr)->sin6_port;
+    }
+    else {
         return;
     }
 
-    if (uri[strlen(uri)-1] == '/') {
-        strcat(filename, "index.html");
+    if (with_port)
+        snprintf(buf, size, (addr->sa_family == AF_INET6) ? "[%s]:%u" : "%s:%u", addr_str, ntohs(port));
+    else
+        snprintf(buf, size, "%s", addr_str);
+}
+
+/* Return the current local time in the log format, formatted at most once a
+   second by each thread */
+static const char *
+request_timestamp(void)
+{
+    static __thread time_t ts_sec = -1;
+    static __thread char ts_buf[64];
+
+    time_t now = time(NULL);
+    if (now != ts_sec) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(ts_buf, sizeof(ts_buf), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        ts_sec = now;
     }
+
+    return ts_buf;
 }
 
+/* Record the time since the end of the previous phase as the duration of 'phase' */
 static void
-response_get(int cfd, char *filename)
+request_phase_end(request_t *req, status_phase phase)
 {
-    struct stat sbuf;
-    if (stat(filename, &sbuf) == -1) {
-        request_error(cfd, "404", "Not Found", "The requested resource could not be found");
+    uint64_t now = get_monotonic_ns();
+    status_timing_set(&req->timing, phase, now - req->phase_start_ns);
+    req->phase_start_ns = now;
+}
+
+static void
+response_get(request_t *req, char *filename)
+{
+    int in_fd = request_open(filename);
+    if (in_fd == -1) {
+        request_phase_end(req, STATUS_PHASE_OPEN);
+        if (errno == ENOENT || errno == ENOTDIR || errno == ENAMETOOLONG) {
+            request_error(req, "404", "Not Found", "The requested resource could not be found");
+        }
+        else if (errno == EACCES || errno == EPERM || errno == EXDEV || errno == ELOOP) {
+            request_error(req, "403", "Forbidden", "");
+        }
+        else {
+            errMsg("Failed to open file %s", filename);
+            request_error(req, "500", "Internal Server Error", "");
+        }
         return;
     }
 
-    if (!(S_ISREG(sbuf.st_mode) && (sbuf.st_mode & S_IRUSR))) {
-        request_error(cfd, "403", "Forbidden", "");
+    struct stat sbuf;
+    if (fstat(in_fd, &sbuf) == -1 || !(S_ISREG(sbuf.st_mode) && (sbuf.st_mode & S_IRUSR))) {
+        close(in_fd);
+        request_phase_end(req, STATUS_PHASE_OPEN);
+        request_error(req, "403", "Forbidden", "");
         return;
     }
 
-    response_serve_static(cfd, filename, sbuf.st_size);
+    response_serve_static(req, filename, in_fd, sbuf.st_size);
 }
 
 static void
-response_serve_static(int cfd, char *filename, int filesize)
+response_serve_static(request_t *req, char *filename, int in_fd, int filesize)
 {
+    int cfd = req->cfd;
     char resp[BUF_SIZE];//, hdr[BUF_SIZE]; // write a function that creates the header?
     char content_type[MAX_LEN];
+
+    request_phase_end(req, STATUS_PHASE_OPEN);
+    TRACE3(file_open, cfd, filename, filesize);
+    req->is_static = 1;
+    req->file_size = filesize;
+
     response_get_content_type(filename, content_type);
 
     // Header
-    sprintf(resp, "HTTP/1.0 200 OK\r\n");
-    sprintf(resp, "%sServer: Tzou's HTTP server\r\n", resp);
-    sprintf(resp, "%sContent-Type: %s\r\n", resp, content_type);
-    sprintf(resp, "%sContent-Length: %d\r\n", resp, filesize);
+    response_format_header(resp, content_type, filesize, req->keep_alive);
+    if (stat_headers) {
+        size_t len = strlen(resp);
+        response_stat_headers(req, resp + len, sizeof(resp) - len);
+    }
     strcat(resp, "\r\n");
+    req->status = "200";
     if (writen(cfd, resp, strlen(resp)) == -1) {    // can use send() sys call
         errMsg("response_serve_static(): writen(): Failed to write headers to socket. Peer may have closed connection.");
+        req->keep_alive = 0;
+        close(in_fd);
         return;
     }
 
-    // Body
-    int in_fd;
-    if ((in_fd = open(filename, O_RDONLY)) < 0) {
-        errMsg("Failed to open file %s", filename);
-        request_error(cfd, "500", "Internal Server Error", "");
-        return;
-    }
+    // Body. sendfile() returns early if the write timeout expires.
+    TRACE2(send_start, cfd, filesize);
     off_t offset = 0;
-    ssize_t nbytes = sendfile(cfd, in_fd, &offset, filesize);   // Can use mmap(). TCP_CORK option?
-    if (nbytes < 0) {
-        errMsg("response_serve_static(): sendfile(): Failed to send file to socket");
+    ssize_t nbytes = 0;
+    while (offset < filesize) {
+        nbytes = sendfile(cfd, in_fd, &offset, filesize - offset);   // Can use mmap(). TCP_CORK option?
+        if (nbytes <= 0 && !(nbytes == -1 && errno == EINTR))
+            break;
+    }
+    close(in_fd);
+    TRACE2(send_done, cfd, (nbytes < 0) ? nbytes : offset);
+    request_phase_end(req, STATUS_PHASE_SEND);
+    req->bytes = offset;
+    if (offset < filesize) {
+        /* The client got a truncated response: it can't tell where the next one starts */
+        req->keep_alive = 0;
+        if (nbytes < 0)
+            errMsg("response_serve_static(): sendfile(): Failed to send file to socket");
+    }
+}
+
+/* Serve the request path 'path' of 'len' bytes from the archive: the gzip
+   variant if the client accepts it, or a 304 if the client already has the
+   variant */
+static void
+response_get_packed(request_t *req, const char *path, size_t len)
+{
+    pack_t *pack = pack_acquire();
+    const pack_entry *e = (pack != NULL) ? pack_lookup(pack, path, len) : NULL;
+    request_phase_end(req, STATUS_PHASE_OPEN);
+    if (e == NULL) {
+        pack_release(pack);
+        request_error(req, "404", "Not Found", "The requested resource could not be found");
         return;
     }
+
+    const pack_variant *var = &e->variants[PACK_IDENTITY];
+    if (req->accept_gzip && e->variants[PACK_GZIP].hdr_off != 0)
+        var = &e->variants[PACK_GZIP];
+
+    if (req->if_none_match[0] != '\0'
+        && (strstr(req->if_none_match, var->etag) != NULL || !strcmp(req->if_none_match, "*"))) {
+        char resp[MAX_LEN];
+        snprintf(resp, sizeof(resp), "HTTP/1.1 304 Not Modified\r\n"
+                 "Server: Tzou's HTTP server\r\n"
+                 "ETag: %s\r\n"
+                 "Connection: %s\r\n\r\n",
+                 var->etag, req->keep_alive ? "keep-alive" : "close");
+        req->status = "304";
+        if (writen(req->cfd, resp, strlen(resp)) == -1) {
+            errMsg("response_get_packed(): writen(): Failed to write to socket. Peer may have closed connection.");
+            req->keep_alive = 0;
+        }
+        request_phase_end(req, STATUS_PHASE_SEND);
+    }
+    else {
+        response_serve_packed(req, path, pack, var);
+    }
+    pack_release(pack);
 }
 
+/* Send the variant 'var' of the file 'path' of 'pack': the precomputed
+   header, then the body. A small body goes out with the header in one writev() from the
+   mapping; a larger one with sendfile() from the archive, which doesn't copy
+   it through the process. */
 static void
+response_serve_packed(request_t *req, const char *path, pack_t *pack, const pack_variant *var)
+{
+    int cfd = req->cfd;
+    const char *data = pack_data(pack);
+    req->is_static = 1;
+    req->file_size = var->body_len;
+    TRACE3(file_open, cfd, path, var->body_len);
+
+    /* The part of the header that depends on the request */
+    char tail[BUF_SIZE];
+    int len = snprintf(tail, sizeof(tail), "Connection: %s\r\n", req->keep_alive ? "keep-alive" : "close");
+    if (stat_headers)
+        len += response_stat_headers(req, tail + len, sizeof(tail) - len - 2);
+    strcpy(tail + len, "\r\n");
+    len += 2;
+
+    struct iovec iov[3] = {
+        { .iov_base = (void *) (data + var->hdr_off), .iov_len = var->hdr_len },
+        { .iov_base = tail, .iov_len = len },
+        { .iov_base = (void *) (data + var->body_off), .iov_len = var->body_len }
+    };
+    int iovcnt = (var->body_len <= PACK_WRITEV_MAX) ? 3 : 2;
+    req->status = "200";
+
+    /* Restart after partial writes */
+    TRACE2(send_start, cfd, var->body_len);
+    struct iovec *iov_p = iov;
+    while (iovcnt > 0) {
+        ssize_t n = writev(cfd, iov_p, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            errMsg("response_serve_packed(): writev(): Failed to write response to socket. Peer may have closed connection.");
+            req->keep_alive = 0;
+            request_phase_end(req, STATUS_PHASE_SEND);
+            return;
+        }
+        while (iovcnt > 0 && n >= iov_p->iov_len) {
+            n -= iov_p->iov_len;
+            iov_p++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov_p->iov_base = (char *) iov_p->iov_base + n;
+            iov_p->iov_len -= n;
+        }
+    }
+
+    off_t offset = var->body_off;
+    off_t end = var->body_off + var->body_len;
+    ssize_t nbytes = 0;
+    if (var->body_len > PACK_WRITEV_MAX) {
+        while (offset < end) {
+            nbytes = sendfile(cfd, pack_fd(pack), &offset, end - offset);
+            if (nbytes <= 0 && !(nbytes == -1 && errno == EINTR))
+                break;
+        }
+    }
+    else {
+        offset = end;
+    }
+    TRACE2(send_done, cfd, (nbytes < 0) ? nbytes : offset - (off_t) var->body_off);
+    request_phase_end(req, STATUS_PHASE_SEND);
+    req->bytes = offset - var->body_off;
+    if (offset < end) {
+        /* The client got a truncated response: it can't tell where the next one starts */
+        req->keep_alive = 0;
+        if (nbytes < 0)
+            errMsg("response_serve_packed(): sendfile(): Failed to send file to socket");
+    }
+}
+
+/* Serve the server statistics, in Prometheus format if the query string asks
+   for it (?format=prometheus), or else as plain text */
+static void
+response_serve_status(request_t *req, const char *query)
+{
+    status_format format = strstr(query, "format=prometheus") ? STATUS_FORMAT_PROMETHEUS : STATUS_FORMAT_TEXT;
+
+    size_t len;
+    char *body = status_render(format, &len);
+    if (body == NULL) {
+        request_error(req, "500", "Internal Server Error", "");
+        return;
+    }
+
+    char resp[MAX_LEN];
+    snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\n"
+             "Server: Tzou's HTTP server\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %lu\r\n"
+             "Connection: %s\r\n"
+             "Cache-Control: no-cache\r\n\r\n",
+             (format == STATUS_FORMAT_PROMETHEUS) ? "text/plain; version=0.0.4" : "text/plain", len,
+             req->keep_alive ? "keep-alive" : "close");
+
+    req->status = "200";
+    if (writen(req->cfd, resp, strlen(resp)) == -1 || writen(req->cfd, body, len) == -1) {
+        errMsg("response_serve_status(): writen(): Failed to write to socket. Peer may have closed connection.");
+        req->keep_alive = 0;
+    }
+    else {
+        req->bytes = len;
+    }
+    request_phase_end(req, STATUS_PHASE_SEND);
+
+    free(body);
+}
+
+/* Format the header of a 200 response into 'resp', a buffer of BUF_SIZE
+   bytes, without the terminating empty line */
+void
+response_format_header(char *resp, const char *content_type, int filesize, int keep_alive)
+{
+    snprintf(resp, BUF_SIZE, "HTTP/1.1 200 OK\r\n"
+             "Server: Tzou's HTTP server\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %d\r\n"
+             "Connection: %s\r\n",
+             content_type, filesize, keep_alive ? "keep-alive" : "close");
+}
+
+/*
+Format the Stat-req-* and Stat-thread-* headers of the request into 'buf'.
+Times are in milliseconds since request handling was set up. The request is
+complete once its file is ready to be sent, just before the response is
+written. Only counters are shared between the threads; they are updated
+atomically or under the job queue lock the thread pool already takes.
+Returns the length of the headers.
+*/
+static int
+response_stat_headers(request_t *req, char *buf, size_t size)
+{
+    const thpool_job_info *job = thpool_current_job();
+    if (job == NULL)
+        return 0;
+
+    unsigned long complete_count = __atomic_fetch_add(&num_completed, 1, __ATOMIC_RELAXED);
+    uint64_t complete_ns = get_monotonic_ns();
+
+    /* The thread counts include this request */
+    int id = thpool_thread_id();
+    uint64_t requests, static_files;
+    status_thread_counts(id, &requests, &static_files);
+
+    int len = snprintf(buf, size,
+                       "Stat-req-arrival-count: %lu\r\n"
+                       "Stat-req-arrival-time: %.3f\r\n"
+                       "Stat-req-dispatch-count: %lu\r\n"
+                       "Stat-req-dispatch-time: %.3f\r\n"
+                       "Stat-req-complete-count: %lu\r\n"
+                       "Stat-req-complete-time: %.3f\r\n"
+                       "Stat-req-age: %lu\r\n"
+                       "Stat-thread-id: %d\r\n"
+                       "Stat-thread-count: %llu\r\n"
+                       "Stat-thread-static: %llu\r\n"
+                       "Stat-thread-dynamic: 0\r\n",
+                       job->arrival_seq, (job->enqueue_ns - start_ns) / 1e6,
+                       job->dispatch_seq, (job->dispatch_ns - start_ns) / 1e6,
+                       complete_count, (complete_ns - start_ns) / 1e6,
+                       job->age, id,
+                       (unsigned long long) requests + 1, (unsigned long long) static_files + 1);
+
+    return (len < 0 || len >= size) ? 0 : len;
+}
+
+void
 response_get_content_type(char *filename, char *content_type)
 {
     const char *ext;
@@ -273,23 +1160,27 @@ response_get_content_type(char *filename, char *content_type)
 }
 
 static void
-request_error(int cfd, const char *status_code, const char *reason, const char *msg)
+request_error(request_t *req, const char *status_code, const char *reason, const char *msg)
 {   // Serve static webpage for each error code?
     char body[MAX_LEN];
-    sprintf(body, "<!DOCTYPE html><html lang=\"en\"><head><title>Error page</title></head>");
-    sprintf(body, "%s<body><h1><b>%s %s</b></h1>", body, status_code, reason);
-    sprintf(body, "%s<p>%s</p></body></html>", body, msg);
+    int body_len = snprintf(body, sizeof(body), "<!DOCTYPE html><html lang=\"en\"><head><title>Error page</title></head>"
+                            "<body><h1><b>%s %s</b></h1><p>%s</p></body></html>", status_code, reason, msg);
+    body_len = min(body_len, (int) sizeof(body) - 1);
 
     char resp[BUF_SIZE];
-    sprintf(resp, "HTTP/1.0 %s %s\r\n", status_code, reason);
-    sprintf(resp, "%sServer: Tzou's HTTP server\r\n", resp);
-    sprintf(resp, "%sContent-Type: %s\r\n", resp, "text/html");
-    sprintf(resp, "%sContent-Length: %lu\r\n", resp, strlen(body));
-    strcat(resp, "\r\n");
-    strcat(resp, body);
+    int len = snprintf(resp, sizeof(resp), "HTTP/1.1 %s %s\r\n", status_code, reason);
+    len += snprintf(resp + len, sizeof(resp) - len, "Server: Tzou's HTTP server\r\n"
+                    "Content-Type: text/html\r\n"
+                    "Content-Length: %d\r\n"
+                    "Connection: %s\r\n\r\n",
+                    body_len, req->keep_alive ? "keep-alive" : "close");
+    len += snprintf(resp + len, sizeof(resp) - len, "%s", body);
 
-    if (writen(cfd, resp, strlen(resp)) == -1) {    // can use send(). handle error retval of -1.
+    req->status = status_code;
+    req->bytes = body_len;
+    if (writen(req->cfd, resp, len) == -1) {    // can use send(). handle error retval of -1.
         errMsg("request_error(): writen(): Failed to write to socket. Peer may have closed connection.");
-        return;
+        req->keep_alive = 0;
     }
+    request_phase_end(req, STATUS_PHASE_SEND);
 }
@@ -5,7 +5,61 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include <sys/socket.h>
+#include "../utils/async_log.h"
+#include "../utils/utils.h"
+#include "../utils/timer_wheel.h"
+
+struct event_loop;
+
+/* Connection accepted by an event loop, handed to a worker thread for each
+   request and back to the event loop between requests */
+typedef struct conn {
+    int fd;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;   /* Peer address returned by accept() */
+    struct event_loop *loop;        /* Event loop owning the connection */
+    rbuf_t *rbuf;                   /* Read buffer, only allocated while requests are read */
+    uint64_t deadline_ns;           /* Time by which the request headers must have been read */
+    size_t scanned;                 /* Bytes of the buffered request searched for the end of its headers */
+    unsigned int num_requests;      /* Requests served on the connection */
+    int cpu;                        /* CPU that processed its packets, or -1 */
+    int registered;                 /* Added to the epoll set of the event loop */
+    tw_timer timer;                 /* Header or idle timeout, while the event loop waits for a request */
+    struct conn *next;              /* Connections handed back to the event loop */
+} conn_t;
+
+/* Request handling options */
+typedef struct {
+    unsigned int num_threads;       /* Worker threads serving requests */
+    alog_t *access_log;             /* Log of every request served, or NULL */
+    const char *status_url;         /* URL of the statistics page, or NULL */
+    int stat_headers;               /* Add the Stat-req-* and Stat-thread-* headers to file responses */
+    alog_t *slow_log;               /* Log of the slow requests with their phases, or NULL */
+    unsigned int slow_ms;           /* Time from arrival to end of response that makes a request slow */
+    unsigned int body_timeout_ms;   /* Time to receive a request body */
+    size_t read_buf_size;           /* Size of the read buffer of a connection */
+    const char *pack;               /* Archive to serve the files from instead of the document root, or NULL */
+} request_opts;
+
+int request_init(const request_opts *opts);
 
 void request_handle(void *arg);
 
+int request_abort_all(void);
+
+void request_thread_start(int id);
+
+void request_thread_exit(int id);
+
+unsigned long request_peek_size(const char *data, size_t len);
+
+void request_shed(int cfd);
+
+void request_rate_limited(int cfd);
+
+void request_timed_out(int cfd);
+
+void request_too_large(int cfd);
+
 #endif
@@ -0,0 +1,28 @@
+/************************************************\
+ * Internal functions of request.c, exposed for *
+ * the microbenchmarks (bench/microbench.c)     *
+\************************************************/
+
+#ifndef REQUEST_INTERNAL_H
+#define REQUEST_INTERNAL_H
+
+#include "../utils/utils.h"
+
+#define MAX_LEN 1024
+
+/* Request header field */
+typedef struct hdr_t {
+    char *name;
+    char *value;
+    struct hdr_t *next;
+} hdr_t;
+
+hdr_t **request_parse_hdr(rbuf_t *rbuf_p, int cfd, int *error_p);
+
+void request_destroy_hdr(hdr_t **hdr_pp);
+
+void response_format_header(char *resp, const char *content_type, int filesize, int keep_alive);
+
+void response_get_content_type(char *filename, char *content_type);
+
+#endif
@@ -1,27 +1,80 @@
 
+#define _GNU_SOURCE
+
 #include "../utils/tlpi_hdr.h"
 #include "../utils/inet_sockets.h"
+#include "../utils/affinity.h"
+#include "../utils/async_log.h"
+#include "../utils/become_daemon.h"
 #include "../threadpool/threadpool.h"
 #include "request.h"
+#include "status.h"
+#include "event_loop.h"
+#include "upgrade.h"
+#include "config.h"
+#include "warmup.h"
+#include "pack.h"
 #include <signal.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
 
-
-//#define FD_BUF_SIZE 20  /* Obtain from command line args later */
-#define SERVICE "http"
-#define BACKLOG 20      /* Obtain from command line args or file later */
-#define NUM_THREADS 4
-#define MAX_NUM_JOBS 100
+#define ERROR_LOG_RING_SIZE (16*1024)   /* Per thread buffer of the queued error messages */
 
 
 static volatile sig_atomic_t run_forever = 1;
+static volatile sig_atomic_t handed_off;    /* The listening socket was handed to a new binary */
+static server_config cfg;
+static alog_t *access_log;
+static alog_t *slow_log;
+static alog_t *error_log;       /* Queue of the error messages of a serving process */
+static int error_syslog;        /* Error messages go to syslog */
+static event_loop *loop;
+static char **server_argv;      /* Arguments to start a new binary with on SIGUSR2 */
+static int start_dir;           /* Directory the server was started in, for the arguments */
+static int inherited;           /* The listening socket was taken over from an upgraded process */
+static int supervised;          /* This process is one of several serving processes */
+static rate_limiter *shared_limiter;    /* Rate limiter of all the serving processes, or NULL */
+static void serve(int lfd, unsigned int proc, unsigned int num_procs);
+static void supervise(int lfd, unsigned int num_procs);
+static void print_address(int lfd);
+static int error_log_open(void);
+static int error_output(const char *msg, size_t len, int mayBlock);
+static pid_t pid_file_running(void);
+static int pid_file_write(void);
+static void pid_file_remove(void);
+static void upgrade_serving(void);
+static void upgrade_failed(void);
 static void *handle_signals();
 
 
 int
 main(int argc, char *argv[])
 {
-    int lfd, cfd;   /* Listening and connection socket file descriptors */
+    int lfd;        /* Listening socket file descriptor */
+    server_argv = argv;
+
+    if (config_parse(&cfg, argc, argv) == -1 || config_finish(&cfg) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if (cfg.check_only) {
+        config_print(stdout, &cfg);
+        exit(EXIT_SUCCESS);
+    }
+
+    /* Paths of the settings are relative to the directory the server was
+       started in */
+    start_dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (start_dir == -1) {
+        errExit("main(): Failed to open working directory");
+    }
 
     /* Create signal mask to block delivery of signals to threads in thread pool */
     sigset_t set;
@@ -34,69 +87,678 @@ main(int argc, char *argv[])
         errExit("main(): sigprocmask(): Failed to create signal mask");
     }
 
+    /* Create a listening socket, or take over the one of the process that
+       started this one to upgrade (see upgrade.c) */
+    inherited = upgrade_inherit(&lfd);
+    if (inherited == -1) {
+        errExit("main(): upgrade_inherit(): Failed to take over listening socket");
+    }
+    if (!inherited && cfg.pid_file[0] != '\0') {
+        pid_t pid = pid_file_running();
+        if (pid > 0) {
+            fatal("main(): Already running as process %ld (see %s)", (long) pid, cfg.pid_file);
+        }
+    }
+    if (!inherited) {
+        socklen_t addrlen;
+        lfd = inetListen(cfg.service, cfg.backlog, &addrlen);
+        if (lfd == -1) {
+            errExit("main(): inetListen(): Failed to create a listening socket");
+        }
+    }
+
+    /* Make the listening socket non-blocking so the backlog can be drained until EAGAIN. The
+       connections themselves are left blocking since the workers use blocking reads and writes. */
+    int flags = fcntl(lfd, F_GETFL);
+    if (flags == -1 || fcntl(lfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        errExit("main(): fcntl(): Failed to make listening socket non-blocking");
+    }
+
+    /* A new binary started by SIGUSR2 gets the socket through upgrade.c only,
+       so that closing it there stops the listening */
+    if (fcntl(lfd, F_SETFD, FD_CLOEXEC) == -1) {
+        errExit("main(): fcntl(): Failed to set FD_CLOEXEC on listening socket");
+    }
+
+    /* The size based policies peek at the request line after accept(), so
+       let the kernel hold back connections until the request has arrived */
+    if (cfg.sched == THPOOL_SCHED_SFF || cfg.sched == THPOOL_SCHED_SFF_AGING) {
+        int secs = cfg.defer_accept_secs;
+        if (setsockopt(lfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)) == -1) {
+            errMsg("main(): setsockopt(): Failed to set TCP_DEFER_ACCEPT");
+        }
+    }
+
+    /* Detach from the terminal once listening, so that a failure to listen
+       is still reported there. A new binary started by SIGUSR2 is already
+       detached. */
+    if (cfg.daemon && !inherited && becomeDaemon(BD_NO_CHDIR | BD_NO_CLOSE_FILES | BD_NO_UMASK0) == -1) {
+        errExit("main(): becomeDaemon(): Failed to run in the background");
+    }
+
+    if (error_log_open() == -1) {
+        errExit("main(): Failed to open error log %s", cfg.error_log);
+    }
+    errSetOutput(error_output);
+
+    /* A new binary started by SIGUSR2 takes the PID file over from the
+       process that started it once it serves (see upgrade_serving()) */
+    if (cfg.pid_file[0] != '\0') {
+        if (!inherited && pid_file_write() == -1) {
+            errExit("main(): Failed to write PID file %s", cfg.pid_file);
+        }
+        if (atexit(pid_file_remove) != 0) {
+            errMsg("main(): atexit(): The PID file will be left behind");
+        }
+    }
+
+    /* Files are opened relative to the document root */
+    if (chdir(cfg.docroot) == -1) {
+        errExit("main(): chdir(): Failed to enter document root %s", cfg.docroot);
+    }
+
+    unsigned int num_procs = cfg.worker_processes;
+    if (num_procs == 1) {
+        serve(lfd, 0, 1);
+    }
+    else {
+        supervise(lfd, num_procs);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+
+/* ========================== SERVING PROCESS ============================ */
+
+
+/*
+Serve the connections of the listening socket 'lfd' until a termination
+signal, as process 'proc' of 'num_procs' serving processes.
+*/
+static void
+serve(int lfd, unsigned int proc, unsigned int num_procs)
+{
     /* Create thread pool */
-    threadpool thpool = thpool_init(NUM_THREADS, MAX_NUM_JOBS);
+    thpool_attr attr;
+    thpool_attr_init(&attr);
+    attr.sched = cfg.sched;
+    attr.max_wait_ms = cfg.sched_max_wait_ms;
+    attr.max_spin_us = cfg.max_spin_us;
+    attr.codel_target_us = cfg.shed_target_ms * 1000;
+    attr.codel_interval_ms = cfg.shed_interval_ms;
+    attr.job_ages = cfg.stat_headers;
+    if (cfg.perf_counters) {
+        attr.on_thread_start = request_thread_start;
+        attr.on_thread_exit = request_thread_exit;
+    }
+    int size_based = (attr.sched == THPOOL_SCHED_SFF || attr.sched == THPOOL_SCHED_SFF_AGING);
+
+    /* Pin workers to CPUs. With several processes, each process gets one
+       of the CPUs for all its workers. */
+    int cpus[AFFINITY_MAX_CPUS];
+    int num_cpus = 0;
+    if (cfg.affinity == AFFINITY_PHYSICAL) {
+        num_cpus = affinity_physical_cpus(cpus, AFFINITY_MAX_CPUS);
+    }
+    else if (cfg.affinity == AFFINITY_LIST) {
+        num_cpus = affinity_parse_cpu_list(cfg.cpu_list, cpus, AFFINITY_MAX_CPUS);
+    }
+    if (num_cpus == -1) {
+        errExit("serve(): Failed to determine CPUs to pin worker threads to");
+    }
+    attr.cpus = cpus;
+    attr.num_cpus = num_cpus;
+    if (num_procs > 1 && num_cpus > 0) {
+        attr.cpus = &cpus[proc % num_cpus];
+        attr.num_cpus = 1;
+    }
+
+    /* Queue the error messages from here on, before the threads that could
+       write them in bursts */
+    alog_t *elog = error_syslog ? alog_open_syslog(LOG_ERR, ERROR_LOG_RING_SIZE)
+                                : alog_open_fd(STDERR_FILENO, ERROR_LOG_RING_SIZE);
+    if (elog == NULL) {
+        errExit("serve(): alog_open(): Failed to open error log");
+    }
+    __atomic_store_n(&error_log, elog, __ATOMIC_RELEASE);
+
+    /* Open the access log before the workers that write to it. Processes
+       sharing a log can't each rotate it: rotate with SIGHUP instead. */
+    access_log = alog_open(cfg.access_log_path, (num_procs > 1) ? 0 : cfg.access_log_rotate_bytes, 0);
+    if (access_log == NULL) {
+        errExit("serve(): alog_open(): Failed to open access log");
+    }
+
+    if (cfg.slow_log_ms > 0) {
+        slow_log = alog_open(cfg.slow_log_path, (num_procs > 1) ? 0 : cfg.slow_log_rotate_bytes, cfg.slow_log_ring_size);
+        if (slow_log == NULL) {
+            errExit("serve(): alog_open(): Failed to open slow request log");
+        }
+    }
+
+    status_set_proc(proc);
+    request_opts ropts = {
+        .num_threads = cfg.num_threads,
+        .access_log = access_log,
+        .status_url = (cfg.status_url[0] != '\0') ? cfg.status_url : NULL,
+        .stat_headers = cfg.stat_headers,
+        .slow_log = slow_log,
+        .slow_ms = cfg.slow_log_ms,
+        .body_timeout_ms = cfg.body_timeout_ms,
+        .read_buf_size = cfg.read_buf_size,
+        .pack = (cfg.pack[0] != '\0') ? cfg.pack : NULL
+    };
+    if (request_init(&ropts) == -1) {
+        errExit("serve(): request_init(): Failed to initialize request handling");
+    }
+
+    threadpool thpool = thpool_init(cfg.num_threads, cfg.max_num_jobs, &attr);
     if (thpool == NULL) {
-        errExit("main(): thpool_init(): Failed to create thread pool");
+        errExit("serve(): thpool_init(): Failed to create thread pool");
+    }
+
+    /* Load the files into the caches before accepting. The caches are the
+       kernel's, shared by all serving processes: one of them does it. */
+    if (cfg.warmup && proc == 0) {
+        warmup_opts wopts = {
+            .manifest = (cfg.warmup_manifest[0] != '\0') ? cfg.warmup_manifest : NULL,
+            .max_bytes = cfg.warmup_max_bytes
+        };
+        warmup_stats wstats;
+        if (warmup_run(thpool, cfg.num_threads, &wopts, &wstats) == -1) {
+            errMsg("serve(): warmup_run(): Warmup failed, serving with cold caches");
+        }
+        else {
+            printf("Warmed up %u files (%u failed to open), read ahead %.1f MB in %.1f ms\n", wstats.files, wstats.failed,
+                   wstats.bytes / (1024.0 * 1024.0), wstats.ns / 1e6);
+            fflush(stdout);
+        }
     }
 
-    /* Create a listening socket */
-    socklen_t addrlen;
-    lfd = inetListen(SERVICE, BACKLOG, &addrlen);
-    if (lfd == -1) {
-        errExit("main(): inetListen(): Failed to create a listening socket");
+    event_loop_opts opts = {
+        .accept_batch = cfg.accept_batch,
+        .size_based = size_based,
+        .incoming_cpu = (num_cpus > 0),
+        .header_timeout_ms = cfg.header_timeout_ms,
+        .read_buf_size = cfg.read_buf_size,
+        .idle_timeout_ms = cfg.idle_timeout_ms,
+        .write_timeout_ms = cfg.write_timeout_ms,
+        .tick_ms = cfg.timer_tick_ms,
+        .shed = (cfg.shed_target_ms > 0),
+        .rate_limit = cfg.rate_limit,
+        .rate_burst = cfg.rate_burst,
+        .rate_clients = cfg.rate_clients,
+        .limiter = shared_limiter,
+        .shared_listener = (num_procs > 1)
+    };
+    loop = event_loop_create(lfd, thpool, &opts);
+    if (loop == NULL) {
+        errExit("serve(): event_loop_create(): Failed to create event loop");
     }
 
      /* Create a thread to accept incoming signals synchronously */
     pthread_t signal_thr;
     if (pthread_create(&signal_thr, NULL, handle_signals, lfd) > 0) {
-        errExit("main(): pthread_create(): Failed to create signal handling thread");
+        errExit("serve(): pthread_create(): Failed to create signal handling thread");
     }
 
     /* Detach the signal handling thread */
     if (pthread_detach(signal_thr) > 0) {
-        errExit("main(): pthread_detach(): Failed to detach signal handling thread");
+        errExit("serve(): pthread_detach(): Failed to detach signal handling thread");
+    }
+
+    /* The supervisor reports for the whole set of processes */
+    if (!supervised) {
+        print_address(lfd);
+
+        /* Everything is set up: the old process can stop accepting */
+        upgrade_serving();
+    }
+
+    /* Accept connections and hand their requests to the thread pool until a termination signal */
+    event_loop_run(loop);
+
+    /* Stop accepting so that new connections are refused rather than left in
+       the backlog (after an upgrade, or with other processes, those accept
+       them), and close the connections that are between requests. Done here
+       rather than in the signal handling thread so that the socket is not
+       closed under it. */
+    if (!supervised && !handed_off && shutdown(lfd, SHUT_RD) == -1) {
+        errMsg("serve(): shutdown(): Failed to close read channel of listening socket");
+    }
+    close(lfd);
+    int num_idle = event_loop_close_idle(loop);
+    if (num_idle > 0) {
+        printf("Closed %d idle connections\n", num_idle);
+    }
+
+    /* Let queued and in-flight requests complete, then cut off the stragglers */
+    if (thpool_drain(thpool, cfg.drain_timeout_ms) == -1) {
+        errMsg("serve(): Shutdown deadline expired, aborted %d in-flight requests", request_abort_all());
+    }
+
+    if (!supervised) {
+        /* Report how long idle workers took to pick up new connections */
+        hist_t spun, parked;
+        thpool_wakeup_latency(thpool, &spun, &parked);
+        hist_print(stdout, "Worker wakeup latency (spinning)", &spun);
+        hist_print(stdout, "Worker wakeup latency (parked)", &parked);
+
+        /* Report where the requests spent their time */
+        status_print(stdout);
+    }
+
+    thpool_destroy(thpool);
+    event_loop_destroy(loop);
+
+    /* The workers are gone: flush what they logged */
+    if (alog_dropped(access_log) > 0) {
+        errMsg("serve(): %llu access log lines were dropped", (unsigned long long) alog_dropped(access_log));
     }
+    alog_close(access_log);
+    if (slow_log != NULL) {
+        if (alog_dropped(slow_log) > 0) {
+            errMsg("serve(): %llu slow request log lines were dropped", (unsigned long long) alog_dropped(slow_log));
+        }
+        alog_close(slow_log);
+    }
+
+    /* Flush the queued error messages, and write the later ones directly */
+    __atomic_store_n(&error_log, NULL, __ATOMIC_RELEASE);
+    if (alog_dropped(elog) > 0) {
+        errMsg("serve(): %llu error messages were dropped", (unsigned long long) alog_dropped(elog));
+    }
+    alog_close(elog);
+
+    fflush(stdout);
+    exit(EXIT_SUCCESS);
+}
 
+static void
+print_address(int lfd)
+{
     /* Print listening socket address */
     struct sockaddr my_addr;  /* Socket address buffer */
     socklen_t len = sizeof(my_addr); /* Size of socket address buffer */
     char addr_str[IS_ADDR_STR_LEN];
     if (getsockname(lfd, &my_addr, &len) == -1) {
-        errExit("main(): getsockname(): Failed to get listening socket address");
+        errExit("print_address(): getsockname(): Failed to get listening socket address");
     }
-    printf("Starting server at %s\n", inetAddressStr(&my_addr, len, addr_str, IS_ADDR_STR_LEN));
+    printf("Starting server at %s%s\n", inetAddressStr(&my_addr, len, addr_str, IS_ADDR_STR_LEN),
+           inherited ? " (upgrade)" : "");
     fflush(stdout);
+}
+
+
+/* ========================== ERRORS AND PID FILE ============================ */
 
-    for (;run_forever;) {
 
-        /* Accept incoming connections */
-        cfd = accept(lfd, NULL, NULL);
-        if (cfd == -1) {
-            errMsg("main(): Failed to accept connection");
-            continue;
+/* Set up the error log: syslog, or standard error, replaced by the error log
+   file if there is one. Called again on SIGHUP to reopen the file. Returns
+   0, or -1 on error. */
+static int
+error_log_open(void)
+{
+    if (!strcmp(cfg.error_log, "syslog")) {
+        if (!error_syslog) {
+            openlog(program_invocation_short_name, LOG_PID | LOG_NDELAY, LOG_DAEMON);
+            error_syslog = 1;
         }
+        return 0;
+    }
+    if (!strcmp(cfg.error_log, "-")) {
+        return 0;
+    }
 
-        /* Assign connection to a thread */
-        if (thpool_add_work(thpool, request_handle, cfd) == -1) {
-            errMsg("main(): Failed to add work to thread pool");
-            // Should we wait for one job to complete? add this new method to threadpool API?
+    int fd = openat(start_dir, cfg.error_log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    if (dup2(fd, STDERR_FILENO) == -1) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+Output of errMsg() and the like (see errSetOutput()). The messages of a
+serving process that carries on are queued on its error log, so that a burst
+of errors (e.g. many clients going away in the middle of responses) doesn't
+stall the workers on writes to a terminal or to syslog. They are dropped,
+and counted, when the queue of the thread is full. The supervisor, and the
+messages before exiting, are written directly.
+*/
+static int
+error_output(const char *msg, size_t len, int mayBlock)
+{
+    alog_t *log = __atomic_load_n(&error_log, __ATOMIC_ACQUIRE);
+    if (log != NULL && !mayBlock) {
+        alog_write(log, msg, len);
+        return 0;
+    }
+
+    if (error_syslog) {
+        if (len > 0 && msg[len - 1] == '\n') {
+            len--;
+        }
+        syslog(LOG_ERR, "%.*s", (int) len, msg);
+        return 0;
+    }
+    return -1;
+}
+
+/* Return the process ID in the PID file, or 0 if there is none */
+static pid_t
+pid_file_read(void)
+{
+    char buf[32];
+    int fd = openat(start_dir, cfg.pid_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    return (pid_t) strtol(buf, NULL, 10);
+}
+
+/* Return the process ID of the server in the PID file if it is still
+   running, or 0 */
+static pid_t
+pid_file_running(void)
+{
+    pid_t pid = pid_file_read();
+    if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM)) {
+        return pid;
+    }
+    return 0;
+}
+
+/* Write the process ID to the PID file. The file is replaced by a rename so
+   that it is never seen partly written. Returns 0, or -1 on error. */
+static int
+pid_file_write(void)
+{
+    char tmp[PATH_MAX], buf[32];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", cfg.pid_file) >= sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = openat(start_dir, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    int len = snprintf(buf, sizeof(buf), "%ld\n", (long) getpid());
+    if (write(fd, buf, len) != len || close(fd) == -1) {
+        unlinkat(start_dir, tmp, 0);
+        return -1;
+    }
+
+    if (renameat(start_dir, tmp, start_dir, cfg.pid_file) == -1) {
+        unlinkat(start_dir, tmp, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/* Tell the process that started this one on SIGUSR2, if any, that this one
+   serves, taking its PID file over first. A process that fails to get here
+   is killed by the old one, and must not have left its PID in the file. */
+static void
+upgrade_serving(void)
+{
+    if (inherited && cfg.pid_file[0] != '\0' && pid_file_write() == -1) {
+        errMsg("upgrade_serving(): Failed to write PID file %s", cfg.pid_file);
+    }
+    upgrade_ready();
+}
+
+/* The new binary started on SIGUSR2 was killed: claim the PID file back, in
+   case it wrote the file before it could report that it serves */
+static void
+upgrade_failed(void)
+{
+    if (cfg.pid_file[0] != '\0' && pid_file_read() != getpid() && pid_file_write() == -1) {
+        errMsg("upgrade_failed(): Failed to rewrite PID file %s", cfg.pid_file);
+    }
+}
+
+/* Remove the PID file on exit, unless it has been taken over by a new
+   binary, or this is a serving process of the supervisor that wrote it */
+static void
+pid_file_remove(void)
+{
+    if (pid_file_read() == getpid() && unlinkat(start_dir, cfg.pid_file, 0) == -1) {
+        errMsg("pid_file_remove(): Failed to remove PID file %s", cfg.pid_file);
+    }
+}
+
+
+/* ========================== SUPERVISOR ============================ */
+
+
+/* Serving process, as seen by the supervisor */
+typedef struct {
+    pid_t pid;                  /* 0 if not running */
+    uint64_t started_ns;
+    uint64_t restart_ns;        /* When to restart it, if not running */
+} serving_proc;
+
+/* Start serving process 'p' of 'procs' */
+static void
+spawn(int lfd, serving_proc *procs, unsigned int p, unsigned int num_procs)
+{
+    pid_t supervisor = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        errMsg("spawn(): fork(): Failed to start serving process %u", p);
+        procs[p].restart_ns = get_monotonic_ns() + (uint64_t) cfg.restart_delay_ms * 1000000;
+        return;
+    }
+
+    if (pid == 0) {
+        /* Don't outlive the supervisor */
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1 || getppid() != supervisor) {
+            _exit(EXIT_FAILURE);
+        }
+        supervised = 1;
+        serve(lfd, p, num_procs);
+    }
+
+    procs[p].pid = pid;
+    procs[p].started_ns = get_monotonic_ns();
+}
+
+/* Send 'sig' to the running serving processes */
+static void
+signal_all(serving_proc *procs, unsigned int num_procs, int sig)
+{
+    unsigned int p;
+    for (p = 0; p < num_procs; p++) {
+        if (procs[p].pid > 0 && kill(procs[p].pid, sig) == -1) {
+            errMsg("signal_all(): kill(): Failed to signal process %ld", (long) procs[p].pid);
+        }
+    }
+}
+
+/*
+Serve the connections of the listening socket 'lfd' with 'num_procs'
+processes sharing it, and restart those that die. Each process runs its own
+thread pool and event loop, so that a crash only takes down the connections
+of one process, and the processes share no locks or allocator arenas. Their
+statistics are kept in shared memory (see status.c), so that the status
+page of any of them, and the report of the supervisor on exit, cover all.
+So are the buckets of the rate limiter, so that the limit of a client holds
+across the processes its connections land on.
+
+A process that dies is restarted right away, or restart-delay-ms after it
+was started if it died sooner, so that one that fails on startup doesn't
+spin. Termination signals and SIGHUP are forwarded to the processes; on
+SIGUSR2 the supervisor hands the listening socket to a new binary, and then
+stops its processes.
+
+The supervisor itself never starts threads, so that it can fork safely.
+*/
+static void
+supervise(int lfd, unsigned int num_procs)
+{
+    if (status_share(num_procs, cfg.num_threads) == -1) {
+        errExit("supervise(): status_share(): Failed to share statistics");
+    }
+
+    /* A client spreads over the processes: they limit it together */
+    if (cfg.rate_limit > 0) {
+        shared_limiter = rl_create(cfg.rate_limit, cfg.rate_burst, cfg.rate_clients, 1);
+        if (shared_limiter == NULL) {
+            errExit("supervise(): rl_create(): Failed to create shared rate limiter");
+        }
+    }
+
+    serving_proc *procs = (serving_proc *) calloc(num_procs, sizeof(*procs));
+    if (procs == NULL) {
+        errExit("supervise(): Failed to allocate memory for serving processes");
+    }
+
+    unsigned int p, num_running = 0;
+    for (p = 0; p < num_procs; p++) {
+        spawn(lfd, procs, p, num_procs);
+        if (procs[p].pid > 0) {
+            num_running++;
+        }
+    }
+
+    print_address(lfd);
+    printf("Serving with %u processes of %u threads\n", num_procs, cfg.num_threads);
+    fflush(stdout);
+    upgrade_serving();
+
+    sigset_t set;
+    if (sigemptyset(&set) < 0 || sigaddset(&set, SIGCHLD) < 0 || sigaddset(&set, SIGHUP) < 0
+        || sigaddset(&set, SIGINT) < 0 || sigaddset(&set, SIGQUIT) < 0 || sigaddset(&set, SIGTERM) < 0
+        || sigaddset(&set, SIGUSR2) < 0 || sigaddset(&set, SIGPIPE) < 0) {
+        errExit("supervise(): sigaddset()");
+    }
+
+    int stopping = 0;
+    while (!stopping || num_running > 0) {
+        /* Wait for a signal, or for the next delayed restart */
+        uint64_t now = get_monotonic_ns(), next_ns = UINT64_MAX;
+        for (p = 0; p < num_procs && !stopping; p++) {
+            if (procs[p].pid == 0 && procs[p].restart_ns < next_ns) {
+                next_ns = procs[p].restart_ns;
+            }
+        }
+
+        int sig;
+        if (next_ns == UINT64_MAX) {
+            if (sigwait(&set, &sig) > 0) {
+                errExit("supervise(): sigwait()");
+            }
+        }
+        else {
+            uint64_t wait_ns = (next_ns > now) ? next_ns - now : 0;
+            struct timespec ts = { .tv_sec = wait_ns / 1000000000, .tv_nsec = wait_ns % 1000000000 };
+            sig = sigtimedwait(&set, NULL, &ts);
+            if (sig == -1 && errno != EAGAIN && errno != EINTR) {
+                errExit("supervise(): sigtimedwait()");
+            }
+        }
+
+        switch (sig) {
+            case SIGCHLD:
+            {
+                int wstatus;
+                pid_t pid;
+                while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+                    for (p = 0; p < num_procs && procs[p].pid != pid; p++)
+                        ;
+                    if (p == num_procs) {
+                        continue;   /* A new binary that failed to start */
+                    }
+                    procs[p].pid = 0;
+                    num_running--;
+                    if (stopping) {
+                        continue;
+                    }
+
+                    if (WIFSIGNALED(wstatus)) {
+                        errMsg("supervise(): Process %ld killed by signal %d, restarting", (long) pid, WTERMSIG(wstatus));
+                    }
+                    else {
+                        errMsg("supervise(): Process %ld exited with status %d, restarting", (long) pid, WEXITSTATUS(wstatus));
+                    }
+                    procs[p].restart_ns = procs[p].started_ns + (uint64_t) cfg.restart_delay_ms * 1000000;
+                }
+                break;
+            }
+            case SIGINT:
+            case SIGTERM:
+            case SIGQUIT:
+                stopping = 1;
+                signal_all(procs, num_procs, SIGTERM);
+                break;
+            case SIGUSR2:
+                if (!stopping) {
+                    pid_t pid = upgrade_start(lfd, server_argv, start_dir, cfg.upgrade_timeout_ms);
+                    if (pid != -1) {
+                        printf("Handed listening socket to process %ld, draining\n", (long) pid);
+                        fflush(stdout);
+                        stopping = 1;
+                        signal_all(procs, num_procs, SIGTERM);
+                    }
+                    else {
+                        upgrade_failed();
+                    }
+                }
+                break;
+            case SIGHUP:
+                if (error_log_open() == -1) {
+                    errMsg("supervise(): Failed to reopen error log %s", cfg.error_log);
+                }
+                signal_all(procs, num_procs, SIGHUP);
+                break;
+            default:
+                break;
+        }
+
+        /* Restart the processes that are due */
+        now = get_monotonic_ns();
+        for (p = 0; p < num_procs && !stopping; p++) {
+            if (procs[p].pid == 0 && procs[p].restart_ns <= now) {
+                spawn(lfd, procs, p, num_procs);
+                if (procs[p].pid > 0) {
+                    num_running++;
+                }
+            }
         }
     }
 
-    thpool_destroy(thpool);
     close(lfd);
 
-    exit(EXIT_SUCCESS);
+    /* Report where the requests of all processes spent their time */
+    status_print(stdout);
+    free(procs);
 }
 
 
 /*
 This signal handler function is executed in a separate thread. It waits
-for and accepts signals synchronously to initiate a graceful termination
-of this program. shutdown() is used to interrupt the blocking accept() as
-it will return an error. Modifying run_forever boolean trap will then break
-the loop in the main thread.
+for and accepts signals synchronously. SIGHUP reopens the error, access and slow request logs (e.g.
+after it was moved away by logrotate) and reloads the archive served, if any; SIGUSR2 starts the binary anew and hands
+it the listening socket, and terminates this program as below once the new
+process serves; the termination signals initiate a
+graceful termination of this program. event_loop_stop() wakes up the event
+loop in the main thread and makes it return. The main thread then stops
+accepting, closes the idle keep-alive connections and drains the thread pool:
+queued and in-flight requests are given drain-timeout-ms to complete before
+their connections are shut down.
 
 We can also implement this graceful termination by setting up a signal
 handler in the main thread for the signals we want to handle. In this case,
@@ -117,33 +779,66 @@ handle_signals(void *arg)
 
     if (sigaddset(&set, SIGABRT) < 0 || sigaddset(&set, SIGHUP) < 0
         || sigaddset(&set, SIGINT) < 0 || sigaddset(&set, SIGQUIT) < 0
-        || sigaddset(&set, SIGTERM) < 0 || sigaddset(&set, SIGPIPE) < 0) {
+        || sigaddset(&set, SIGTERM) < 0 || sigaddset(&set, SIGPIPE) < 0
+        || sigaddset(&set, SIGUSR2) < 0) {
         errExit("handle_signals(): sigaddset()");
     }
 
-    int sig;
-    if (sigwait(&set, &sig) > 0) {
-        errExit("handle_signals(): sigwait()");
-    }
+    while (run_forever) {
+        int sig;
+        if (sigwait(&set, &sig) > 0) {
+            errExit("handle_signals(): sigwait()");
+        }
+
+        switch (sig) {
+            case SIGINT:
+            case SIGTERM:
+            case SIGQUIT:
+                run_forever = 0;
+                event_loop_stop(loop);
+                break;
+            case SIGUSR2:
+            {
+                /* The supervisor upgrades the whole set of processes */
+                if (supervised) {
+                    break;
+                }
 
-    switch (sig) {
-        case SIGINT:
-        case SIGTERM:
-        case SIGQUIT:
-        case SIGHUP:
-            run_forever = 0;
-            if (shutdown(lfd, SHUT_RD) < 0) {
-                errExit("shutdown(): Failed to close read channel of listening socket");
+                /* The listening socket stays open in the new process: don't
+                   shut it down */
+                pid_t pid = upgrade_start(lfd, server_argv, start_dir, cfg.upgrade_timeout_ms);
+                if (pid != -1) {
+                    printf("Handed listening socket to process %ld, draining\n", (long) pid);
+                    fflush(stdout);
+                    handed_off = 1;
+                    run_forever = 0;
+                    event_loop_stop(loop);
+                }
+                else {
+                    upgrade_failed();
+                }
+                break;
             }
-            break;
-        case SIGABRT:
-            //
-            break;
-        case SIGPIPE:
-            // If server writes to a connection closed by peer
-            break;
-        default:
-            break;
+            case SIGHUP:
+                if (error_log_open() == -1) {
+                    errMsg("handle_signals(): Failed to reopen error log %s", cfg.error_log);
+                }
+                alog_reopen(access_log);
+                if (slow_log != NULL)
+                    alog_reopen(slow_log);
+                if (cfg.pack[0] != '\0' && pack_load(cfg.pack) == -1) {
+                    errMsg("handle_signals(): Failed to reload archive %s, still serving the previous one", cfg.pack);
+                }
+                break;
+            case SIGABRT:
+                //
+                break;
+            case SIGPIPE:
+                // If server writes to a connection closed by peer
+                break;
+            default:
+                break;
+        }
     }
 
     return NULL;
@@ -0,0 +1,511 @@
+/* status.c
+ *
+ * Server statistics
+ *
+ * Each worker thread updates its own counters and latency histograms, padded
+ * to a cache line so that the workers never write to a shared line. They are
+ * only summed up when the statistics are requested.
+ *
+ * Workers that count hardware events (see perf_counters.c) also add up the
+ * counts over the requests they served, reported as per request averages.
+ *
+ * When several processes serve requests, the counters of all of them live in
+ * one shared mapping created before they are forked (status_share()), so that
+ * any process reports the totals, with the threads numbered across processes.
+ * A process restarted in place of another takes over its counters.
+*/
+
+#include "../utils/tlpi_hdr.h"
+#include "../utils/utils.h"
+#include "../utils/histogram.h"
+#include "status.h"
+#include <stdarg.h>
+#include <sys/mman.h>
+
+#define STATUS_NUM_CLASSES 5    /* Status code classes 1xx to 5xx */
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* Counters of one worker thread. Written by that thread only. */
+typedef struct {
+    uint64_t requests;
+    uint64_t static_files;                      /* Requests served with a file */
+    uint64_t bytes;                             /* Response bytes sent */
+    uint64_t responses[STATUS_NUM_CLASSES];     /* Responses by status code class */
+    uint64_t queue_wait_ns;                     /* Time spent by the requests in the job queue */
+    hist_t phases[STATUS_NUM_PHASES];           /* Latency of each phase */
+    uint64_t counted_requests;                  /* Requests with performance counts */
+    uint64_t counters[PERFC_NUM_EVENTS];        /* Performance counts of those requests */
+    unsigned int counted_events;                /* Bit mask of the events counted */
+    int counted_kernel;                         /* Kernel mode was counted too */
+} __attribute__ ((aligned(64))) status_thread;
+
+/* Counters of one process, written by its event loop thread only */
+typedef struct {
+    uint64_t shed;              /* Connections turned away with a 503 */
+    uint64_t rate_limited;      /* Requests turned away with a 429 */
+} __attribute__ ((aligned(64))) status_proc;
+
+/* Growable output buffer */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+} status_buf;
+
+
+/* ========================== GLOBALS ============================ */
+
+
+static status_thread *threads;         /* Threads of this process */
+static unsigned int num_threads;
+static status_thread *all_threads;     /* Threads of all processes, reported */
+static unsigned int num_all_threads;
+static status_proc *procs;
+static unsigned int num_procs;
+static unsigned int proc_index;         /* This process among 'procs' */
+static uint64_t start_ns;
+
+static const char *phase_names[STATUS_NUM_PHASES] = { "queue", "parse", "open", "send" };
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static void status_add(uint64_t *counter, uint64_t value);
+static int status_printf(status_buf *sb, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static void status_render_text(status_buf *sb, const status_thread *total, uint64_t shed, uint64_t rate_limited);
+static void status_render_prometheus(status_buf *sb, uint64_t shed, uint64_t rate_limited);
+static void status_merge_phase(hist_t *h, status_phase phase);
+static unsigned int status_counted_events(int *kernel);
+
+
+/* ========================== STATUS ============================ */
+
+
+/* Set up the counters of 'n' worker threads. After status_share(), the
+   counters of this process are taken from the shared mapping instead. */
+int
+status_init(unsigned int n)
+{
+    if (all_threads != NULL) {
+        if (n * num_procs != num_all_threads) {
+            errMsg("status_init(): Thread count differs from the shared counters");
+            return -1;
+        }
+        threads = &all_threads[proc_index * n];
+        num_threads = n;
+        return 0;
+    }
+
+    if (posix_memalign((void **) &threads, 64, n * sizeof(*threads)) > 0
+            || posix_memalign((void **) &procs, 64, sizeof(*procs)) > 0) {
+        errMsg("status_init(): Failed to allocate memory for thread counters");
+        return -1;
+    }
+    memset(threads, 0, n * sizeof(*threads));
+    memset(procs, 0, sizeof(*procs));
+    num_threads = n;
+    all_threads = threads;
+    num_all_threads = n;
+    num_procs = 1;
+
+    unsigned int i, p;
+    for (i = 0; i < n; i++) {
+        for (p = 0; p < STATUS_NUM_PHASES; p++)
+            hist_init(&threads[i].phases[p]);
+    }
+    start_ns = get_monotonic_ns();
+
+    return 0;
+}
+
+/* Put the counters of 'nprocs' processes of 'n' worker threads each in a
+   shared mapping. Called before the processes are forked, each of which then
+   calls status_set_proc() and status_init(). Returns 0, or -1 on error. */
+int
+status_share(unsigned int nprocs, unsigned int n)
+{
+    size_t size = nprocs * sizeof(status_proc) + (size_t) nprocs * n * sizeof(status_thread);
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        errMsg("status_share(): Failed to map shared counters");
+        return -1;
+    }
+
+    /* The mapping is zeroed and page aligned */
+    procs = (status_proc *) p;
+    num_procs = nprocs;
+    all_threads = (status_thread *) (procs + nprocs);
+    num_all_threads = nprocs * n;
+
+    unsigned int i, ph;
+    for (i = 0; i < num_all_threads; i++) {
+        for (ph = 0; ph < STATUS_NUM_PHASES; ph++)
+            hist_init(&all_threads[i].phases[ph]);
+    }
+    start_ns = get_monotonic_ns();
+
+    return 0;
+}
+
+/* Make this process count in the shared counters of process 'proc' */
+void
+status_set_proc(unsigned int proc)
+{
+    proc_index = proc;
+}
+
+void
+status_timing_set(status_timing *timing, status_phase phase, uint64_t ns)
+{
+    timing->ns[phase] = ns;
+    timing->timed |= 1U << phase;
+}
+
+/* Count a request served by worker thread 'id' and record the durations of
+   its phases. 'status_code' is NULL if no response was sent. 'is_static' is
+   set if the request was served with a file. */
+void
+status_record(int id, const char *status_code, long long bytes, int is_static, const status_timing *timing)
+{
+    if (id < 0 || id >= num_threads)
+        return;
+
+    status_thread *st = &threads[id];
+    status_add(&st->requests, 1);
+    if (is_static)
+        status_add(&st->static_files, 1);
+    if (bytes > 0)
+        status_add(&st->bytes, bytes);
+    if (status_code != NULL && status_code[0] >= '1' && status_code[0] <= '5')
+        status_add(&st->responses[status_code[0] - '1'], 1);
+    if (timing->timed & (1U << STATUS_PHASE_QUEUE))
+        status_add(&st->queue_wait_ns, timing->ns[STATUS_PHASE_QUEUE]);
+
+    unsigned int p;
+    for (p = 0; p < STATUS_NUM_PHASES; p++) {
+        if (timing->timed & (1U << p))
+            hist_record(&st->phases[p], timing->ns[p]);
+    }
+}
+
+/* Count a connection turned away because the server was overloaded */
+void
+status_record_shed(void)
+{
+    status_add(&procs[proc_index].shed, 1);
+}
+
+/* Count a request turned away because its client was over its rate limit */
+void
+status_record_rate_limited(void)
+{
+    status_add(&procs[proc_index].rate_limited, 1);
+}
+
+/* Add the performance counts 'counts' of one request served by worker thread
+   'id'. 'events' is the bit mask of the events counted, and 'kernel' is set
+   if kernel mode was counted. */
+void
+status_record_counters(int id, const uint64_t counts[PERFC_NUM_EVENTS], unsigned int events, int kernel)
+{
+    if (id < 0 || id >= num_threads)
+        return;
+
+    status_thread *st = &threads[id];
+    unsigned int e;
+    for (e = 0; e < PERFC_NUM_EVENTS; e++) {
+        if (events & (1U << e))
+            status_add(&st->counters[e], counts[e]);
+    }
+    __atomic_store_n(&st->counted_events, events, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->counted_kernel, kernel, __ATOMIC_RELAXED);
+    status_add(&st->counted_requests, 1);
+}
+
+/* Return the bit mask of the events counted by any thread, and set 'kernel'
+   if any thread counted kernel mode */
+static unsigned int
+status_counted_events(int *kernel)
+{
+    unsigned int events = 0;
+    *kernel = 0;
+    unsigned int i;
+    for (i = 0; i < num_all_threads; i++) {
+        events |= __atomic_load_n(&all_threads[i].counted_events, __ATOMIC_RELAXED);
+        *kernel |= __atomic_load_n(&all_threads[i].counted_kernel, __ATOMIC_RELAXED);
+    }
+    return events;
+}
+
+/* Store the number of requests, and of requests served with a file, that
+   worker thread 'id' has completed */
+void
+status_thread_counts(int id, uint64_t *requests, uint64_t *static_files)
+{
+    *requests = 0;
+    *static_files = 0;
+    if (id < 0 || id >= num_threads)
+        return;
+
+    *requests = __atomic_load_n(&threads[id].requests, __ATOMIC_RELAXED);
+    *static_files = __atomic_load_n(&threads[id].static_files, __ATOMIC_RELAXED);
+}
+
+/* Print the latency of each phase, e.g. on shutdown */
+void
+status_print(FILE *fp)
+{
+    hist_t h;
+    char name[64];
+    unsigned int p;
+    for (p = 0; p < STATUS_NUM_PHASES; p++) {
+        status_merge_phase(&h, p);
+        snprintf(name, sizeof(name), "Request phase %s", phase_names[p]);
+        hist_print(fp, name, &h);
+    }
+}
+
+/* Merge the histograms of 'phase' of all threads into 'h' */
+static void
+status_merge_phase(hist_t *h, status_phase phase)
+{
+    hist_init(h);
+    unsigned int i;
+    for (i = 0; i < num_all_threads; i++)
+        hist_merge(h, &all_threads[i].phases[phase]);
+}
+
+/* Return the statistics in 'format', in a buffer to be freed by the caller,
+   and store its length in 'len_p'. Returns NULL on error. */
+char *
+status_render(status_format format, size_t *len_p)
+{
+    status_buf sb = { NULL, 0, 0 };
+
+    status_thread total;
+    memset(&total, 0, sizeof(total));
+    uint64_t shed = 0, rate_limited = 0;
+    unsigned int i, c;
+    for (i = 0; i < num_procs; i++) {
+        shed += __atomic_load_n(&procs[i].shed, __ATOMIC_RELAXED);
+        rate_limited += __atomic_load_n(&procs[i].rate_limited, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < num_all_threads; i++) {
+        total.requests += __atomic_load_n(&all_threads[i].requests, __ATOMIC_RELAXED);
+        total.bytes += __atomic_load_n(&all_threads[i].bytes, __ATOMIC_RELAXED);
+        for (c = 0; c < STATUS_NUM_CLASSES; c++)
+            total.responses[c] += __atomic_load_n(&all_threads[i].responses[c], __ATOMIC_RELAXED);
+        total.queue_wait_ns += __atomic_load_n(&all_threads[i].queue_wait_ns, __ATOMIC_RELAXED);
+        total.counted_requests += __atomic_load_n(&all_threads[i].counted_requests, __ATOMIC_RELAXED);
+        for (c = 0; c < PERFC_NUM_EVENTS; c++)
+            total.counters[c] += __atomic_load_n(&all_threads[i].counters[c], __ATOMIC_RELAXED);
+    }
+
+    if (format == STATUS_FORMAT_PROMETHEUS)
+        status_render_prometheus(&sb, shed, rate_limited);
+    else
+        status_render_text(&sb, &total, shed, rate_limited);
+
+    if (sb.buf == NULL) {
+        errMsg("status_render(): Failed to allocate memory for statistics");
+        return NULL;
+    }
+
+    *len_p = sb.len;
+    return sb.buf;
+}
+
+/* Single writer: a plain increment, but stored so that readers can't see a torn value */
+static void
+status_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+
+/* ========================== OUTPUT ============================ */
+
+
+/* Append formatted output to 'sb'. On allocation failure the buffer is freed
+   and 'sb->buf' is left NULL, making further calls no-ops. */
+static int
+status_printf(status_buf *sb, const char *format, ...)
+{
+    va_list ap;
+
+    if (sb->size == 0) {
+        sb->size = 4096;
+        sb->buf = (char *) malloc(sb->size);
+    }
+
+    while (sb->buf != NULL) {
+        va_start(ap, format);
+        int n = vsnprintf(sb->buf + sb->len, sb->size - sb->len, format, ap);
+        va_end(ap);
+        if (n < 0)
+            return -1;
+
+        if (sb->len + n < sb->size) {
+            sb->len += n;
+            return 0;
+        }
+
+        sb->size = 2 * (sb->len + n + 1);
+        char *buf = (char *) realloc(sb->buf, sb->size);
+        if (buf == NULL)
+            free(sb->buf);
+        sb->buf = buf;
+    }
+
+    return -1;
+}
+
+static void
+status_render_text(status_buf *sb, const status_thread *total, uint64_t shed, uint64_t rate_limited)
+{
+    uint64_t uptime_ns = get_monotonic_ns() - start_ns;
+
+    status_printf(sb, "Uptime: %llu s\n", (unsigned long long) (uptime_ns / 1000000000));
+    status_printf(sb, "Requests: %llu (%.1f/s)\n", (unsigned long long) total->requests,
+                  total->requests / (uptime_ns / 1e9));
+    status_printf(sb, "Bytes sent: %llu\n", (unsigned long long) total->bytes);
+    status_printf(sb, "Responses: 1xx=%llu 2xx=%llu 3xx=%llu 4xx=%llu 5xx=%llu\n",
+                  (unsigned long long) total->responses[0], (unsigned long long) total->responses[1],
+                  (unsigned long long) total->responses[2], (unsigned long long) total->responses[3],
+                  (unsigned long long) total->responses[4]);
+    status_printf(sb, "Shed (503): %llu\n", (unsigned long long) shed);
+    status_printf(sb, "Rate limited (429): %llu\n", (unsigned long long) rate_limited);
+    status_printf(sb, "Mean queue wait: %.1f us\n",
+                  total->requests ? total->queue_wait_ns / 1e3 / total->requests : 0.0);
+
+    status_printf(sb, "\n%-8s %12s %16s %10s %10s %10s %16s\n",
+                  "Thread", "Requests", "Bytes", "2xx", "4xx", "5xx", "Queue wait (us)");
+    unsigned int i;
+    for (i = 0; i < num_all_threads; i++) {
+        uint64_t requests = __atomic_load_n(&all_threads[i].requests, __ATOMIC_RELAXED);
+        uint64_t wait_ns = __atomic_load_n(&all_threads[i].queue_wait_ns, __ATOMIC_RELAXED);
+        status_printf(sb, "%-8u %12llu %16llu %10llu %10llu %10llu %16.1f\n", i,
+                      (unsigned long long) requests,
+                      (unsigned long long) __atomic_load_n(&all_threads[i].bytes, __ATOMIC_RELAXED),
+                      (unsigned long long) __atomic_load_n(&all_threads[i].responses[1], __ATOMIC_RELAXED),
+                      (unsigned long long) __atomic_load_n(&all_threads[i].responses[3], __ATOMIC_RELAXED),
+                      (unsigned long long) __atomic_load_n(&all_threads[i].responses[4], __ATOMIC_RELAXED),
+                      requests ? wait_ns / 1e3 / requests : 0.0);
+    }
+
+    status_printf(sb, "\n%-8s %12s %10s %10s %10s %10s %10s %10s\n",
+                  "Phase", "Count", "Mean (us)", "p50", "p90", "p99", "p99.9", "Max");
+    hist_t h;
+    unsigned int p;
+    for (p = 0; p < STATUS_NUM_PHASES; p++) {
+        status_merge_phase(&h, p);
+        status_printf(sb, "%-8s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[p],
+                      (unsigned long long) h.count, hist_mean(&h) / 1e3,
+                      hist_percentile(&h, 50) / 1e3, hist_percentile(&h, 90) / 1e3,
+                      hist_percentile(&h, 99) / 1e3, hist_percentile(&h, 99.9) / 1e3, h.max / 1e3);
+    }
+
+    int kernel;
+    unsigned int events = status_counted_events(&kernel);
+    if (total->counted_requests == 0 || events == 0)
+        return;
+
+    status_printf(sb, "\nPerformance counters per request (%llu requests, %s):\n",
+                  (unsigned long long) total->counted_requests, kernel ? "user and kernel" : "user space only");
+    unsigned int e;
+    for (e = 0; e < PERFC_NUM_EVENTS; e++) {
+        if (events & (1U << e))
+            status_printf(sb, "%-18s %12.1f\n", perfc_event_name(e),
+                          (double) total->counters[e] / total->counted_requests);
+        else
+            status_printf(sb, "%-18s %12s\n", perfc_event_name(e), "n/a");
+    }
+    unsigned int ipc_events = (1U << PERFC_CYCLES) | (1U << PERFC_INSTRUCTIONS);
+    if ((events & ipc_events) == ipc_events && total->counters[PERFC_CYCLES] > 0)
+        status_printf(sb, "%-18s %12.2f\n", "IPC",
+                      (double) total->counters[PERFC_INSTRUCTIONS] / total->counters[PERFC_CYCLES]);
+}
+
+static void
+status_render_prometheus(status_buf *sb, uint64_t shed, uint64_t rate_limited)
+{
+    unsigned int i, c;
+
+    status_printf(sb, "# HELP http_uptime_seconds Time since the server started.\n");
+    status_printf(sb, "# TYPE http_uptime_seconds gauge\n");
+    status_printf(sb, "http_uptime_seconds %.3f\n", (get_monotonic_ns() - start_ns) / 1e9);
+
+    status_printf(sb, "# HELP http_requests_total Requests served.\n");
+    status_printf(sb, "# TYPE http_requests_total counter\n");
+    for (i = 0; i < num_all_threads; i++)
+        status_printf(sb, "http_requests_total{thread=\"%u\"} %llu\n", i,
+                      (unsigned long long) __atomic_load_n(&all_threads[i].requests, __ATOMIC_RELAXED));
+
+    status_printf(sb, "# HELP http_responses_total Responses sent, by status code class.\n");
+    status_printf(sb, "# TYPE http_responses_total counter\n");
+    for (i = 0; i < num_all_threads; i++) {
+        for (c = 0; c < STATUS_NUM_CLASSES; c++)
+            status_printf(sb, "http_responses_total{thread=\"%u\",code=\"%uxx\"} %llu\n", i, c + 1,
+                          (unsigned long long) __atomic_load_n(&all_threads[i].responses[c], __ATOMIC_RELAXED));
+    }
+
+    status_printf(sb, "# HELP http_response_bytes_total Response bytes sent.\n");
+    status_printf(sb, "# TYPE http_response_bytes_total counter\n");
+    for (i = 0; i < num_all_threads; i++)
+        status_printf(sb, "http_response_bytes_total{thread=\"%u\"} %llu\n", i,
+                      (unsigned long long) __atomic_load_n(&all_threads[i].bytes, __ATOMIC_RELAXED));
+
+    status_printf(sb, "# HELP http_shed_total Connections turned away with a 503 because the server was overloaded.\n");
+    status_printf(sb, "# TYPE http_shed_total counter\n");
+    status_printf(sb, "http_shed_total %llu\n", (unsigned long long) shed);
+
+    status_printf(sb, "# HELP http_rate_limited_total Requests turned away with a 429 because their client was over its rate limit.\n");
+    status_printf(sb, "# TYPE http_rate_limited_total counter\n");
+    status_printf(sb, "http_rate_limited_total %llu\n", (unsigned long long) rate_limited);
+
+    status_printf(sb, "# HELP http_queue_wait_seconds_total Time requests spent in the job queue.\n");
+    status_printf(sb, "# TYPE http_queue_wait_seconds_total counter\n");
+    for (i = 0; i < num_all_threads; i++)
+        status_printf(sb, "http_queue_wait_seconds_total{thread=\"%u\"} %.9f\n", i,
+                      __atomic_load_n(&all_threads[i].queue_wait_ns, __ATOMIC_RELAXED) / 1e9);
+
+    int kernel;
+    unsigned int events = status_counted_events(&kernel);
+    if (events != 0) {
+        status_printf(sb, "# HELP http_counted_requests_total Requests served with performance counters enabled.\n");
+        status_printf(sb, "# TYPE http_counted_requests_total counter\n");
+        for (i = 0; i < num_all_threads; i++)
+            status_printf(sb, "http_counted_requests_total{thread=\"%u\"} %llu\n", i,
+                          (unsigned long long) __atomic_load_n(&all_threads[i].counted_requests, __ATOMIC_RELAXED));
+
+        status_printf(sb, "# HELP http_perf_events_total Performance counts of those requests, by event.\n");
+        status_printf(sb, "# TYPE http_perf_events_total counter\n");
+        for (i = 0; i < num_all_threads; i++) {
+            for (c = 0; c < PERFC_NUM_EVENTS; c++) {
+                if (events & (1U << c))
+                    status_printf(sb, "http_perf_events_total{thread=\"%u\",event=\"%s\"} %llu\n", i,
+                                  perfc_event_name(c),
+                                  (unsigned long long) __atomic_load_n(&all_threads[i].counters[c], __ATOMIC_RELAXED));
+            }
+        }
+    }
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    status_printf(sb, "# HELP http_request_phase_seconds Latency of each phase of serving a request.\n");
+    status_printf(sb, "# TYPE http_request_phase_seconds summary\n");
+    hist_t h;
+    unsigned int p, q;
+    for (p = 0; p < STATUS_NUM_PHASES; p++) {
+        status_merge_phase(&h, p);
+        for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            status_printf(sb, "http_request_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                          phase_names[p], quantiles[q], hist_percentile(&h, 100 * quantiles[q]) / 1e9);
+        status_printf(sb, "http_request_phase_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[p], h.sum / 1e9);
+        status_printf(sb, "http_request_phase_seconds_count{phase=\"%s\"} %llu\n", phase_names[p],
+                      (unsigned long long) h.count);
+    }
+}
@@ -0,0 +1,55 @@
+/************************************************\
+ * Header file for status.c                 *
+\************************************************/
+
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "../utils/perf_counters.h"
+
+/* Output formats of status_render() */
+typedef enum {
+    STATUS_FORMAT_TEXT,         /* Human readable summary */
+    STATUS_FORMAT_PROMETHEUS    /* Prometheus text exposition format */
+} status_format;
+
+/* Phases of serving a request, timed separately */
+typedef enum {
+    STATUS_PHASE_QUEUE,         /* Waiting in the job queue */
+    STATUS_PHASE_PARSE,         /* Reading and parsing the request line and headers */
+    STATUS_PHASE_OPEN,          /* Looking up and opening the requested file */
+    STATUS_PHASE_SEND,          /* Sending the response */
+    STATUS_NUM_PHASES
+} status_phase;
+
+/* Durations of the phases a request went through */
+typedef struct {
+    uint64_t ns[STATUS_NUM_PHASES];
+    unsigned int timed;         /* Bit mask of the phases in 'ns' */
+} status_timing;
+
+int status_init(unsigned int num_threads);
+
+int status_share(unsigned int num_procs, unsigned int num_threads);
+
+void status_set_proc(unsigned int proc);
+
+void status_timing_set(status_timing *timing, status_phase phase, uint64_t ns);
+
+void status_record(int id, const char *status_code, long long bytes, int is_static, const status_timing *timing);
+
+void status_record_shed(void);
+
+void status_record_rate_limited(void);
+
+void status_record_counters(int id, const uint64_t counts[PERFC_NUM_EVENTS], unsigned int events, int kernel);
+
+void status_thread_counts(int id, uint64_t *requests, uint64_t *static_files);
+
+void status_print(FILE *fp);
+
+char *status_render(status_format format, size_t *len_p);
+
+#endif
@@ -0,0 +1,248 @@
+/* upgrade.c
+ *
+ * Binary upgrade without refusing connections
+ *
+ * The running process starts the binary on disk anew with the same arguments,
+ * and hands it the listening socket over a Unix socket pair (SCM_RIGHTS).
+ * Both processes then share the socket, and with it the backlog: connections
+ * that arrive during the upgrade wait in the backlog and are accepted by
+ * whichever process is accepting. Once the new process is ready to serve,
+ * it tells the old one, which stops accepting, lets its in-flight requests
+ * complete and exits.
+ *
+ * If the new process fails to start, or does not become ready in time, the
+ * old process carries on serving.
+ *
+ *   old process                        new process
+ *   -----------                        -----------
+ *   socketpair(), fork(), exec()  -->  upgrade_inherit(): recvmsg() the socket
+ *   sendmsg() the socket               ... start workers and event loop ...
+ *   wait for the ready byte      <--   upgrade_ready()
+ *   stop accepting, drain, exit        serve
+*/
+#define _GNU_SOURCE     /* For execvpe() */
+
+#include "../utils/tlpi_hdr.h"
+#include "upgrade.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define UPGRADE_READY 'R'   /* Byte sent by the new process once it serves */
+
+extern char **environ;
+
+static int upgrade_fd = -1; /* New process: socket to tell the old process it is ready */
+
+
+/* Send the file descriptor 'fd' over the Unix socket 'sfd' */
+static int
+upgrade_send_fd(int sfd, int fd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    /* At least one byte of data must go with the descriptor */
+    char data = 0;
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t n;
+    do {
+        n = sendmsg(sfd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    return (n == 1) ? 0 : -1;
+}
+
+/* Receive a file descriptor over the Unix socket 'sfd'. Returns it, or -1 on error. */
+static int
+upgrade_recv_fd(int sfd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    char data;
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+
+    ssize_t n;
+    do {
+        n = recvmsg(sfd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0)
+        return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/* Wait up to 'timeout_ms' for the new process to report it is ready on 'sfd'.
+   Returns 0 if it did, or -1 if it exited or timed out. */
+static int
+upgrade_wait_ready(int sfd, unsigned int timeout_ms)
+{
+    struct pollfd pfd = { .fd = sfd, .events = POLLIN };
+    int r;
+    do {
+        r = poll(&pfd, 1, timeout_ms);
+    } while (r == -1 && errno == EINTR);
+    if (r <= 0)
+        return -1;
+
+    char c;
+    return (read(sfd, &c, 1) == 1 && c == UPGRADE_READY) ? 0 : -1;
+}
+
+/* Start a new process running the binary 'argv[0]' with the arguments 'argv'
+   in the directory 'dirfd' (that of the original command line, for relative
+   paths in it), hand it the listening socket 'lfd', and wait up to
+   'timeout_ms' for it to serve. Returns the process ID of the new process, or
+   -1 if the upgrade failed, in which case the caller keeps serving. */
+pid_t
+upgrade_start(int lfd, char *argv[], int dirfd, unsigned int timeout_ms)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        errMsg("upgrade_start(): socketpair()");
+        return -1;
+    }
+
+    /* Build the environment of the new process before fork(): only
+       async-signal-safe functions may be called in the child */
+    size_t n = 0;
+    while (environ[n] != NULL)
+        n++;
+    char **envp = (char **) malloc((n + 2) * sizeof(char *));
+    char env_fd[sizeof(UPGRADE_ENV) + 16];
+    if (envp == NULL) {
+        errMsg("upgrade_start(): Failed to allocate memory for environment");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    snprintf(env_fd, sizeof(env_fd), "%s=%d", UPGRADE_ENV, sv[1]);
+    size_t i, j = 0;
+    for (i = 0; i < n; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0)
+            envp[j++] = environ[i];
+    }
+    envp[j++] = env_fd;
+    envp[j] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Only the new process's end of the pair survives exec() */
+        close(sv[0]);
+        if (fcntl(sv[1], F_SETFD, 0) == -1 || fchdir(dirfd) == -1)
+            _exit(127);
+        execvpe(argv[0], argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    if (pid == -1) {
+        errMsg("upgrade_start(): fork()");
+        close(sv[0]);
+        return -1;
+    }
+
+    if (upgrade_send_fd(sv[0], lfd) == -1) {
+        errMsg("upgrade_start(): Failed to send listening socket to process %ld", (long) pid);
+        goto fail;
+    }
+    if (upgrade_wait_ready(sv[0], timeout_ms) == -1) {
+        errMsg("upgrade_start(): Process %ld did not start serving", (long) pid);
+        goto fail;
+    }
+
+    close(sv[0]);
+    return pid;
+
+fail:
+    close(sv[0]);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/* Called by a process on startup. If it was started by upgrade_start(), receive
+   the listening socket of the old process in 'lfd' and return 1. Returns 0 if
+   the process was started normally, or -1 on error. */
+int
+upgrade_inherit(int *lfd)
+{
+    const char *env = getenv(UPGRADE_ENV);
+    if (env == NULL)
+        return 0;
+
+    char *end;
+    errno = 0;
+    long fd = strtol(env, &end, 10);
+    unsetenv(UPGRADE_ENV);
+    if (errno != 0 || *end != '\0' || end == env || fd < 0 || fd > INT_MAX) {
+        errMsg("upgrade_inherit(): Invalid %s", UPGRADE_ENV);
+        return -1;
+    }
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        errMsg("upgrade_inherit(): Bad %s", UPGRADE_ENV);
+        return -1;
+    }
+
+    *lfd = upgrade_recv_fd(fd);
+    if (*lfd == -1) {
+        errMsg("upgrade_inherit(): Failed to receive listening socket");
+        close(fd);
+        return -1;
+    }
+
+    int listening;
+    socklen_t optlen = sizeof(listening);
+    if (getsockopt(*lfd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen) == -1 || !listening) {
+        errMsg("upgrade_inherit(): Received descriptor is not a listening socket");
+        close(*lfd);
+        close(fd);
+        return -1;
+    }
+
+    upgrade_fd = fd;
+    return 1;
+}
+
+/* Called by a process started by upgrade_start() once it serves, to make the
+   old process stop */
+void
+upgrade_ready(void)
+{
+    if (upgrade_fd == -1)
+        return;
+
+    char c = UPGRADE_READY;
+    if (write(upgrade_fd, &c, 1) != 1)
+        errMsg("upgrade_ready(): Failed to notify old process");
+    close(upgrade_fd);
+    upgrade_fd = -1;
+}
@@ -0,0 +1,19 @@
+/************************************************\
+ * Header file for upgrade.c                    *
+\************************************************/
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <sys/types.h>
+
+/* Environment variable telling a new process where to receive the listening socket */
+#define UPGRADE_ENV "HTTP_SERVER_UPGRADE_FD"
+
+pid_t upgrade_start(int lfd, char *argv[], int dirfd, unsigned int timeout_ms);
+
+int upgrade_inherit(int *lfd);
+
+void upgrade_ready(void);
+
+#endif
@@ -0,0 +1,233 @@
+/* warmup.c
+ *
+ * Document root warmup
+ *
+ * Right after startup, the first request for each file pays for the path
+ * lookup and for reading the file from disk. The warmup lists the files of
+ * the document root, or those of a manifest of hot paths, and has every
+ * worker of the thread pool take files off the list to look up (loading the
+ * kernel's dentry and inode caches) and read ahead into the page cache, in
+ * parallel and before the server accepts connections. The read ahead stops
+ * at a byte budget, so that a document root larger than memory doesn't push
+ * everything else out of the page cache.
+ *
+ * The paths are relative to the working directory, the document root.
+*/
+#define _GNU_SOURCE     /* For readahead() */
+
+#include "../utils/tlpi_hdr.h"
+#include "../utils/utils.h"
+#include "warmup.h"
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define WARMUP_LINE_MAX     PATH_MAX
+#define WARMUP_NFTW_FDS     64      /* Directories nftw() keeps open at once */
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* Paths to warm up */
+typedef struct {
+    char **paths;
+    unsigned int num_paths;
+    unsigned int cap;
+} warmup_list;
+
+/* Shared by the workers of one warmup */
+typedef struct {
+    warmup_list list;
+    unsigned int next;          /* Index of the next path to take */
+    uint64_t max_bytes;
+    uint64_t reserved;          /* Bytes of the budget taken by the workers */
+    unsigned int files;
+    unsigned int failed;
+    uint64_t bytes;
+} warmup_job;
+
+
+/* ========================== LIST ============================ */
+
+
+static int
+warmup_list_add(warmup_list *list, const char *path)
+{
+    if (list->num_paths == list->cap) {
+        unsigned int cap = list->cap ? 2 * list->cap : 256;
+        char **paths = (char **) realloc(list->paths, cap * sizeof(*paths));
+        if (paths == NULL) {
+            errMsg("warmup_list_add(): Failed to allocate memory for paths");
+            return -1;
+        }
+        list->paths = paths;
+        list->cap = cap;
+    }
+
+    list->paths[list->num_paths] = strdup(path);
+    if (list->paths[list->num_paths] == NULL) {
+        errMsg("warmup_list_add(): strdup()");
+        return -1;
+    }
+    list->num_paths++;
+    return 0;
+}
+
+static void
+warmup_list_free(warmup_list *list)
+{
+    unsigned int i;
+    for (i = 0; i < list->num_paths; i++)
+        free(list->paths[i]);
+    free(list->paths);
+}
+
+/* nftw() has no argument for its callback */
+static warmup_list *walk_list;
+
+static int
+warmup_walk_file(const char *path, const struct stat *sbuf, int type, struct FTW *ftwbuf)
+{
+    if (type == FTW_F && S_ISREG(sbuf->st_mode))
+        return warmup_list_add(walk_list, path);
+    return 0;
+}
+
+/* List the regular files under the working directory, without following
+   symbolic links or crossing into other file systems */
+static int
+warmup_walk(warmup_list *list)
+{
+    walk_list = list;
+    if (nftw(".", warmup_walk_file, WARMUP_NFTW_FDS, FTW_PHYS | FTW_MOUNT) != 0) {
+        errMsg("warmup_walk(): nftw(): Failed to walk the document root");
+        return -1;
+    }
+    return 0;
+}
+
+/* List the paths of the manifest 'path': one per line, relative to the
+   document root, with or without the leading '/' of a URL. Blank lines and
+   lines starting with '#' are ignored. */
+static int
+warmup_read_manifest(warmup_list *list, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        errMsg("warmup_read_manifest(): Failed to open manifest %s", path);
+        return -1;
+    }
+
+    char line[WARMUP_LINE_MAX];
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        char *p = trimwhitespace(line);
+        if (p[0] == '\0' || p[0] == '#')
+            continue;
+        while (p[0] == '/')
+            p++;
+        ret = warmup_list_add(list, (p[0] == '\0') ? "." : p);
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+
+/* ========================== WORKERS ============================ */
+
+
+/* Look up the file 'path' and read it ahead, within what is left of the
+   budget */
+static void
+warmup_file(warmup_job *w, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        __atomic_add_fetch(&w->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) == -1 || !S_ISREG(sbuf.st_mode)) {
+        close(fd);
+        return;
+    }
+    __atomic_add_fetch(&w->files, 1, __ATOMIC_RELAXED);
+
+    uint64_t len = sbuf.st_size;
+    if (w->max_bytes > 0) {
+        uint64_t off = __atomic_fetch_add(&w->reserved, len, __ATOMIC_RELAXED);
+        len = (off >= w->max_bytes) ? 0 : min(len, w->max_bytes - off);
+    }
+
+    /* Fall back to the hint on file systems that don't support readahead() */
+    if (len > 0) {
+        if (readahead(fd, 0, len) == -1 && posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED) != 0) {
+            len = 0;
+        }
+        __atomic_add_fetch(&w->bytes, len, __ATOMIC_RELAXED);
+    }
+
+    close(fd);
+}
+
+/* Run by every worker: take paths off the list until there are none left */
+static void
+warmup_worker(void *arg)
+{
+    warmup_job *w = (warmup_job *) arg;
+    unsigned int i;
+    while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->list.num_paths)
+        warmup_file(w, w->list.paths[i]);
+}
+
+
+/* ========================== WARMUP ============================ */
+
+
+/*
+Warm up the caches for the files of the manifest or the document root, with
+the 'num_threads' workers of 'thpool', which must have no other work. Returns
+once done, with what was done in 'stats'. Returns 0, or -1 on error.
+*/
+int
+warmup_run(threadpool thpool, unsigned int num_threads, const warmup_opts *opts, warmup_stats *stats)
+{
+    uint64_t start_ns = get_monotonic_ns();
+    memset(stats, 0, sizeof(*stats));
+
+    warmup_job w;
+    memset(&w, 0, sizeof(w));
+    w.max_bytes = opts->max_bytes;
+
+    int ret = (opts->manifest != NULL) ? warmup_read_manifest(&w.list, opts->manifest) : warmup_walk(&w.list);
+    if (ret == -1) {
+        warmup_list_free(&w.list);
+        return -1;
+    }
+
+    /* One job per worker rather than per file, which would not fit in the
+       job queue */
+    unsigned int i;
+    for (i = 0; i < num_threads && i < w.list.num_paths; i++) {
+        if (thpool_add_work(thpool, warmup_worker, &w) == -1) {
+            errMsg("warmup_run(): thpool_add_work(): Failed to start warmup worker");
+            break;
+        }
+    }
+    if (i == 0 && w.list.num_paths > 0) {
+        warmup_worker(&w);
+    }
+    thpool_wait(thpool);
+
+    stats->files = w.files;
+    stats->failed = w.failed;
+    stats->bytes = w.bytes;
+    stats->ns = get_monotonic_ns() - start_ns;
+
+    warmup_list_free(&w.list);
+    return 0;
+}
@@ -0,0 +1,28 @@
+/************************************************\
+ * Header file for warmup.c                     *
+\************************************************/
+
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../threadpool/threadpool.h"
+
+/* Warmup options */
+typedef struct {
+    const char *manifest;       /* File listing the paths to warm up, one per line. NULL walks the document root */
+    size_t max_bytes;           /* Most bytes read ahead into the page cache. 0 for no limit */
+} warmup_opts;
+
+/* What a warmup did */
+typedef struct {
+    unsigned int files;         /* Regular files looked up */
+    unsigned int failed;        /* Paths that could not be opened */
+    uint64_t bytes;             /* Bytes read ahead */
+    uint64_t ns;                /* Time taken */
+} warmup_stats;
+
+int warmup_run(threadpool thpool, unsigned int num_threads, const warmup_opts *opts, warmup_stats *stats);
+
+#endif
@@ -4,18 +4,36 @@
  * Modified by Deh-Jun Tzou                      *
 \************************************************/
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE     /* For pthread_attr_setaffinity_np() */
 
 #include <pthread.h>
 #include <signal.h>
+#include <sched.h>
 #include "../utils/tlpi_hdr.h"
+#include "../utils/utils.h"
+#include "../utils/affinity.h"
+#include "../utils/histogram.h"
+#include "../utils/trace.h"
 #include "threadpool.h"
 
 
+#define THPOOL_AFFINITY_SCAN 8  /* Jobs the ANY policy looks at for one received on the worker's CPU */
+#define THPOOL_SPIN_FACTOR 2    /* Spin for this many mean inter-arrival times before parking */
+
+/* Hint to the CPU that we are in a spin-wait loop */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+
 /* ========================== GLOBALS ============================ */
 
 
-static volatile int threads_keepalive;  // Must declare as volatile to prevent compiler optimization
+static __thread struct thread *thread_self;    /* Pool thread running the calling code, or NULL */
 
 
 /* ========================== STRUCTURES ============================ */
@@ -26,71 +44,132 @@ typedef struct bsem {
     pthread_mutex_t mtx;
     pthread_cond_t cnd;
     int val;
+    int closed;                 /* Set by bsem_close(). Waiters no longer block */
+    int spinning;               /* Threads spinning in bsem_spin(). Posts skip the wakeup if > 0 */
 } bsem;
 
 /* Job */
 typedef struct job {
     void (*function)(void *);
     void *arg;
+    unsigned long key;          /* Scheduling key. Smaller keys are served first by the SFF policies */
+    unsigned long seq;          /* Arrival order. Breaks ties between equal keys */
+    unsigned long dispatch_seq; /* Dispatch order */
+    unsigned int num_overtaken; /* Older jobs still queued when this one was dispatched */
+    uint64_t enqueue_ns;        /* Time at which the job entered the job queue */
+    unsigned int heap_idx;      /* Position in the job queue heap (SFF policies) */
+    int cpu;                    /* Preferred CPU of the job, or -1 */
+    struct job *prev;
     struct job *next;
 } job;
 
-/* Job Queue */
+/* Job Queue
+
+   All queued jobs are kept in a doubly linked list in arrival order. The SFF
+   policies additionally index the jobs by key in a binary min-heap, so that a
+   job can be removed either as the smallest key (heap) or as the oldest job
+   (list) in O(log n). */
 typedef struct jobqueue {
     pthread_mutex_t jobqueue_mtx;
-    job *head;
-    job *tail;
+    job *head;                  /* Oldest job */
+    job *tail;                  /* Newest job */
+    job **heap;                 /* Min-heap of jobs ordered by (key, seq). NULL for FIFO */
     bsem *has_jobs;
     unsigned int num_jobs;
     unsigned int max_size;
+    unsigned long next_seq;
+    unsigned long next_dispatch_seq;
+    thpool_sched sched;
+    uint64_t max_wait_ns;       /* Age after which SFF_AGING serves the oldest job */
+    int job_ages;               /* Count the older jobs each job overtakes */
+    uint64_t last_push_ns;      /* Time the last job was added */
+    uint64_t interarrival_ns;   /* Moving average of the time between two added jobs */
+    uint64_t codel_target_ns;   /* Overload detection, see jobqueue_codel(). 0 disables */
+    uint64_t codel_interval_ns;
+    uint64_t first_above_ns;    /* End of the interval the queueing delay must stay above target, or 0 */
+    int overloaded;             /* Read without the lock by thpool_is_overloaded() */
 } jobqueue;
 
 /* Thread */
 typedef struct thread {
     int id;
+    int cpu;                    /* CPU the thread is pinned to, or -1 */
     pthread_t pthread;
     struct thpool *thpool;
+    hist_t spin_hist;           /* Wakeup latency of jobs picked up while spinning */
+    hist_t park_hist;           /* Wakeup latency of jobs picked up after parking */
+    thpool_job_info current;    /* Job being run */
 } thread;
 
 /* Thread Pool */
 typedef struct thpool {
     thread **threads;
+    unsigned int num_threads;   /* Number of entries in 'threads' */
+    int keepalive;              /* Cleared by thpool_destroy() to terminate the threads */
     unsigned int num_threads_alive;
     unsigned int num_threads_working;
     pthread_mutex_t thpool_mtx;
     pthread_cond_t thpool_cnd;
     jobqueue jobqueue;
+    void (*on_thread_start)(int id);
+    void (*on_thread_exit)(int id);
+    uint64_t max_spin_ns;       /* Upper bound of the spin phase of idle threads. 0 disables spinning */
+    int max_spinners;           /* Maximum number of threads spinning at once */
 } thpool;
 
 
 /* ========================== PROTOTYPES ============================ */
 
 
-static int jobqueue_init(jobqueue *jobqueue_p, unsigned int jobqueue_size);
+static int jobqueue_init(jobqueue *jobqueue_p, unsigned int jobqueue_size, const thpool_attr *attr);
+static void jobqueue_codel(jobqueue *jobqueue_p, const job *job_p);
 static void jobqueue_destroy(jobqueue *jobqueue_p);
 static int jobqueue_clear(jobqueue *jobqueue_p);
-static job *jobqueue_poll(jobqueue *jobqueue_p);
+static job *jobqueue_poll(jobqueue *jobqueue_p, int cpu);
 static int jobqueue_add(jobqueue *jobqueue_p, job *job_p);
+static unsigned int jobqueue_add_batch(jobqueue *jobqueue_p, job *head_p, unsigned int num_jobs, job **rest_pp);
+static void jobqueue_push(jobqueue *jobqueue_p, job *job_p);
+static void jobqueue_remove(jobqueue *jobqueue_p, job *job_p);
+
+static int heap_less(const job *a, const job *b);
+static void heap_swap(job **heap, unsigned int i, unsigned int j);
+static void heap_sift_up(job **heap, unsigned int i);
+static void heap_sift_down(job **heap, unsigned int n, unsigned int i);
 
-static int thread_init(thpool *thpool_p, thread **thread_p, int id);
+static int thread_init(thpool *thpool_p, thread **thread_p, int id, int cpu);
 static void *thread_start(void *arg);
+static int thread_wait(thread *thread_p);
 static void thread_destroy(thread *thread_p);
 
 static int bsem_init(bsem *bsem_p, int val);
 static int bsem_reset(bsem *bsem_p);
 static void bsem_post(bsem *bsem_p);
-static void bsem_post_all(bsem *bsem_p);
+static void bsem_close(bsem *bsem_p);
 static void bsem_wait(bsem *bsem_p);
+static int bsem_spin(bsem *bsem_p, uint64_t budget_ns, int max_spinners);
 
 
 /* ========================== THREAD POOL ========================== */
 
 
-thpool *
-thpool_init(unsigned int num_threads, unsigned int jobqueue_size)
+void
+thpool_attr_init(thpool_attr *attr)
 {
-    threads_keepalive = 1;
+    attr->sched = THPOOL_SCHED_FIFO;
+    attr->max_wait_ms = THPOOL_DEFAULT_MAX_WAIT_MS;
+    attr->cpus = NULL;
+    attr->num_cpus = 0;
+    attr->on_thread_start = NULL;
+    attr->on_thread_exit = NULL;
+    attr->max_spin_us = THPOOL_DEFAULT_MAX_SPIN_US;
+    attr->codel_target_us = 0;
+    attr->codel_interval_ms = THPOOL_DEFAULT_CODEL_INTERVAL_MS;
+    attr->job_ages = 0;
+}
 
+thpool *
+thpool_init(unsigned int num_threads, unsigned int jobqueue_size, const thpool_attr *attr)
+{
     if (num_threads <= 0) {
         errMsg("Must specify a positive number of threads");
         return NULL;
@@ -104,11 +183,29 @@ thpool_init(unsigned int num_threads, unsigned int jobqueue_size)
         return NULL;
     }
 
+    thpool_p->num_threads = num_threads;
+    thpool_p->keepalive = 1;
     thpool_p->num_threads_alive = 0;
     thpool_p->num_threads_working = 0;
+    thpool_p->on_thread_start = NULL;
+    thpool_p->on_thread_exit = NULL;
 
     /* Initialize the job queue */
-    if (jobqueue_init(&thpool_p->jobqueue, jobqueue_size) == -1) {
+    thpool_attr default_attr;
+    if (attr == NULL) {
+        thpool_attr_init(&default_attr);
+        attr = &default_attr;
+    }
+
+    thpool_p->on_thread_start = attr->on_thread_start;
+    thpool_p->on_thread_exit = attr->on_thread_exit;
+
+    /* Spinning only pays off if the thread adding jobs runs on another CPU */
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    thpool_p->max_spin_ns = (num_cpus > 1) ? (uint64_t) attr->max_spin_us * 1000 : 0;
+    thpool_p->max_spinners = (num_cpus > 3) ? num_cpus / 2 : 1;
+
+    if (jobqueue_init(&thpool_p->jobqueue, jobqueue_size, attr) == -1) {
         errMsg("Failed to initialize the job queue");
         free(thpool_p);
         return NULL;
@@ -129,25 +226,48 @@ thpool_init(unsigned int num_threads, unsigned int jobqueue_size)
         return NULL;
     }
 
-    if (pthread_cond_init(&thpool_p->thpool_cnd, NULL) > 0) {
+    /* Timed waits in thpool_drain() must not be affected by changes of the wall clock */
+    pthread_condattr_t cnd_attr;
+    pthread_condattr_init(&cnd_attr);
+    pthread_condattr_setclock(&cnd_attr, CLOCK_MONOTONIC);
+    int ret_val = pthread_cond_init(&thpool_p->thpool_cnd, &cnd_attr);
+    pthread_condattr_destroy(&cnd_attr);
+    if (ret_val > 0) {
         errMsg("Failed to initialize thread pool condition variable");
         return NULL;
     }
 
-    /* Initialize threads in pool */
+    /* Initialize threads in pool, spreading them round-robin over the given CPUs */
     int i;
+    unsigned int num_created = 0;
     for (i = 0; i < num_threads; i++) {
-        thread_init(thpool_p, &thpool_p->threads[i], i);
+        int cpu = (attr->num_cpus > 0) ? attr->cpus[i % attr->num_cpus] : -1;
+        if (thread_init(thpool_p, &thpool_p->threads[i], i, cpu) == -1) {
+            thpool_p->threads[i] = NULL;
+        }
+        else {
+            num_created++;
+        }
     }
 
     /* Wait for all threads to be initialized */
-    while (thpool_p->num_threads_alive != num_threads);
+    pthread_mutex_lock(&thpool_p->thpool_mtx);
+    while (thpool_p->num_threads_alive != num_created) {
+        pthread_cond_wait(&thpool_p->thpool_cnd, &thpool_p->thpool_mtx);
+    }
+    pthread_mutex_unlock(&thpool_p->thpool_mtx);
 
     return thpool_p;
 }
 
 int
 thpool_add_work(thpool *thpool_p, void (*function)(void*), void *arg)
+{
+    return thpool_add_work_key(thpool_p, function, arg, 0);
+}
+
+int
+thpool_add_work_key(thpool *thpool_p, void (*function)(void*), void *arg, unsigned long key)
 {
     job *new_job;
     new_job = (job *) malloc(sizeof(*new_job));
@@ -158,51 +278,148 @@ thpool_add_work(thpool *thpool_p, void (*function)(void*), void *arg)
 
     new_job->function = function;
     new_job->arg = arg;
+    new_job->key = key;
+    new_job->cpu = -1;
 
     if (jobqueue_add(&thpool_p->jobqueue, new_job) < 0) {
         errMsg("thpool_add_work(): Failed to add new job to job queue");
         free(new_job);
         return -1;
     }
+    TRACE2(enqueue, arg, key);
 
     return 0;
 }
 
+/*
+Enqueue 'num_jobs' jobs running 'function' on the argument of each element of
+'work', with the scheduling key and preferred CPU of that element. The whole
+batch is spliced onto the job queue under a single lock acquisition and
+announced with a single semaphore post; the remaining workers are woken in a
+chain by jobqueue_poll(). If the queue cannot hold the whole batch, only the
+leading jobs that fit are queued. Returns the number of jobs queued, which the
+caller must use to dispose of the arguments that were not, or -1 on error.
+*/
+int
+thpool_add_work_batch(thpool *thpool_p, void (*function)(void*), const thpool_work *work, unsigned int num_jobs)
+{
+    if (num_jobs == 0)
+        return 0;
+
+    /* Build the chain of jobs outside of the job queue lock */
+    job *head = NULL, *tail = NULL;
+    unsigned int i;
+    for (i = 0; i < num_jobs; i++) {
+        job *new_job = (job *) malloc(sizeof(*new_job));
+        if (new_job == NULL) {
+            errMsg("thpool_add_work_batch(): Failed to allocate memory for new job");
+            while (head != NULL) {
+                job *next = head->next;
+                free(head);
+                head = next;
+            }
+            return -1;
+        }
+
+        new_job->function = function;
+        new_job->arg = work[i].arg;
+        new_job->key = work[i].key;
+        new_job->cpu = work[i].cpu;
+        new_job->next = NULL;
+
+        if (head == NULL)
+            head = new_job;
+        else
+            tail->next = new_job;
+        tail = new_job;
+    }
+
+    job *job_p;
+    unsigned int num_added = jobqueue_add_batch(&thpool_p->jobqueue, head, num_jobs, &job_p);
+    for (i = 0; i < num_added; i++)
+        TRACE2(enqueue, work[i].arg, work[i].key);
+
+    /* Free the jobs that did not fit in the job queue */
+    if (num_added < num_jobs) {
+        errMsg("thpool_add_work_batch(): Job queue full, dropped %u of %u jobs", num_jobs - num_added, num_jobs);
+        while (job_p != NULL) {
+            job *next = job_p->next;
+            free(job_p);
+            job_p = next;
+        }
+    }
+
+    return num_added;
+}
+
+/*
+Terminate all threads and free the thread pool. Jobs being run are completed,
+but jobs still in the job queue are discarded: call thpool_wait() or
+thpool_drain() first to run them.
+*/
 void
 thpool_destroy(thpool *thpool_p)
 {
     if (thpool_p == NULL)
         return;
 
-    /* Get total number of alive threads */
-    unsigned int total_threads_alive = thpool_p->num_threads_alive;
+    /* End infinite loop for each thread and wake up the idle ones */
+    __atomic_store_n(&thpool_p->keepalive, 0, __ATOMIC_RELEASE);
+    bsem_close(thpool_p->jobqueue.has_jobs);
 
-    /* End infinite loop for each thread */
-    threads_keepalive = 0;
-
-    /* Wait a second for threads to terminate */
-    bsem_post_all(thpool_p->jobqueue.has_jobs);
-    sleep(1);
-
-    /* Terminate all remaining threads */
-    while (thpool_p->num_threads_alive) {
-        bsem_post_all(thpool_p->jobqueue.has_jobs);
-        sleep(1);
+    /* Wait for each thread to finish its current job and terminate */
+    int i;
+    for (i = 0; i < thpool_p->num_threads; i++) {
+        if (thpool_p->threads[i] == NULL)
+            continue;
+        if (pthread_join(thpool_p->threads[i]->pthread, NULL) > 0) {
+            errMsg("thpool_destroy(): Failed to join thread %d", i);
+        }
     }
 
     /* Destroy job queue */
     jobqueue_destroy(&thpool_p->jobqueue);
 
     /* Destroy thread structures */
-    int i;
-    for (i = 0; i < total_threads_alive; i++) {
-        thread_destroy(thpool_p->threads[i]);
+    for (i = 0; i < thpool_p->num_threads; i++) {
+        if (thpool_p->threads[i] != NULL)
+            thread_destroy(thpool_p->threads[i]);
     }
 
     free(thpool_p->threads);
     free(thpool_p);
 }
 
+/*
+Wait until the job queue is empty and no thread is running a job, or until
+'timeout_ms' milliseconds have passed. New jobs may not be added meanwhile.
+Returns 0 if the thread pool was drained, or -1 if the deadline expired.
+*/
+int
+thpool_drain(thpool *thpool_p, unsigned int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    int ret_val = 0;
+    pthread_mutex_lock(&thpool_p->thpool_mtx);
+    while (thpool_p->jobqueue.num_jobs || thpool_p->num_threads_working) {
+        if (pthread_cond_timedwait(&thpool_p->thpool_cnd, &thpool_p->thpool_mtx, &deadline) == ETIMEDOUT) {
+            ret_val = (thpool_p->jobqueue.num_jobs || thpool_p->num_threads_working) ? -1 : 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&thpool_p->thpool_mtx);
+
+    return ret_val;
+}
+
 void
 thpool_wait(thpool *thpool_p)
 {
@@ -219,12 +436,56 @@ thpool_num_threads_working(thpool *thpool_p)
     return thpool_p->num_threads_working;
 }
 
+/* Return 1 if queued jobs have been waiting longer than the 'codel_target_us'
+   attribute for at least 'codel_interval_ms', so that new work should be
+   turned away until the backlog clears. Always 0 if 'codel_target_us' is 0. */
+int
+thpool_is_overloaded(thpool *thpool_p)
+{
+    return __atomic_load_n(&thpool_p->jobqueue.overloaded, __ATOMIC_RELAXED);
+}
+
+/*
+Merge the wakeup latency histograms of all threads into 'spun' (jobs picked up
+while spinning) and 'parked' (jobs picked up after blocking). The wakeup latency
+is the time from adding a job to an idle pool until a thread dequeues it, in
+nanoseconds. Jobs that waited for a busy pool are not counted.
+*/
+void
+thpool_wakeup_latency(thpool *thpool_p, hist_t *spun, hist_t *parked)
+{
+    hist_init(spun);
+    hist_init(parked);
+
+    int i;
+    for (i = 0; i < thpool_p->num_threads; i++) {
+        if (thpool_p->threads[i] == NULL)
+            continue;
+        hist_merge(spun, &thpool_p->threads[i]->spin_hist);
+        hist_merge(parked, &thpool_p->threads[i]->park_hist);
+    }
+}
+
+int
+thpool_thread_id(void)
+{
+    return (thread_self != NULL) ? thread_self->id : -1;
+}
+
+/* Return the timing of the job the calling thread is running, or NULL if it
+   is not a pool thread */
+const thpool_job_info *
+thpool_current_job(void)
+{
+    return (thread_self != NULL) ? &thread_self->current : NULL;
+}
+
 
 /* ========================== JOB QUEUE ========================== */
 
 
 static int
-jobqueue_init(jobqueue *jobqueue_p, unsigned int jobqueue_size)
+jobqueue_init(jobqueue *jobqueue_p, unsigned int jobqueue_size, const thpool_attr *attr)
 {
     if (pthread_mutex_init(&jobqueue_p->jobqueue_mtx, NULL) > 0) {
         errMsg("jobqueue_init(): Failed to initialize job queue mutex");
@@ -243,10 +504,31 @@ jobqueue_init(jobqueue *jobqueue_p, unsigned int jobqueue_size)
         return -1;
     }
 
+    jobqueue_p->heap = NULL;
+    if (attr->sched == THPOOL_SCHED_SFF || attr->sched == THPOOL_SCHED_SFF_AGING) {
+        jobqueue_p->heap = (job **) malloc(jobqueue_size * sizeof(*jobqueue_p->heap));
+        if (jobqueue_p->heap == NULL) {
+            errMsg("jobqueue_init(): Failed to allocate memory for job queue heap");
+            free(jobqueue_p->has_jobs);
+            return -1;
+        }
+    }
+
     jobqueue_p->head = NULL;
     jobqueue_p->tail = NULL;
     jobqueue_p->num_jobs = 0;
     jobqueue_p->max_size = jobqueue_size;
+    jobqueue_p->next_seq = 0;
+    jobqueue_p->next_dispatch_seq = 0;
+    jobqueue_p->sched = attr->sched;
+    jobqueue_p->max_wait_ns = (uint64_t) attr->max_wait_ms * 1000000;
+    jobqueue_p->job_ages = attr->job_ages;
+    jobqueue_p->last_push_ns = 0;
+    jobqueue_p->interarrival_ns = 0;
+    jobqueue_p->codel_target_ns = (uint64_t) attr->codel_target_us * 1000;
+    jobqueue_p->codel_interval_ns = (uint64_t) attr->codel_interval_ms * 1000000;
+    jobqueue_p->first_above_ns = 0;
+    jobqueue_p->overloaded = 0;
 
     return 0;
 }
@@ -255,6 +537,7 @@ static void
 jobqueue_destroy(jobqueue *jobqueue_p)
 {
     jobqueue_clear(jobqueue_p);
+    free(jobqueue_p->heap);
     free(jobqueue_p->has_jobs);
 }
 
@@ -262,7 +545,7 @@ static int
 jobqueue_clear(jobqueue *jobqueue_p)
 {
     job *job_p;
-    while ((job_p = jobqueue_poll(jobqueue_p)) != NULL) {
+    while ((job_p = jobqueue_poll(jobqueue_p, -1)) != NULL) {
         free(job_p);
     }
 
@@ -278,24 +561,69 @@ jobqueue_clear(jobqueue *jobqueue_p)
     return 0;
 }
 
+/* Remove and return the next job according to the scheduling policy of the
+   job queue, or NULL if the job queue is empty. 'cpu' is the CPU the calling
+   thread is pinned to, or -1. */
 static job *
-jobqueue_poll(jobqueue *jobqueue_p)
+jobqueue_poll(jobqueue *jobqueue_p, int cpu)
 {
     pthread_mutex_lock(&jobqueue_p->jobqueue_mtx);
-    job *head = jobqueue_p->head;
-    if (jobqueue_p->num_jobs == 1) {
-        jobqueue_p->head = NULL;
-        jobqueue_p->tail = NULL;
-        jobqueue_p->num_jobs = 0;
-    }
-    else if (jobqueue_p->num_jobs > 1) {
-        jobqueue_p->head = head->next;
-        jobqueue_p->num_jobs--;
-        bsem_post(jobqueue_p->has_jobs);
+    job *job_p = NULL;
+    if (jobqueue_p->num_jobs > 0) {
+        switch (jobqueue_p->sched) {
+            case THPOOL_SCHED_SFF_AGING:
+                /* Bound starvation: the oldest job goes first once it has waited too long */
+                if (get_monotonic_ns() - jobqueue_p->head->enqueue_ns >= jobqueue_p->max_wait_ns) {
+                    job_p = jobqueue_p->head;
+                    break;
+                }
+                /* Fall through */
+            case THPOOL_SCHED_SFF:
+                job_p = jobqueue_p->heap[0];
+                break;
+            case THPOOL_SCHED_ANY:
+                /* Prefer one of the oldest jobs whose preferred CPU is ours */
+                if (cpu >= 0) {
+                    int i;
+                    for (job_p = jobqueue_p->head, i = 0; job_p != NULL && i < THPOOL_AFFINITY_SCAN;
+                         job_p = job_p->next, i++) {
+                        if (job_p->cpu == cpu)
+                            break;
+                    }
+                    if (job_p != NULL && job_p->cpu == cpu)
+                        break;
+                }
+                /* Fall through */
+            case THPOOL_SCHED_FIFO:
+            default:
+                job_p = jobqueue_p->head;
+                break;
+        }
+
+        /* Number the dispatch and, if asked for, count the older jobs this
+           one overtakes: they precede it in the arrival list (there are none
+           with FIFO). That walk is O(queue length), hence optional. */
+        job_p->dispatch_seq = jobqueue_p->next_dispatch_seq++;
+        job_p->num_overtaken = 0;
+        if (jobqueue_p->job_ages) {
+            job *older;
+            for (older = job_p->prev; older != NULL; older = older->prev)
+                job_p->num_overtaken++;
+        }
+
+        if (jobqueue_p->codel_target_ns > 0)
+            jobqueue_codel(jobqueue_p, job_p);
+
+        jobqueue_remove(jobqueue_p, job_p);
+
+        /* Wake up another thread if there are jobs left */
+        if (jobqueue_p->num_jobs > 0) {
+            bsem_post(jobqueue_p->has_jobs);
+        }
     }
     pthread_mutex_unlock(&jobqueue_p->jobqueue_mtx);
 
-    return head;
+    return job_p;
 }
 
 static int
@@ -303,21 +631,9 @@ jobqueue_add(jobqueue *jobqueue_p, job *job_p)
 {
     int ret_val = -1;
     pthread_mutex_lock(&jobqueue_p->jobqueue_mtx);
-    job_p->next = NULL;
     if (jobqueue_p->num_jobs < jobqueue_p->max_size)
     {
-        if (jobqueue_p->head == NULL)
-        {
-            jobqueue_p->head = job_p;
-            jobqueue_p->tail = job_p;
-        }
-        else
-        {
-            jobqueue_p->tail->next = job_p;
-            jobqueue_p->tail = job_p;
-        }
-
-        jobqueue_p->num_jobs++;
+        jobqueue_push(jobqueue_p, job_p);
         bsem_post(jobqueue_p->has_jobs);
         ret_val = 0;
     }
@@ -326,12 +642,181 @@ jobqueue_add(jobqueue *jobqueue_p, job *job_p)
     return ret_val;
 }
 
+/* Queue as many jobs of the chain 'head_p' as there is room for. The chain
+   of jobs that were not queued is returned in 'rest_pp'. */
+static unsigned int
+jobqueue_add_batch(jobqueue *jobqueue_p, job *head_p, unsigned int num_jobs, job **rest_pp)
+{
+    unsigned int num_added = 0;
+    pthread_mutex_lock(&jobqueue_p->jobqueue_mtx);
+    while (head_p != NULL && jobqueue_p->num_jobs < jobqueue_p->max_size) {
+        job *next = head_p->next;
+        jobqueue_push(jobqueue_p, head_p);
+        head_p = next;
+        num_added++;
+    }
+
+    if (num_added > 0) {
+        bsem_post(jobqueue_p->has_jobs);
+    }
+    pthread_mutex_unlock(&jobqueue_p->jobqueue_mtx);
+
+    *rest_pp = head_p;
+    return num_added;
+}
+
+/*
+Track the time jobs spend in the queue (their sojourn time) as CoDel does for
+packets: a queue whose sojourn times stay above the target for a whole
+interval holds a standing backlog that the threads are not absorbing, i.e.
+the pool is overloaded. A single job under target, or the queue running
+empty, ends the overload. Called with the job queue lock held, for each job
+dispatched.
+*/
+static void
+jobqueue_codel(jobqueue *jobqueue_p, const job *job_p)
+{
+    uint64_t now = get_monotonic_ns();
+    uint64_t sojourn_ns = now - job_p->enqueue_ns;
+
+    if (sojourn_ns < jobqueue_p->codel_target_ns || jobqueue_p->num_jobs == 1) {
+        jobqueue_p->first_above_ns = 0;
+        if (jobqueue_p->overloaded)
+            __atomic_store_n(&jobqueue_p->overloaded, 0, __ATOMIC_RELAXED);
+    }
+    else if (jobqueue_p->first_above_ns == 0) {
+        jobqueue_p->first_above_ns = now + jobqueue_p->codel_interval_ns;
+    }
+    else if (now >= jobqueue_p->first_above_ns && !jobqueue_p->overloaded) {
+        __atomic_store_n(&jobqueue_p->overloaded, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Append a job to the job queue. Caller must hold the job queue mutex
+   and have checked that the job queue is not full. */
+static void
+jobqueue_push(jobqueue *jobqueue_p, job *job_p)
+{
+    job_p->seq = jobqueue_p->next_seq++;
+    job_p->enqueue_ns = get_monotonic_ns();
+
+    /* Track the job arrival rate, which sizes the spin phase of idle threads */
+    if (jobqueue_p->last_push_ns != 0) {
+        uint64_t delta = job_p->enqueue_ns - jobqueue_p->last_push_ns;
+        uint64_t avg = jobqueue_p->interarrival_ns;
+        avg = (avg == 0) ? delta : avg - avg/8 + delta/8;
+        __atomic_store_n(&jobqueue_p->interarrival_ns, avg, __ATOMIC_RELAXED);
+    }
+    jobqueue_p->last_push_ns = job_p->enqueue_ns;
+    job_p->prev = jobqueue_p->tail;
+    job_p->next = NULL;
+
+    if (jobqueue_p->head == NULL)
+    {
+        jobqueue_p->head = job_p;
+        jobqueue_p->tail = job_p;
+    }
+    else
+    {
+        jobqueue_p->tail->next = job_p;
+        jobqueue_p->tail = job_p;
+    }
+
+    if (jobqueue_p->heap != NULL) {
+        job_p->heap_idx = jobqueue_p->num_jobs;
+        jobqueue_p->heap[job_p->heap_idx] = job_p;
+        heap_sift_up(jobqueue_p->heap, job_p->heap_idx);
+    }
+
+    jobqueue_p->num_jobs++;
+}
+
+/* Unlink a queued job from the job queue. Caller must hold the job queue mutex. */
+static void
+jobqueue_remove(jobqueue *jobqueue_p, job *job_p)
+{
+    if (job_p->prev != NULL)
+        job_p->prev->next = job_p->next;
+    else
+        jobqueue_p->head = job_p->next;
+
+    if (job_p->next != NULL)
+        job_p->next->prev = job_p->prev;
+    else
+        jobqueue_p->tail = job_p->prev;
+
+    jobqueue_p->num_jobs--;
+
+    if (jobqueue_p->heap != NULL) {
+        /* Move the last heap entry into the hole and restore the heap order */
+        unsigned int i = job_p->heap_idx;
+        if (i != jobqueue_p->num_jobs) {
+            heap_swap(jobqueue_p->heap, i, jobqueue_p->num_jobs);
+            heap_sift_down(jobqueue_p->heap, jobqueue_p->num_jobs, i);
+            heap_sift_up(jobqueue_p->heap, i);
+        }
+    }
+
+    job_p->prev = NULL;
+    job_p->next = NULL;
+}
+
+
+/* ========================== HEAP ========================== */
+
+
+static int
+heap_less(const job *a, const job *b)
+{
+    if (a->key != b->key)
+        return a->key < b->key;
+    return a->seq < b->seq;
+}
+
+static void
+heap_swap(job **heap, unsigned int i, unsigned int j)
+{
+    job *tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    heap[i]->heap_idx = i;
+    heap[j]->heap_idx = j;
+}
+
+static void
+heap_sift_up(job **heap, unsigned int i)
+{
+    while (i > 0) {
+        unsigned int parent = (i - 1) / 2;
+        if (!heap_less(heap[i], heap[parent]))
+            break;
+        heap_swap(heap, i, parent);
+        i = parent;
+    }
+}
+
+static void
+heap_sift_down(job **heap, unsigned int n, unsigned int i)
+{
+    for (;;) {
+        unsigned int smallest = i, left = 2*i + 1, right = 2*i + 2;
+        if (left < n && heap_less(heap[left], heap[smallest]))
+            smallest = left;
+        if (right < n && heap_less(heap[right], heap[smallest]))
+            smallest = right;
+        if (smallest == i)
+            break;
+        heap_swap(heap, i, smallest);
+        i = smallest;
+    }
+}
+
 
 /* ========================== THREAD ========================== */
 
 
 static int
-thread_init(thpool *thpool_p, thread **thread_p, int id)
+thread_init(thpool *thpool_p, thread **thread_p, int id, int cpu)
 {   // Must use double pointer (thread **thread) to fill entry in thpool->threads
 
     *thread_p = (thread *) malloc(sizeof(**thread_p));
@@ -341,16 +826,29 @@ thread_init(thpool *thpool_p, thread **thread_p, int id)
     }
 
     (*thread_p)->id = id;
+    (*thread_p)->cpu = cpu;
     (*thread_p)->thpool = thpool_p;
-
-    if (pthread_create(&(*thread_p)->pthread, NULL, thread_start, *thread_p) > 0) {
-        errMsg("thread_init(): Failed to create new thread");
-        free(*thread_p);
-        return -1;
+    hist_init(&(*thread_p)->spin_hist);
+    hist_init(&(*thread_p)->park_hist);
+
+    /* Pin the thread before it starts so that its stack and everything
+       it allocates are first touched on its own CPU */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) > 0) {
+            errMsg("thread_init(): Failed to set affinity of thread %d to CPU %d", id, cpu);
+            (*thread_p)->cpu = -1;
+        }
     }
 
-    if (pthread_detach((*thread_p)->pthread) > 0) {
-        errMsg("thread_init(): Failed to detach thread");
+    int ret_val = pthread_create(&(*thread_p)->pthread, &attr, thread_start, *thread_p);
+    pthread_attr_destroy(&attr);
+    if (ret_val > 0) {
+        errMsg("thread_init(): Failed to create new thread");
         free(*thread_p);
         return -1;
     }
@@ -371,6 +869,7 @@ static void *
 thread_start(void *arg)
 {
     thread *thread_p = (thread *) arg;
+    thread_self = thread_p;
 
     /* Set thread name? */
 
@@ -400,30 +899,56 @@ thread_start(void *arg)
 		errMsg("thread_start(): cannot handle SIGPIPE");
 	}
 
+    /* Keep the memory of a pinned thread on its NUMA node */
+    if (thread_p->cpu >= 0 && affinity_bind_local_memory() == -1) {
+        errMsg("thread_start(): Failed to set local memory policy");
+    }
+
     /* Assure all threads have been created before starting serving */
     thpool *thpool_p = thread_p->thpool;
 
+    /* Let the user allocate per-thread state, which is now node local */
+    if (thpool_p->on_thread_start != NULL) {
+        thpool_p->on_thread_start(thread_p->id);
+    }
+
     /* Mark thread as alive */
     pthread_mutex_lock(&thpool_p->thpool_mtx);
     thpool_p->num_threads_alive++;
+    pthread_cond_broadcast(&thpool_p->thpool_cnd);     // Signal thpool_init()
     pthread_mutex_unlock(&thpool_p->thpool_mtx);
 
-    while (threads_keepalive) {
+    while (__atomic_load_n(&thpool_p->keepalive, __ATOMIC_ACQUIRE)) {
 
-        bsem_wait(thpool_p->jobqueue.has_jobs);
+        uint64_t wait_start_ns = get_monotonic_ns();
+        int spun = thread_wait(thread_p);
 
-        if (threads_keepalive) {    // Check invariant again as state may have changed
+        if (__atomic_load_n(&thpool_p->keepalive, __ATOMIC_ACQUIRE)) {    // Check invariant again as state may have changed
 
             pthread_mutex_lock(&thpool_p->thpool_mtx);
             thpool_p->num_threads_working++;
             pthread_mutex_unlock(&thpool_p->thpool_mtx);
 
-            job *job_p = jobqueue_poll(&thpool_p->jobqueue);
+            job *job_p = jobqueue_poll(&thpool_p->jobqueue, thread_p->cpu);
             void (*function)(void *);
             void *arg;
             if (job_p != NULL) {
+                thread_p->current.enqueue_ns = job_p->enqueue_ns;
+                thread_p->current.dispatch_ns = get_monotonic_ns();
+                thread_p->current.arrival_seq = job_p->seq;
+                thread_p->current.dispatch_seq = job_p->dispatch_seq;
+                /* Of the 'dispatch_seq' jobs dispatched earlier, all but the
+                   'seq - num_overtaken' older ones arrived after this job */
+                thread_p->current.age = thpool_p->jobqueue.job_ages
+                                        ? job_p->dispatch_seq - (job_p->seq - job_p->num_overtaken) : 0;
+                if (job_p->enqueue_ns >= wait_start_ns) {
+                    hist_record(spun ? &thread_p->spin_hist : &thread_p->park_hist,
+                                thread_p->current.dispatch_ns - job_p->enqueue_ns);
+                }
+
                 function = job_p->function;
                 arg = job_p->arg;
+                TRACE3(dequeue, arg, thread_p->id, thread_p->current.dispatch_ns - job_p->enqueue_ns);
                 function(arg);
                 free(job_p);
             }
@@ -431,12 +956,16 @@ thread_start(void *arg)
             pthread_mutex_lock(&thpool_p->thpool_mtx);
             thpool_p->num_threads_working--;
             if (thpool_p->num_threads_working == 0) {
-                pthread_cond_signal(&thpool_p->thpool_cnd);    // Signal thpool_wait()
+                pthread_cond_broadcast(&thpool_p->thpool_cnd);    // Signal thpool_wait() and thpool_drain()
             }
             pthread_mutex_unlock(&thpool_p->thpool_mtx);
         }
     }
 
+    if (thpool_p->on_thread_exit != NULL) {
+        thpool_p->on_thread_exit(thread_p->id);
+    }
+
     pthread_mutex_lock(&thpool_p->thpool_mtx);
     thpool_p->num_threads_alive--;
     pthread_mutex_unlock(&thpool_p->thpool_mtx);
@@ -444,6 +973,33 @@ thread_start(void *arg)
     return NULL;
 }
 
+/*
+Wait until there may be a job in the job queue. If jobs have recently been
+arriving faster than the spin limit of the pool, first spin for a couple of
+mean inter-arrival times: a job arriving meanwhile is picked up without the
+futex wakeup and context switch of blocking on the semaphore. Returns 1 if
+the thread was woken up while spinning, or 0 if it blocked.
+*/
+static int
+thread_wait(thread *thread_p)
+{
+    thpool *thpool_p = thread_p->thpool;
+    jobqueue *jobqueue_p = &thpool_p->jobqueue;
+
+    uint64_t interarrival_ns = __atomic_load_n(&jobqueue_p->interarrival_ns, __ATOMIC_RELAXED);
+    if (interarrival_ns > 0 && interarrival_ns <= thpool_p->max_spin_ns) {
+        uint64_t budget_ns = THPOOL_SPIN_FACTOR * interarrival_ns;
+        if (budget_ns > thpool_p->max_spin_ns)
+            budget_ns = thpool_p->max_spin_ns;
+
+        if (bsem_spin(jobqueue_p->has_jobs, budget_ns, thpool_p->max_spinners))
+            return 1;
+    }
+
+    bsem_wait(jobqueue_p->has_jobs);
+    return 0;
+}
+
 static void
 thread_destroy(thread *thread_p)
 {
@@ -473,6 +1029,8 @@ bsem_init(bsem *bsem_p, int val)
     }
 
     bsem_p->val = val;
+    bsem_p->closed = 0;
+    bsem_p->spinning = 0;
 
     return 0;
 }
@@ -487,16 +1045,21 @@ static void
 bsem_post(bsem *bsem_p)
 {
     pthread_mutex_lock(&bsem_p->mtx);
-    bsem_p->val = 1;
+    __atomic_store_n(&bsem_p->val, 1, __ATOMIC_SEQ_CST);
+    int spinning = __atomic_load_n(&bsem_p->spinning, __ATOMIC_SEQ_CST);
     pthread_mutex_unlock(&bsem_p->mtx);
-    pthread_cond_signal(&bsem_p->cnd);
+
+    /* A spinning thread will see the post, so don't wake up a blocked one */
+    if (spinning == 0)
+        pthread_cond_signal(&bsem_p->cnd);
 }
 
+/* Wake up all current and future waiters for good */
 static void
-bsem_post_all(bsem *bsem_p)
+bsem_close(bsem *bsem_p)
 {
     pthread_mutex_lock(&bsem_p->mtx);
-    bsem_p->val = 1;
+    __atomic_store_n(&bsem_p->closed, 1, __ATOMIC_SEQ_CST);
     pthread_mutex_unlock(&bsem_p->mtx);
     pthread_cond_broadcast(&bsem_p->cnd);
 }
@@ -505,9 +1068,50 @@ static void
 bsem_wait(bsem *bsem_p)
 {
     pthread_mutex_lock(&bsem_p->mtx);
-    while (bsem_p->val != 1) {
+    while (bsem_p->val != 1 && !bsem_p->closed) {
         pthread_cond_wait(&bsem_p->cnd, &bsem_p->mtx);
     }
-    bsem_p->val = 0;
+    __atomic_store_n(&bsem_p->val, 0, __ATOMIC_RELAXED);
     pthread_mutex_unlock(&bsem_p->mtx);
 }
+
+/*
+Poll the semaphore for up to 'budget_ns' nanoseconds instead of blocking.
+Returns 1 if the semaphore was taken, or 0 if the budget ran out or too many
+threads are spinning already, in which case the caller should bsem_wait().
+The 'spinning' count is incremented before polling 'val' and bsem_post()
+sets 'val' before reading 'spinning', so a post skipping the wakeup is always
+seen either here or by the bsem_wait() that follows.
+*/
+static int
+bsem_spin(bsem *bsem_p, uint64_t budget_ns, int max_spinners)
+{
+    if (__atomic_add_fetch(&bsem_p->spinning, 1, __ATOMIC_SEQ_CST) > max_spinners) {
+        __atomic_sub_fetch(&bsem_p->spinning, 1, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+
+    uint64_t deadline_ns = get_monotonic_ns() + budget_ns;
+    unsigned int i = 0;
+    int taken = 0;
+    for (;;) {
+        if (__atomic_load_n(&bsem_p->val, __ATOMIC_SEQ_CST) == 1
+            || __atomic_load_n(&bsem_p->closed, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&bsem_p->mtx);
+            if (bsem_p->val == 1 || bsem_p->closed) {
+                __atomic_store_n(&bsem_p->val, 0, __ATOMIC_RELAXED);
+                taken = 1;
+            }
+            pthread_mutex_unlock(&bsem_p->mtx);
+            if (taken)
+                break;
+        }
+
+        cpu_relax();
+        if ((++i & 63) == 0 && get_monotonic_ns() >= deadline_ns)
+            break;
+    }
+
+    __atomic_sub_fetch(&bsem_p->spinning, 1, __ATOMIC_SEQ_CST);
+    return taken;
+}
@@ -5,19 +5,79 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
+#include "../utils/histogram.h"
+
 
 typedef struct thpool * threadpool;
 
+/* Job queue scheduling policies */
+typedef enum {
+    THPOOL_SCHED_FIFO,          /* Oldest job first */
+    THPOOL_SCHED_ANY,           /* Any job first. FIFO, preferring jobs for the CPU of the thread */
+    THPOOL_SCHED_SFF,           /* Smallest key first, FIFO among equal keys */
+    THPOOL_SCHED_SFF_AGING      /* SFF, but a job that waited 'max_wait_ms' is served next */
+} thpool_sched;
+
+#define THPOOL_DEFAULT_MAX_WAIT_MS 200
+#define THPOOL_DEFAULT_MAX_SPIN_US 50
+#define THPOOL_DEFAULT_CODEL_INTERVAL_MS 100
+
+/* Thread pool attributes. Initialize with thpool_attr_init() before setting fields. */
+typedef struct thpool_attr {
+    thpool_sched sched;         /* Job queue scheduling policy */
+    unsigned int max_wait_ms;   /* Starvation bound of THPOOL_SCHED_SFF_AGING */
+    const int *cpus;            /* CPUs to pin the threads to, round-robin. NULL for no pinning */
+    unsigned int num_cpus;
+    void (*on_thread_start)(int id);    /* Called by each thread before it serves jobs */
+    void (*on_thread_exit)(int id);     /* Called by each thread before it terminates */
+    unsigned int max_spin_us;   /* Longest time an idle thread spins before blocking. 0 disables spinning */
+    unsigned int codel_target_us;   /* Queueing delay above which the pool is overloaded, see thpool_is_overloaded(). 0 disables */
+    unsigned int codel_interval_ms; /* Time the delay must stay above target */
+    int job_ages;               /* Compute thpool_job_info.age, which walks the job queue on every dispatch */
+} thpool_attr;
+
+/* Job being run by the calling thread, see thpool_current_job() */
+typedef struct thpool_job_info {
+    uint64_t enqueue_ns;        /* Time the job entered the job queue (CLOCK_MONOTONIC) */
+    uint64_t dispatch_ns;       /* Time a thread took the job off the job queue */
+    unsigned long arrival_seq;  /* Number of jobs queued before this one */
+    unsigned long dispatch_seq; /* Number of jobs dispatched before this one */
+    unsigned long age;          /* Number of jobs queued after this one but dispatched before it. 0 unless job_ages is set */
+} thpool_job_info;
+
+/* A unit of work submitted with thpool_add_work_batch() */
+typedef struct thpool_work {
+    void *arg;                  /* Argument of the job function */
+    unsigned long key;          /* Scheduling key (SFF policies) */
+    int cpu;                    /* Preferred CPU (ANY policy with pinned threads), or -1 */
+} thpool_work;
+
+
+void thpool_attr_init(thpool_attr *attr);
 
-threadpool thpool_init(unsigned int num_threads, unsigned int jobqueue_size);
+threadpool thpool_init(unsigned int num_threads, unsigned int jobqueue_size, const thpool_attr *attr);
 
 int thpool_add_work(threadpool thpool_p, void (*function)(void*), void *arg);
 
+int thpool_add_work_key(threadpool thpool_p, void (*function)(void*), void *arg, unsigned long key);
+
+int thpool_add_work_batch(threadpool thpool_p, void (*function)(void*), const thpool_work *work, unsigned int num_jobs);
+
 void thpool_destroy(threadpool thpool_p);
 
+int thpool_drain(threadpool thpool_p, unsigned int timeout_ms);
+
 void thpool_wait(threadpool thpool_p);
 
 int thpool_num_threads_working(threadpool thpool_p);
 
+int thpool_is_overloaded(threadpool thpool_p);
+
+void thpool_wakeup_latency(threadpool thpool_p, hist_t *spun, hist_t *parked);
+
+int thpool_thread_id(void);
+
+const thpool_job_info *thpool_current_job(void);
+
 
 #endif
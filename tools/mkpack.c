@@ -0,0 +1,352 @@
+/* mkpack.c
+ *
+ * Archive builder for the packed document root (see server/pack.c)
+ *
+ * Packs the regular files under a document root into one archive: for each
+ * file, its URL path, the response header of each variant (content type,
+ * length and a strong ETag derived from the content), the body, and a gzip
+ * variant of the compressible files when it is smaller enough to be worth
+ * it. The bodies are written as the files are read, so that only the index
+ * and the headers are held in memory.
+ *
+ * The archive is written to ARCHIVE.tmp and renamed over ARCHIVE once
+ * complete, so that a server reloading ARCHIVE (SIGHUP) never sees it partly
+ * written.
+ *
+ * Usage: mkpack [-z level] docroot archive
+ *
+ * -z sets the gzip compression level, 1 to 9 (default 9), or 0 for no gzip
+ * variants.
+*/
+#define _GNU_SOURCE
+
+#include "../utils/tlpi_hdr.h"
+#include "../utils/utils.h"
+#include "../server/pack.h"
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define MKPACK_NFTW_FDS     64
+#define MKPACK_MIN_SAVING   10      /* Percentage of the size a gzip variant must save */
+#define MKPACK_HDR_MAX      1024
+
+
+/* ========================== GLOBALS ============================ */
+
+
+static int gzip_level = Z_BEST_COMPRESSION;
+static const char *root;            /* Document root, as given */
+static int out_fd;
+static uint64_t out_off;            /* End of the bodies written so far */
+
+static pack_entry *entries;
+static unsigned int num_entries, cap_entries;
+
+/* Paths and headers, appended to the archive after the bodies. The offsets
+   of the entries are into this buffer until then. */
+static char *strs;
+static size_t strs_len, strs_cap;
+
+/* Content types by extension, and whether they are worth compressing */
+static const struct {
+    const char *ext;
+    const char *type;
+    int compress;
+} types[] = {
+    { "html", "text/html", 1 },
+    { "htm", "text/html", 1 },
+    { "css", "text/css", 1 },
+    { "js", "application/javascript", 1 },
+    { "json", "application/json", 1 },
+    { "xml", "application/xml", 1 },
+    { "svg", "image/svg+xml", 1 },
+    { "txt", "text/plain", 1 },
+    { "jpg", "image/jpeg", 0 },
+    { "jpeg", "image/jpeg", 0 },
+    { "png", "image/png", 0 },
+    { "gif", "image/gif", 0 },
+    { "ico", "image/x-icon", 1 },
+    { "woff2", "font/woff2", 0 },
+    { "pdf", "application/pdf", 0 },
+};
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static void usage(const char *prog);
+static int add_file(const char *path, const struct stat *sbuf, int type, struct FTW *ftwbuf);
+static void add_variant(pack_variant *var, const char *content_type, const char *encoding, int vary,
+                        const char *body, size_t len, uint64_t content_hash);
+static size_t gzip_body(const char *body, size_t len, char **gz);
+static uint64_t append_str(const char *str, size_t len);
+static void write_all(const void *buf, size_t len, uint64_t off);
+static int cmp_entries(const void *a, const void *b);
+
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "z:")) != -1) {
+        switch (opt) {
+            case 'z': gzip_level = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || gzip_level < 0 || gzip_level > 9)
+        usage(argv[0]);
+    root = argv[optind];
+    const char *archive = argv[optind + 1];
+
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", archive) >= sizeof(tmp))
+        fatal("main(): Archive path too long");
+    out_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1)
+        errExit("main(): Failed to create %s", tmp);
+
+    /* The bodies go right after the index, whose size depends on the
+       number of files: walk the document root twice, first to count them */
+    if (nftw(root, add_file, MKPACK_NFTW_FDS, FTW_PHYS) != 0)
+        errExit("main(): nftw(): Failed to walk %s", root);
+    unsigned int count = num_entries;
+    num_entries = 0;
+    strs_len = 0;
+    free(entries);
+    entries = (pack_entry *) calloc(count > 0 ? count : 1, sizeof(*entries));
+    if (entries == NULL)
+        errExit("main(): calloc()");
+    cap_entries = count;
+
+    out_off = sizeof(pack_header) + (uint64_t) count * sizeof(pack_entry);
+    if (nftw(root, add_file, MKPACK_NFTW_FDS, FTW_PHYS) != 0)
+        errExit("main(): nftw(): Failed to walk %s", root);
+    if (num_entries != count)
+        fatal("main(): %s changed while it was packed", root);
+
+    /* The paths and headers after the bodies */
+    uint64_t strs_off = out_off;
+    unsigned int i, v;
+    for (i = 0; i < num_entries; i++) {
+        entries[i].path_off += strs_off;
+        for (v = 0; v < PACK_NUM_VARIANTS; v++) {
+            if (entries[i].variants[v].hdr_len > 0)
+                entries[i].variants[v].hdr_off += strs_off;
+        }
+    }
+    write_all(strs, strs_len, strs_off);
+
+    /* Sort the index for pack_lookup(), comparing the paths in the buffer */
+    for (i = 0; i < num_entries; i++)
+        entries[i].path_off -= strs_off;
+    qsort(entries, num_entries, sizeof(*entries), cmp_entries);
+    for (i = 0; i < num_entries; i++)
+        entries[i].path_off += strs_off;
+    write_all(entries, (size_t) num_entries * sizeof(*entries), sizeof(pack_header));
+
+    pack_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+    hdr.version = PACK_VERSION;
+    hdr.num_entries = num_entries;
+    hdr.entries_off = sizeof(pack_header);
+    hdr.size = strs_off + strs_len;
+    write_all(&hdr, sizeof(hdr), 0);
+
+    if (fsync(out_fd) == -1 || close(out_fd) == -1)
+        errExit("main(): Failed to write %s", tmp);
+    if (rename(tmp, archive) == -1)
+        errExit("main(): Failed to rename %s to %s", tmp, archive);
+
+    printf("Packed %u files into %s (%llu bytes)\n", num_entries, archive, (unsigned long long) hdr.size);
+    exit(EXIT_SUCCESS);
+}
+
+static void
+usage(const char *prog)
+{
+    usageErr("%s [-z level] docroot archive\n", prog);
+}
+
+/* nftw() callback: add the regular file 'path' to the archive. On the first
+   walk, when 'cap_entries' is 0, only count it. */
+static int
+add_file(const char *path, const struct stat *sbuf, int type, struct FTW *ftwbuf)
+{
+    if (type != FTW_F || !S_ISREG(sbuf->st_mode))
+        return 0;
+    if (cap_entries == 0) {
+        num_entries++;
+        return 0;
+    }
+    if (num_entries == cap_entries)
+        fatal("add_file(): %s changed while it was packed", root);
+
+    /* URL path: the path below the document root, with a leading '/' */
+    const char *rel = path + strlen(root);
+    while (*rel == '/')
+        rel++;
+    char url[PATH_MAX + 1];
+    snprintf(url, sizeof(url), "/%s", rel);
+
+    /* Read the file */
+    size_t len = sbuf->st_size;
+    char *body = (char *) malloc(len > 0 ? len : 1);
+    if (body == NULL)
+        errExit("add_file(): malloc()");
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        errExit("add_file(): Failed to open %s", path);
+    if (readn(fd, body, len) != (ssize_t) len)
+        fatal("add_file(): Failed to read %s", path);
+    close(fd);
+
+    const char *content_type = "text/plain";
+    int compress = 0;
+    const char *ext = get_filename_ext(url);
+    size_t t;
+    for (t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        if (!strcasecmp(ext, types[t].ext)) {
+            content_type = types[t].type;
+            compress = types[t].compress;
+        }
+    }
+
+    /* Keep the gzip variant if it saves enough to be worth it */
+    char *gz = NULL;
+    size_t gz_len = 0;
+    if (compress && gzip_level > 0 && len > 0) {
+        gz_len = gzip_body(body, len, &gz);
+        if (gz_len == 0 || gz_len > len - len * MKPACK_MIN_SAVING / 100) {
+            free(gz);
+            gz = NULL;
+            gz_len = 0;
+        }
+    }
+
+    pack_entry *e = &entries[num_entries++];
+    memset(e, 0, sizeof(*e));
+    e->hash = pack_hash(url, strlen(url));
+    e->path_off = append_str(url, strlen(url));
+    e->path_len = strlen(url);
+
+    uint64_t content_hash = pack_hash(body, len);
+    add_variant(&e->variants[PACK_IDENTITY], content_type, NULL, gz != NULL, body, len, content_hash);
+    if (gz != NULL)
+        add_variant(&e->variants[PACK_GZIP], content_type, "gzip", 1, gz, gz_len, content_hash);
+
+    free(body);
+    free(gz);
+    return 0;
+}
+
+/* Write the body of a variant and keep its response header. The ETag of the
+   gzip variant differs from that of the identity one, as they are different
+   representations. */
+static void
+add_variant(pack_variant *var, const char *content_type, const char *encoding, int vary,
+            const char *body, size_t len, uint64_t content_hash)
+{
+    snprintf(var->etag, sizeof(var->etag), "\"%016llx%s\"", (unsigned long long) content_hash,
+             (encoding != NULL) ? "-gz" : "");
+
+    char hdr[MKPACK_HDR_MAX];
+    int n = snprintf(hdr, sizeof(hdr),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Server: Tzou's HTTP server\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "%s%s%s"
+                     "%s"
+                     "ETag: %s\r\n",
+                     content_type, len,
+                     (encoding != NULL) ? "Content-Encoding: " : "", (encoding != NULL) ? encoding : "",
+                     (encoding != NULL) ? "\r\n" : "",
+                     vary ? "Vary: Accept-Encoding\r\n" : "",
+                     var->etag);
+    var->hdr_off = append_str(hdr, n);
+    var->hdr_len = n;
+
+    var->body_off = out_off;
+    var->body_len = len;
+    write_all(body, len, out_off);
+    out_off += len;
+}
+
+/* Compress 'body' into a gzip stream allocated in '*gz'. Returns its length,
+   or 0 on error. */
+static size_t
+gzip_body(const char *body, size_t len, char **gz)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+
+    size_t cap = deflateBound(&zs, len);
+    *gz = (char *) malloc(cap);
+    if (*gz == NULL) {
+        deflateEnd(&zs);
+        return 0;
+    }
+
+    zs.next_in = (Bytef *) body;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *) *gz;
+    zs.avail_out = cap;
+    int ret = deflate(&zs, Z_FINISH);
+    size_t gz_len = zs.total_out;
+    deflateEnd(&zs);
+
+    return (ret == Z_STREAM_END) ? gz_len : 0;
+}
+
+/* Append 'len' bytes to the strings. Returns their offset in the buffer. */
+static uint64_t
+append_str(const char *str, size_t len)
+{
+    if (strs_len + len > strs_cap) {
+        strs_cap = (strs_cap + len) * 2;
+        strs = (char *) realloc(strs, strs_cap);
+        if (strs == NULL)
+            errExit("append_str(): realloc()");
+    }
+    memcpy(strs + strs_len, str, len);
+    strs_len += len;
+    return strs_len - len;
+}
+
+static void
+write_all(const void *buf, size_t len, uint64_t off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(out_fd, buf, len, off);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("write_all(): pwrite()");
+        }
+        buf = (const char *) buf + n;
+        len -= n;
+        off += n;
+    }
+}
+
+/* Order of the index: by hash, then by path */
+static int
+cmp_entries(const void *a, const void *b)
+{
+    const pack_entry *ea = (const pack_entry *) a, *eb = (const pack_entry *) b;
+    if (ea->hash != eb->hash)
+        return (ea->hash < eb->hash) ? -1 : 1;
+
+    size_t len = min(ea->path_len, eb->path_len);
+    int c = memcmp(strs + ea->path_off, strs + eb->path_off, len);
+    if (c != 0)
+        return c;
+    return (ea->path_len < eb->path_len) ? -1 : (ea->path_len > eb->path_len);
+}
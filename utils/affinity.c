@@ -0,0 +1,121 @@
+/* affinity.c
+ *
+ * CPU topology helpers used to place threads on CPUs
+*/
+#define _GNU_SOURCE     /* For CPU_SET() and friends */
+
+#include "tlpi_hdr.h"
+#include "affinity.h"
+#include <sched.h>
+#include <ctype.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+
+/* Parse a CPU list in the format used by the kernel (e.g. "0-3,8,10-11") and
+   store the CPU numbers, in order, in 'cpus'. Returns the number of CPUs
+   stored, or -1 if the list is malformed or has more than 'max_cpus' CPUs. */
+
+int
+affinity_parse_cpu_list(const char *str, int *cpus, int max_cpus)
+{
+    int num_cpus = 0;
+    const char *p = str;
+
+    while (*p != '\0') {
+        char *end;
+        long first, last;
+
+        while (isspace((unsigned char) *p)) p++;
+        if (*p == '\0')
+            break;
+
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        last = first;
+        p = end;
+
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+            p = end;
+        }
+
+        for (; first <= last; first++) {
+            if (num_cpus == max_cpus)
+                return -1;
+            cpus[num_cpus++] = first;
+        }
+
+        while (isspace((unsigned char) *p)) p++;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+    }
+
+    return num_cpus;
+}
+
+/* Store in 'cpus' one CPU per physical core that this process may run on,
+   skipping the SMT siblings of each core. The topology is read from sysfs;
+   if it is unavailable, every allowed CPU is treated as a core of its own.
+   Returns the number of CPUs stored, or -1 on error. */
+
+int
+affinity_physical_cpus(int *cpus, int max_cpus)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        return -1;
+
+    int num_cpus = 0;
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE && num_cpus < max_cpus; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+
+        char path[128], list[256];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+
+        FILE *fp = fopen(path, "r");
+        if (fp != NULL) {
+            int siblings[AFFINITY_MAX_CPUS];
+            int n = -1;
+            if (fgets(list, sizeof(list), fp) != NULL)
+                n = affinity_parse_cpu_list(list, siblings, AFFINITY_MAX_CPUS);
+            fclose(fp);
+
+            /* Keep only the first allowed sibling of the core */
+            int i, first_sibling = 1;
+            for (i = 0; i < n && siblings[i] < cpu; i++) {
+                if (CPU_ISSET(siblings[i], &allowed))
+                    first_sibling = 0;
+            }
+            if (!first_sibling)
+                continue;
+        }
+
+        cpus[num_cpus++] = cpu;
+    }
+
+    return num_cpus;
+}
+
+/* Make all memory subsequently faulted in by the calling thread come from the
+   NUMA node of the CPU it runs on, even if the process was started with
+   another memory policy (e.g. numactl --interleave). Buffers first touched
+   by a pinned thread then stay node local. Returns 0 on success, -1 on error. */
+
+int
+affinity_bind_local_memory(void)
+{
+#ifdef SYS_set_mempolicy
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == -1 && errno != ENOSYS)
+        return -1;
+#endif
+    return 0;
+}
@@ -0,0 +1,17 @@
+/* affinity.h
+
+   Header file for affinity.c
+*/
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#define AFFINITY_MAX_CPUS 1024  /* Maximum number of CPUs in a CPU list */
+
+int affinity_parse_cpu_list(const char *str, int *cpus, int max_cpus);
+
+int affinity_physical_cpus(int *cpus, int max_cpus);
+
+int affinity_bind_local_memory(void);
+
+#endif
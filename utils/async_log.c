@@ -0,0 +1,563 @@
+/* async_log.c
+ *
+ * Asynchronous line oriented logs
+ *
+ * Each thread writing to a log gets its own single-producer single-consumer
+ * ring buffer, registered on its first write, so writers never take a lock or
+ * make a system call (except for an occasional eventfd nudge). A dedicated
+ * logger thread per log drains all rings with one writev() every
+ * ALOG_FLUSH_MS, or sooner when a ring gets half full. A line that does not
+ * fit in its ring is dropped and counted instead of blocking the writer.
+ *
+ * Logs written to a file are rotated when they grow past a size limit, and
+ * can be reopened on request (e.g. on SIGHUP, after an external logrotate).
+ * A log can also be sent to syslog, in which case the logger thread makes
+ * the syslog() calls, one per line.
+*/
+#define _GNU_SOURCE
+
+#include "tlpi_hdr.h"
+#include "async_log.h"
+#include <stdarg.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <syslog.h>
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* Ring buffer of one writing thread. 'head' and 'tail' are byte positions
+   that only grow; they are on separate cache lines so that the writer and
+   the logger thread do not contend on them. */
+typedef struct alog_ring {
+    uint64_t head __attribute__ ((aligned(64)));    /* Written by the writer thread */
+    int nudged;                                     /* Writer has signalled the logger thread */
+    uint64_t tail __attribute__ ((aligned(64)));    /* Written by the logger thread */
+    char *buf;
+} alog_ring;
+
+struct alog {
+    unsigned int id;            /* Index in 'logs' */
+    uint64_t gen;               /* Distinguishes this log from earlier logs with the same id */
+    char *path;                 /* NULL if not written to a file of its own */
+    int fd;
+    int priority;               /* syslog() priority of the lines, or -1 if not sent to syslog */
+    off_t size;                 /* Current size of the file */
+    off_t rotate_bytes;         /* Size at which the file is rotated. 0 never rotates */
+    size_t ring_size;           /* Power of two */
+    alog_ring *rings[ALOG_MAX_RINGS];
+    unsigned int num_rings;
+    uint64_t dropped;
+    int reopen;                 /* Set by alog_reopen() */
+    int stop;                   /* Set by alog_close() */
+    int efd;                    /* eventfd waking up the logger thread */
+    pthread_t thread;
+};
+
+
+/* ========================== GLOBALS ============================ */
+
+
+static pthread_mutex_t logs_mtx = PTHREAD_MUTEX_INITIALIZER;
+static alog_t *logs[ALOG_MAX_LOGS];
+static uint64_t next_gen = 1;
+
+/* Ring of the calling thread for each log id, valid if the generation matches */
+static __thread alog_ring *thread_rings[ALOG_MAX_LOGS];
+static __thread uint64_t thread_gens[ALOG_MAX_LOGS];
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static alog_t *alog_alloc(size_t ring_size);
+static alog_t *alog_start(alog_t *log);
+static alog_ring *alog_thread_ring(alog_t *log);
+static void alog_nudge(alog_t *log);
+static void *alog_thread(void *arg);
+static void alog_flush(alog_t *log);
+static void alog_syslog(alog_t *log, const struct iovec *iov, int iovcnt);
+static int alog_open_file(alog_t *log);
+static void alog_rotate(alog_t *log);
+
+
+/* ========================== LOG ============================ */
+
+
+/* Open a log appending to the file 'path', or to standard output if 'path'
+   is NULL or "-". The file is rotated when it grows past 'rotate_bytes'
+   (0 never rotates). 'ring_size' is the buffer size of each writing thread
+   (0 for ALOG_RING_SIZE). A relative 'path' is taken against the current
+   working directory, once: reopening and rotating the log use the same
+   file even if the process changes directory since. Returns NULL on error. */
+
+alog_t *
+alog_open(const char *path, off_t rotate_bytes, size_t ring_size)
+{
+    alog_t *log = alog_alloc(ring_size);
+    if (log == NULL)
+        return NULL;
+
+    log->fd = STDOUT_FILENO;
+    if (path != NULL && strcmp(path, "-")) {
+        char cwd[PATH_MAX];
+        if (path[0] == '/')
+            log->path = strdup(path);
+        else if (getcwd(cwd, sizeof(cwd)) == NULL || asprintf(&log->path, "%s/%s", cwd, path) == -1)
+            log->path = NULL;
+        if (log->path == NULL || alog_open_file(log) == -1) {
+            errMsg("alog_open(): Failed to open log file %s", path);
+            free(log->path);
+            free(log);
+            return NULL;
+        }
+        log->rotate_bytes = rotate_bytes;
+    }
+
+    return alog_start(log);
+}
+
+/* Open a log appending to the open file descriptor 'fd' (e.g. standard
+   error), which stays owned by the caller. Returns NULL on error. */
+
+alog_t *
+alog_open_fd(int fd, size_t ring_size)
+{
+    alog_t *log = alog_alloc(ring_size);
+    if (log == NULL)
+        return NULL;
+
+    log->fd = fd;
+    return alog_start(log);
+}
+
+/* Open a log whose lines are sent to syslog with 'priority'. The caller sets
+   up the connection with openlog(). Returns NULL on error. */
+
+alog_t *
+alog_open_syslog(int priority, size_t ring_size)
+{
+    alog_t *log = alog_alloc(ring_size);
+    if (log == NULL)
+        return NULL;
+
+    log->fd = -1;
+    log->priority = priority;
+    return alog_start(log);
+}
+
+static alog_t *
+alog_alloc(size_t ring_size)
+{
+    alog_t *log = (alog_t *) calloc(1, sizeof(*log));
+    if (log == NULL) {
+        errMsg("alog_open(): Failed to allocate memory for log");
+        return NULL;
+    }
+
+    /* Ring positions wrap with a mask */
+    if (ring_size == 0)
+        ring_size = ALOG_RING_SIZE;
+    log->ring_size = 1;
+    while (log->ring_size < ring_size)
+        log->ring_size <<= 1;
+
+    log->priority = -1;
+    return log;
+}
+
+/* Register the log and start its logger thread. Frees the log and returns
+   NULL on error. */
+
+static alog_t *
+alog_start(alog_t *log)
+{
+    log->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (log->efd == -1) {
+        errMsg("alog_open(): Failed to create eventfd");
+        goto fail;
+    }
+
+    pthread_mutex_lock(&logs_mtx);
+    unsigned int id;
+    for (id = 0; id < ALOG_MAX_LOGS && logs[id] != NULL; id++);
+    if (id < ALOG_MAX_LOGS) {
+        logs[id] = log;
+        log->id = id;
+        log->gen = next_gen++;
+    }
+    pthread_mutex_unlock(&logs_mtx);
+    if (id == ALOG_MAX_LOGS) {
+        errMsg("alog_open(): Too many open logs");
+        goto fail;
+    }
+
+    if (pthread_create(&log->thread, NULL, alog_thread, log) > 0) {
+        errMsg("alog_open(): Failed to create logger thread");
+        pthread_mutex_lock(&logs_mtx);
+        logs[log->id] = NULL;
+        pthread_mutex_unlock(&logs_mtx);
+        goto fail;
+    }
+
+    return log;
+
+fail:
+    if (log->efd > 0)
+        close(log->efd);
+    if (log->path != NULL)
+        close(log->fd);
+    free(log->path);
+    free(log);
+    return NULL;
+}
+
+/* Append 'len' bytes, normally one or more whole lines, to the log without
+   blocking. Returns 0 on success, or -1 if the bytes were dropped because the
+   ring buffer of the calling thread is full. */
+
+int
+alog_write(alog_t *log, const char *line, size_t len)
+{
+    alog_ring *ring = alog_thread_ring(log);
+    if (ring == NULL || len > log->ring_size) {
+        __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (log->ring_size - (head - tail) < len) {
+        __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    /* Copy the line, wrapping around the end of the buffer */
+    size_t off = head & (log->ring_size - 1);
+    size_t first = min(len, log->ring_size - off);
+    memcpy(ring->buf + off, line, first);
+    memcpy(ring->buf, line + first, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+    /* Don't wait for the next periodic flush if the ring is filling up */
+    if (head + len - tail > log->ring_size / 2 && !__atomic_load_n(&ring->nudged, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&ring->nudged, 1, __ATOMIC_RELAXED);
+        alog_nudge(log);
+    }
+
+    return 0;
+}
+
+int
+alog_printf(alog_t *log, const char *format, ...)
+{
+    char line[ALOG_LINE_MAX];
+    va_list ap;
+
+    va_start(ap, format);
+    int len = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+
+    if (len < 0)
+        return -1;
+
+    /* A truncated line still ends the entry, so that the next one starts on
+       a line of its own */
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+        if (format[0] != '\0' && format[strlen(format) - 1] == '\n')
+            line[len - 1] = '\n';
+    }
+
+    return alog_write(log, line, len);
+}
+
+/* Ask the logger thread to reopen the log file. Safe to call from a signal
+   handling thread; has no effect on a log not written to a file it opened. */
+
+void
+alog_reopen(alog_t *log)
+{
+    __atomic_store_n(&log->reopen, 1, __ATOMIC_RELEASE);
+    alog_nudge(log);
+}
+
+/* Return the number of writes dropped because a ring buffer was full */
+
+uint64_t
+alog_dropped(alog_t *log)
+{
+    return __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+}
+
+/* Flush all buffered lines, stop the logger thread and free the log. No
+   thread may write to the log concurrently or afterwards. */
+
+void
+alog_close(alog_t *log)
+{
+    if (log == NULL)
+        return;
+
+    __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+    alog_nudge(log);
+    if (pthread_join(log->thread, NULL) > 0) {
+        errMsg("alog_close(): Failed to join logger thread");
+    }
+
+    pthread_mutex_lock(&logs_mtx);
+    logs[log->id] = NULL;
+    pthread_mutex_unlock(&logs_mtx);
+
+    unsigned int i;
+    for (i = 0; i < ALOG_MAX_RINGS; i++) {
+        if (log->rings[i] != NULL) {
+            free(log->rings[i]->buf);
+            free(log->rings[i]);
+        }
+    }
+
+    close(log->efd);
+    if (log->path != NULL)
+        close(log->fd);
+    free(log->path);
+    free(log);
+}
+
+
+/* ========================== WRITER ============================ */
+
+
+/* Return the ring buffer of the calling thread, registering one on the first
+   write of the thread to this log. The buffer is allocated and touched by the
+   writer so that it is local to the writer's NUMA node. Returns NULL if all
+   ring slots are taken. */
+
+static alog_ring *
+alog_thread_ring(alog_t *log)
+{
+    if (thread_gens[log->id] == log->gen)
+        return thread_rings[log->id];
+
+    alog_ring *ring = NULL;
+    unsigned int slot = __atomic_fetch_add(&log->num_rings, 1, __ATOMIC_RELAXED);
+    if (slot < ALOG_MAX_RINGS && posix_memalign((void **) &ring, 64, sizeof(*ring)) == 0) {
+        memset(ring, 0, sizeof(*ring));
+        ring->buf = (char *) malloc(log->ring_size);
+        if (ring->buf == NULL) {
+            free(ring);
+            ring = NULL;
+        }
+        else {
+            memset(ring->buf, 0, log->ring_size);
+            __atomic_store_n(&log->rings[slot], ring, __ATOMIC_RELEASE);
+        }
+    }
+
+    thread_rings[log->id] = ring;
+    thread_gens[log->id] = log->gen;
+    return ring;
+}
+
+static void
+alog_nudge(alog_t *log)
+{
+    uint64_t one = 1;
+    if (write(log->efd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        /* The logger thread still flushes periodically */
+    }
+}
+
+
+/* ========================== LOGGER THREAD ============================ */
+
+
+static void *
+alog_thread(void *arg)
+{
+    alog_t *log = (alog_t *) arg;
+    struct pollfd pfd = { .fd = log->efd, .events = POLLIN };
+
+    for (;;) {
+        if (poll(&pfd, 1, ALOG_FLUSH_MS) == 1) {
+            uint64_t val;
+            if (read(log->efd, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+                errMsg("alog_thread(): Failed to read eventfd");
+            }
+        }
+
+        int stop = __atomic_load_n(&log->stop, __ATOMIC_ACQUIRE);
+
+        if (__atomic_exchange_n(&log->reopen, 0, __ATOMIC_ACQ_REL) && log->path != NULL) {
+            alog_flush(log);
+            if (alog_open_file(log) == -1) {
+                errMsg("alog_thread(): Failed to reopen log file %s", log->path);
+            }
+        }
+
+        alog_flush(log);
+
+        if (stop)
+            break;
+    }
+
+    return NULL;
+}
+
+/* Write out the contents of all ring buffers with a single writev() */
+
+static void
+alog_flush(alog_t *log)
+{
+    struct iovec iov[2*ALOG_MAX_RINGS];
+    alog_ring *rings[ALOG_MAX_RINGS];   /* Rings snapshotted, NULL for those not yet published */
+    uint64_t heads[ALOG_MAX_RINGS];
+    int iovcnt = 0;
+    size_t total = 0;
+
+    unsigned int num_rings = min(__atomic_load_n(&log->num_rings, __ATOMIC_RELAXED), ALOG_MAX_RINGS);
+    unsigned int i;
+    for (i = 0; i < num_rings; i++) {
+        alog_ring *ring = __atomic_load_n(&log->rings[i], __ATOMIC_ACQUIRE);
+        rings[i] = ring;
+        if (ring == NULL)
+            continue;
+
+        uint64_t tail = ring->tail;
+        heads[i] = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (heads[i] == tail)
+            continue;
+
+        size_t len = heads[i] - tail;
+        size_t off = tail & (log->ring_size - 1);
+        size_t first = min(len, log->ring_size - off);
+        iov[iovcnt].iov_base = ring->buf + off;
+        iov[iovcnt++].iov_len = first;
+        if (len > first) {
+            iov[iovcnt].iov_base = ring->buf;
+            iov[iovcnt++].iov_len = len - first;
+        }
+        total += len;
+    }
+
+    if (total == 0)
+        return;
+
+    if (log->priority != -1) {
+        alog_syslog(log, iov, iovcnt);
+        iovcnt = 0;
+    }
+
+    /* Restart after partial writes */
+    struct iovec *iov_p = iov;
+    while (iovcnt > 0) {
+        ssize_t n = writev(log->fd, iov_p, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            errMsg("alog_flush(): Failed to write log");
+            break;
+        }
+        while (iovcnt > 0 && n >= iov_p->iov_len) {
+            n -= iov_p->iov_len;
+            iov_p++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov_p->iov_base = (char *) iov_p->iov_base + n;
+            iov_p->iov_len -= n;
+        }
+    }
+
+    /* Hand the space back to the writers, in the rings snapshotted above
+       only: a ring published since has no head in 'heads' */
+    for (i = 0; i < num_rings; i++) {
+        alog_ring *ring = rings[i];
+        if (ring == NULL || heads[i] == ring->tail)
+            continue;
+        __atomic_store_n(&ring->tail, heads[i], __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->nudged, 0, __ATOMIC_RELAXED);
+    }
+
+    log->size += total;
+    if (log->path != NULL && log->rotate_bytes > 0 && log->size >= log->rotate_bytes)
+        alog_rotate(log);
+}
+
+/* Send the lines in 'iov' to syslog. A line may span two vectors when it
+   wraps around the end of its ring buffer. */
+
+static void
+alog_syslog(alog_t *log, const struct iovec *iov, int iovcnt)
+{
+    char line[ALOG_LINE_MAX];
+    size_t len = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        const char *p = (const char *) iov[i].iov_base;
+        size_t j;
+        for (j = 0; j < iov[i].iov_len; j++) {
+            if (p[j] == '\n') {
+                syslog(log->priority, "%.*s", (int) len, line);
+                len = 0;
+            }
+            else if (len < sizeof(line)) {
+                line[len++] = p[j];
+            }
+        }
+    }
+    if (len > 0)
+        syslog(log->priority, "%.*s", (int) len, line);
+}
+
+/* (Re)open the log file, replacing the current one. Returns 0 on success, or
+   -1 on error, in which case the current file is kept. */
+
+static int
+alog_open_file(alog_t *log)
+{
+    int fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    struct stat sbuf;
+    log->size = (fstat(fd, &sbuf) == 0) ? sbuf.st_size : 0;
+
+    if (log->fd != STDOUT_FILENO)
+        close(log->fd);
+    log->fd = fd;
+
+    return 0;
+}
+
+/* Shift path.1 ... path.N-1 to path.2 ... path.N, move the log file to path.1
+   and start a new one */
+
+static void
+alog_rotate(alog_t *log)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    int i;
+    for (i = ALOG_KEEP_FILES - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", log->path, i);
+        snprintf(to, sizeof(to), "%s.%d", log->path, i + 1);
+        rename(from, to);
+    }
+
+    snprintf(to, sizeof(to), "%s.1", log->path);
+    if (rename(log->path, to) == -1) {
+        errMsg("alog_rotate(): Failed to rotate log file %s", log->path);
+        log->size = 0;      /* Don't retry on every flush */
+        return;
+    }
+
+    if (alog_open_file(log) == -1) {
+        errMsg("alog_rotate(): Failed to open new log file %s", log->path);
+    }
+}
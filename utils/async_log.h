@@ -0,0 +1,39 @@
+/* async_log.h
+
+   Header file for async_log.c
+*/
+
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ALOG_MAX_LOGS       8           /* Maximum number of logs open at once */
+#define ALOG_MAX_RINGS      64          /* Maximum number of threads writing to a log */
+#define ALOG_RING_SIZE      (256*1024)  /* Default size of the ring buffer of each writing thread */
+#define ALOG_FLUSH_MS       50          /* Longest time a line stays buffered */
+#define ALOG_KEEP_FILES     5           /* Number of rotated files kept (path.1 ... path.N) */
+#define ALOG_LINE_MAX       2048        /* Longest line written by alog_printf() */
+
+typedef struct alog alog_t;
+
+alog_t *alog_open(const char *path, off_t rotate_bytes, size_t ring_size);
+
+alog_t *alog_open_fd(int fd, size_t ring_size);
+
+alog_t *alog_open_syslog(int priority, size_t ring_size);
+
+int alog_write(alog_t *log, const char *line, size_t len);
+
+int alog_printf(alog_t *log, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+void alog_reopen(alog_t *log);
+
+uint64_t alog_dropped(alog_t *log);
+
+void alog_close(alog_t *log);
+
+#endif
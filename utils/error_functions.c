@@ -17,6 +17,22 @@
 #include "tlpi_hdr.h"
 #include "ename.c.inc"          /* Defines ename and MAX_ENAME */
 
+/* Takes over the output of the messages if set, see errSetOutput() */
+
+static int (*errOutput)(const char *msg, size_t len, int mayBlock);
+
+/* Send the messages to 'output' instead of stderr. It is called with
+   'mayBlock' FALSE for errMsg(), whose callers carry on and should not wait
+   for the message to be written, and TRUE for the functions that terminate
+   the process, whose message must be out before it exits. 'output' returns
+   0 if it took the message, or -1 to have it written to stderr. */
+
+void
+errSetOutput(int (*output)(const char *msg, size_t len, int mayBlock))
+{
+    errOutput = output;
+}
+
 #ifdef __GNUC__                 /* Prevent 'gcc -Wall' complaining  */
 __attribute__ ((__noreturn__))  /* if we call this function as last */
 #endif                          /* statement in a non-void function */
@@ -49,7 +65,7 @@ terminate(Boolean useExit3)
         'format' and 'ap'. */
 
 static void
-outputError(Boolean useErr, int err, Boolean flushStdout,
+outputError(Boolean useErr, int err, Boolean flushStdout, Boolean mayBlock,
         const char *format, va_list ap)
 {
 #define BUF_SIZE 500
@@ -66,6 +82,9 @@ outputError(Boolean useErr, int err, Boolean flushStdout,
 
     snprintf(buf, BUF_SIZE, "ERROR%s %s\n", errText, userMsg);
 
+    if (errOutput != NULL && errOutput(buf, strlen(buf), mayBlock) == 0)
+        return;
+
     if (flushStdout)
         fflush(stdout);       /* Flush any pending stdout */
     fputs(buf, stderr);
@@ -84,7 +103,7 @@ errMsg(const char *format, ...)
     savedErrno = errno;       /* In case we change it here */
 
     va_start(argList, format);
-    outputError(TRUE, errno, TRUE, format, argList);
+    outputError(TRUE, errno, TRUE, FALSE, format, argList);
     va_end(argList);
 
     errno = savedErrno;
@@ -99,7 +118,7 @@ errExit(const char *format, ...)
     va_list argList;
 
     va_start(argList, format);
-    outputError(TRUE, errno, TRUE, format, argList);
+    outputError(TRUE, errno, TRUE, TRUE, format, argList);
     va_end(argList);
 
     terminate(TRUE);
@@ -126,7 +145,7 @@ err_exit(const char *format, ...)
     va_list argList;
 
     va_start(argList, format);
-    outputError(TRUE, errno, FALSE, format, argList);
+    outputError(TRUE, errno, FALSE, TRUE, format, argList);
     va_end(argList);
 
     terminate(FALSE);
@@ -141,7 +160,7 @@ errExitEN(int errnum, const char *format, ...)
     va_list argList;
 
     va_start(argList, format);
-    outputError(TRUE, errnum, TRUE, format, argList);
+    outputError(TRUE, errnum, TRUE, TRUE, format, argList);
     va_end(argList);
 
     terminate(TRUE);
@@ -155,7 +174,7 @@ fatal(const char *format, ...)
     va_list argList;
 
     va_start(argList, format);
-    outputError(FALSE, 0, TRUE, format, argList);
+    outputError(FALSE, 0, TRUE, TRUE, format, argList);
     va_end(argList);
 
     terminate(TRUE);
@@ -15,10 +15,14 @@
 #ifndef ERROR_FUNCTIONS_H
 #define ERROR_FUNCTIONS_H
 
+#include <stddef.h>
+
 /* Error diagnostic routines */
 
 void errMsg(const char *format, ...);
 
+void errSetOutput(int (*output)(const char *msg, size_t len, int mayBlock));
+
 #ifdef __GNUC__
 
     /* This macro stops 'gcc -Wall' complaining that "control reaches
@@ -0,0 +1,133 @@
+/* histogram.c
+ *
+ * Fixed size log-linear histograms for latency measurements
+ *
+ * A histogram is written by a single thread. Other threads may read it (e.g.
+ * to merge it into a summary) while it is being written; the counters are
+ * accessed atomically so that each one is read whole, but the summary is not
+ * a consistent snapshot across counters.
+*/
+#include "histogram.h"
+#include <string.h>
+
+
+/* Return the index of the bucket counting 'value' */
+static unsigned int
+hist_bucket(uint64_t value)
+{
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+
+    unsigned int exp = 63 - __builtin_clzll(value);
+    unsigned int sub = (value >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+/* Return the largest value counted by bucket 'idx' */
+static uint64_t
+hist_bucket_max(unsigned int idx)
+{
+    if (idx < HIST_SUB_BUCKETS)
+        return idx;
+
+    unsigned int exp = idx / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub = idx % HIST_SUB_BUCKETS;
+    uint64_t lowest = (HIST_SUB_BUCKETS + sub) << (exp - HIST_SUB_BITS);
+    return lowest + (1ULL << (exp - HIST_SUB_BITS)) - 1;
+}
+
+void
+hist_init(hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void
+hist_record(hist_t *h, uint64_t value)
+{
+    unsigned int idx = hist_bucket(value);
+
+    /* Single writer: plain read-modify-write, but stores readers can't tear */
+    __atomic_store_n(&h->buckets[idx], h->buckets[idx] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if (value < h->min)
+        __atomic_store_n(&h->min, value, __ATOMIC_RELAXED);
+    if (value > h->max)
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+/* Add the counts of 'src' to 'dst'. 'dst' must not be written concurrently. */
+void
+hist_merge(hist_t *dst, const hist_t *src)
+{
+    uint64_t count = __atomic_load_n(&src->count, __ATOMIC_ACQUIRE);
+    if (count == 0)
+        return;
+
+    unsigned int i;
+    for (i = 0; i < HIST_NUM_BUCKETS; i++)
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+
+    dst->count += count;
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+
+    uint64_t min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (min < dst->min)
+        dst->min = min;
+    if (max > dst->max)
+        dst->max = max;
+}
+
+/* Return the value below which 'percentile' percent of the recorded values
+   fall, rounded up to the end of its bucket, or 0 if the histogram is empty */
+uint64_t
+hist_percentile(const hist_t *h, double percentile)
+{
+    uint64_t total = 0;
+    unsigned int i;
+    for (i = 0; i < HIST_NUM_BUCKETS; i++)
+        total += h->buckets[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    uint64_t seen = 0;
+    for (i = 0; i < HIST_NUM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = hist_bucket_max(i);
+            return (value > h->max) ? h->max : value;
+        }
+    }
+
+    return h->max;
+}
+
+uint64_t
+hist_mean(const hist_t *h)
+{
+    return (h->count > 0) ? h->sum / h->count : 0;
+}
+
+/* Print a one line summary of a histogram of nanoseconds, in microseconds */
+void
+hist_print(FILE *fp, const char *name, const hist_t *h)
+{
+    if (h->count == 0) {
+        fprintf(fp, "%s: no samples\n", name);
+        return;
+    }
+
+    fprintf(fp, "%s: count=%llu mean=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+            name, (unsigned long long) h->count, hist_mean(h) / 1e3,
+            hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+            hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
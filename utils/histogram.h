@@ -0,0 +1,41 @@
+/* histogram.h
+
+   Header file for histogram.c
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Log-linear histogram of non-negative integer values (e.g. nanoseconds).
+ * Each power of two range is split into HIST_SUB_BUCKETS linear buckets, so
+ * any recorded value is reported with a relative error below 1/16 while the
+ * histogram has a fixed size and covers the whole uint64_t range.
+ * Histograms with the same layout are merged by adding their counts. */
+#define HIST_SUB_BITS       4
+#define HIST_SUB_BUCKETS    (1 << HIST_SUB_BITS)
+#define HIST_NUM_BUCKETS    ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;             /* Number of recorded values */
+    uint64_t sum;               /* Sum of recorded values */
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_NUM_BUCKETS];
+} hist_t;
+
+void hist_init(hist_t *h);
+
+void hist_record(hist_t *h, uint64_t value);
+
+void hist_merge(hist_t *dst, const hist_t *src);
+
+uint64_t hist_percentile(const hist_t *h, double percentile);
+
+uint64_t hist_mean(const hist_t *h);
+
+void hist_print(FILE *fp, const char *name, const hist_t *h);
+
+#endif
@@ -0,0 +1,118 @@
+/* perf_counters.c
+ *
+ * Hardware and software performance counters of the calling thread
+ *
+ * The events are opened as one perf_event_open() group so that a single
+ * read() returns all of them, counted over the same interval. Events the
+ * machine does not support (e.g. hardware events in most virtual machines)
+ * are left out of the group, and kernel mode is only counted if
+ * perf_event_paranoid allows it.
+*/
+#define _GNU_SOURCE
+
+#include "tlpi_hdr.h"
+#include "perf_counters.h"
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} events[PERFC_NUM_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,     "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,   "instructions" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,   "cache_misses" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context_switches" }
+};
+
+
+static int
+perfc_open_event(perfc_event event, int group_fd, int exclude_kernel)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[event].type;
+    attr.config = events[event].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+
+    /* This thread (pid 0) on any CPU */
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Open the counters of the calling thread. They start counting at once.
+   Returns the number of events opened, or -1 if none could be. */
+int
+perfc_open(perfc_t *pc)
+{
+    pc->group_fd = -1;
+    pc->num_open = 0;
+    pc->exclude_kernel = 0;
+
+    unsigned int e;
+    for (e = 0; e < PERFC_NUM_EVENTS; e++) {
+        int fd = perfc_open_event(e, pc->group_fd, pc->exclude_kernel);
+        if (fd == -1 && (errno == EACCES || errno == EPERM) && !pc->exclude_kernel) {
+            pc->exclude_kernel = 1;
+            fd = perfc_open_event(e, pc->group_fd, pc->exclude_kernel);
+        }
+
+        pc->fds[e] = fd;
+        if (fd == -1)
+            continue;
+        if (pc->group_fd == -1)
+            pc->group_fd = fd;
+        pc->num_open++;
+    }
+
+    if (pc->num_open == 0) {
+        errMsg("perfc_open(): No performance counter could be opened");
+        return -1;
+    }
+
+    return pc->num_open;
+}
+
+/* Read the current counts into 'values', indexed by perfc_event. The events
+   that are not counted read as 0. Returns 0 on success or -1 on error. */
+int
+perfc_read(const perfc_t *pc, uint64_t values[PERFC_NUM_EVENTS])
+{
+    uint64_t buf[1 + PERFC_NUM_EVENTS];     /* Number of events, then their values in group order */
+
+    if (pc->group_fd == -1)
+        return -1;
+
+    ssize_t n = read(pc->group_fd, buf, sizeof(buf));
+    if (n < (ssize_t) sizeof(uint64_t) || buf[0] != pc->num_open)
+        return -1;
+
+    unsigned int e, i = 1;
+    for (e = 0; e < PERFC_NUM_EVENTS; e++)
+        values[e] = (pc->fds[e] != -1) ? buf[i++] : 0;
+
+    return 0;
+}
+
+void
+perfc_close(perfc_t *pc)
+{
+    unsigned int e;
+    for (e = 0; e < PERFC_NUM_EVENTS; e++) {
+        if (pc->fds[e] != -1)
+            close(pc->fds[e]);
+        pc->fds[e] = -1;
+    }
+    pc->group_fd = -1;
+    pc->num_open = 0;
+}
+
+const char *
+perfc_event_name(perfc_event event)
+{
+    return (event < PERFC_NUM_EVENTS) ? events[event].name : "unknown";
+}
@@ -0,0 +1,36 @@
+/* perf_counters.h
+
+   Header file for perf_counters.c
+*/
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+
+/* Events counted, in the order of the values read by perfc_read() */
+typedef enum {
+    PERFC_CYCLES,
+    PERFC_INSTRUCTIONS,
+    PERFC_CACHE_MISSES,
+    PERFC_CONTEXT_SWITCHES,
+    PERFC_NUM_EVENTS
+} perfc_event;
+
+/* Counters of the thread that opened them */
+typedef struct {
+    int group_fd;                       /* Leader of the event group, or -1 if no event could be opened */
+    int fds[PERFC_NUM_EVENTS];          /* -1 for the events not supported here */
+    unsigned int num_open;
+    unsigned int exclude_kernel;        /* Only user space is counted (perf_event_paranoid >= 2) */
+} perfc_t;
+
+int perfc_open(perfc_t *pc);
+
+int perfc_read(const perfc_t *pc, uint64_t values[PERFC_NUM_EVENTS]);
+
+void perfc_close(perfc_t *pc);
+
+const char *perfc_event_name(perfc_event event);
+
+#endif
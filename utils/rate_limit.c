@@ -0,0 +1,170 @@
+/* rate_limit.c
+ *
+ * Per-client-address rate limiting
+ *
+ * Each client address has a token bucket holding up to 'burst' tokens and
+ * earning 'rate' tokens per second; a request takes one token. The bucket
+ * is kept as a single word, the time at which it will be full again
+ * ("theoretical arrival time" of the GCRA formulation): a request is allowed
+ * if that time is at most a burst away, and pushes it one token later. The
+ * bucket is thus updated with one compare-and-swap, and needs no refill.
+ *
+ * The buckets live in a fixed-size table, split in shards of
+ * RL_SHARD_BUCKETS buckets sharing a cache line. An address hashes to one
+ * shard. Buckets whose full time has passed hold nothing worth keeping, so
+ * they are reused by the next address that needs one: the table expires
+ * buckets lazily and never grows. If a shard has no such bucket, the one
+ * closest to full is evicted, giving its address a fresh burst.
+ *
+ * Two addresses racing for the same free bucket may briefly share its
+ * tokens; the limit is approximate in that case only.
+ *
+ * A limiter created shared keeps its buckets in an anonymous shared mapping,
+ * so that the processes forked after its creation limit each address
+ * together rather than each allowing it the full rate. The buckets hold
+ * CLOCK_MONOTONIC times, which all processes read alike.
+*/
+
+#include "tlpi_hdr.h"
+#include "rate_limit.h"
+#include <netinet/in.h>
+#include <sys/mman.h>
+
+
+/* FNV-1a hash of the address of 'addr', never 0. IPv4-mapped IPv6 addresses
+   hash like the IPv4 address. */
+static uint64_t
+rl_hash(const struct sockaddr *addr)
+{
+    const unsigned char *p;
+    size_t len;
+
+    if (addr->sa_family == AF_INET) {
+        p = (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr;
+        len = sizeof(struct in_addr);
+    }
+    else if (addr->sa_family == AF_INET6) {
+        const struct in6_addr *a6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+        p = (const unsigned char *) a6;
+        len = sizeof(struct in6_addr);
+        if (IN6_IS_ADDR_V4MAPPED(a6)) {
+            p += 12;
+            len = 4;
+        }
+    }
+    else {
+        return 1;
+    }
+
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return (h == 0) ? 1 : h;
+}
+
+/* Create a limiter allowing each address 'rate' requests per second, in
+   bursts of up to 'burst' requests, tracking about 'num_buckets' addresses
+   at once. If 'shared' is set, the processes forked afterwards share the
+   buckets. Returns NULL on error. */
+rate_limiter *
+rl_create(unsigned int rate, unsigned int burst, unsigned int num_buckets, int shared)
+{
+    if (rate == 0 || burst == 0) {
+        errMsg("rl_create(): Rate and burst must be positive");
+        return NULL;
+    }
+
+    rate_limiter *rl = (rate_limiter *) malloc(sizeof(*rl));
+    if (rl == NULL) {
+        errMsg("rl_create(): Failed to allocate memory for rate limiter");
+        return NULL;
+    }
+    rl->interval_ns = 1000000000ULL / rate;
+    rl->tolerance_ns = (uint64_t) (burst - 1) * rl->interval_ns;
+
+    rl->num_shards = 1;
+    while (rl->num_shards * RL_SHARD_BUCKETS < num_buckets)
+        rl->num_shards <<= 1;
+
+    /* Zeroed buckets are free. A fresh mapping is zeroed and page aligned. */
+    size_t size = rl->num_shards * RL_SHARD_BUCKETS * sizeof(rl_bucket);
+    rl->shared = shared;
+    if (shared) {
+        void *buckets = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (buckets == MAP_FAILED) {
+            errMsg("rl_create(): mmap(): Failed to map shared buckets");
+            free(rl);
+            return NULL;
+        }
+        rl->buckets = (rl_bucket *) buckets;
+    }
+    else {
+        if (posix_memalign((void **) &rl->buckets, 64, size) != 0) {
+            errMsg("rl_create(): Failed to allocate memory for buckets");
+            free(rl);
+            return NULL;
+        }
+        memset(rl->buckets, 0, size);
+    }
+
+    return rl;
+}
+
+/* Take a token from the bucket of the address of 'addr' at time 'now_ns'.
+   Returns 1 if the request is allowed, or 0 if the address is over its rate.
+   May be called from several threads. */
+int
+rl_allow(rate_limiter *rl, const struct sockaddr *addr, uint64_t now_ns)
+{
+    uint64_t key = rl_hash(addr);
+    rl_bucket *shard = &rl->buckets[(key & (rl->num_shards - 1)) * RL_SHARD_BUCKETS];
+    rl_bucket *b = NULL, *oldest = NULL;
+    uint64_t oldest_tat = UINT64_MAX;
+
+    int i;
+    for (i = 0; i < RL_SHARD_BUCKETS; i++) {
+        if (__atomic_load_n(&shard[i].key, __ATOMIC_ACQUIRE) == key) {
+            b = &shard[i];
+            break;
+        }
+        uint64_t tat = __atomic_load_n(&shard[i].tat, __ATOMIC_RELAXED);
+        if (tat < oldest_tat) {
+            oldest_tat = tat;
+            oldest = &shard[i];
+        }
+    }
+
+    if (b == NULL) {
+        /* New address: claim a bucket with an expired one (free buckets
+           have expired at time 0), else evict the one closest to full. The
+           new bucket is full, less the token of this request. */
+        __atomic_store_n(&oldest->tat, now_ns + rl->interval_ns, __ATOMIC_RELAXED);
+        __atomic_store_n(&oldest->key, key, __ATOMIC_RELEASE);
+        return 1;
+    }
+
+    uint64_t tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+    for (;;) {
+        uint64_t start = (tat > now_ns) ? tat : now_ns;
+        if (start - now_ns > rl->tolerance_ns)
+            return 0;
+        if (__atomic_compare_exchange_n(&b->tat, &tat, start + rl->interval_ns, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 1;
+    }
+}
+
+void
+rl_destroy(rate_limiter *rl)
+{
+    if (rl == NULL)
+        return;
+    if (rl->shared)
+        munmap(rl->buckets, rl->num_shards * RL_SHARD_BUCKETS * sizeof(rl_bucket));
+    else
+        free(rl->buckets);
+    free(rl);
+}
@@ -0,0 +1,35 @@
+/* rate_limit.h
+
+   Header file for rate_limit.c
+*/
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Buckets per shard. A shard of 16-byte buckets fills one cache line */
+#define RL_SHARD_BUCKETS 4
+
+/* Token bucket of one client address */
+typedef struct {
+    uint64_t key;               /* Hash of the address, 0 if the bucket was never used */
+    uint64_t tat;               /* Time at which the bucket is full again, in ns */
+} rl_bucket;
+
+typedef struct {
+    uint64_t interval_ns;       /* Time to earn one token */
+    uint64_t tolerance_ns;      /* Time to earn a whole burst, less one token */
+    uint64_t num_shards;        /* Power of 2 */
+    int shared;                 /* The buckets are in a shared mapping */
+    rl_bucket *buckets;
+} rate_limiter;
+
+rate_limiter *rl_create(unsigned int rate, unsigned int burst, unsigned int num_buckets, int shared);
+
+int rl_allow(rate_limiter *rl, const struct sockaddr *addr, uint64_t now_ns);
+
+void rl_destroy(rate_limiter *rl);
+
+#endif
@@ -0,0 +1,182 @@
+/* timer_wheel.c
+ *
+ * Hierarchical timer wheel
+ *
+ * Adding and cancelling a timer are O(1): a timer is linked into the slot of
+ * the lowest level whose range covers its expiry. Each time the level 0
+ * wheel completes a turn, the next slot of level 1 is cascaded, i.e. its
+ * timers are redistributed to level 0, and so on up the levels. Most
+ * timeouts (idle connections) are cancelled or re-armed long before they
+ * cascade, so the cost of a timer that never fires is its add and cancel.
+*/
+
+#include "tlpi_hdr.h"
+#include "timer_wheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_MAX_TICKS ((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+
+
+/* Link 't' into the slot of the lowest level covering its expiry */
+static void
+tw_link(timer_wheel *tw, tw_timer *t)
+{
+    uint64_t expires = t->expires;
+    if (expires <= tw->now)
+        expires = tw->now + 1;          /* Already due: fire on the next tick */
+    else if (expires - tw->now > TW_MAX_TICKS)
+        expires = tw->now + TW_MAX_TICKS;
+
+    uint64_t delta = expires - tw->now;
+    unsigned int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= (1ULL << (TW_BITS * (level + 1))))
+        level++;
+
+    tw_timer **slot = &tw->slots[level][(expires >> (TW_BITS * level)) & TW_MASK];
+    t->next = *slot;
+    if (t->next != NULL)
+        t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void
+tw_unlink(tw_timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+void
+tw_init(timer_wheel *tw, uint64_t tick_ns, uint64_t now_ns)
+{
+    memset(tw, 0, sizeof(*tw));
+    tw->tick_ns = tick_ns;
+    tw->now = now_ns / tick_ns;
+}
+
+void
+tw_timer_init(tw_timer *t)
+{
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+}
+
+/* Arm 't' to expire at 'expires_ns' (CLOCK_MONOTONIC), re-arming it if it is
+   already pending. Timers expire at tick granularity, never early. */
+void
+tw_add(timer_wheel *tw, tw_timer *t, uint64_t expires_ns)
+{
+    if (t->pprev != NULL)
+        tw_unlink(t);
+    else
+        tw->num_pending++;
+
+    t->expires = (expires_ns + tw->tick_ns - 1) / tw->tick_ns;
+    tw_link(tw, t);
+}
+
+void
+tw_cancel(timer_wheel *tw, tw_timer *t)
+{
+    if (t->pprev == NULL)
+        return;
+    tw_unlink(t);
+    tw->num_pending--;
+}
+
+int
+tw_pending(const tw_timer *t)
+{
+    return t->pprev != NULL;
+}
+
+/* Move the timers of the current slot of 'level' down the hierarchy */
+static void
+tw_cascade(timer_wheel *tw, unsigned int level)
+{
+    tw_timer **slot = &tw->slots[level][(tw->now >> (TW_BITS * level)) & TW_MASK];
+    tw_timer *t = *slot;
+    *slot = NULL;
+    while (t != NULL) {
+        tw_timer *next = t->next;
+        tw_link(tw, t);
+        t = next;
+    }
+}
+
+/* Process the ticks up to 'now_ns', calling 'expire' for every timer that
+   expires. The callback may add or cancel any timer, including 't'. */
+void
+tw_advance(timer_wheel *tw, uint64_t now_ns, void (*expire)(tw_timer *t, void *arg), void *arg)
+{
+    uint64_t target = now_ns / tw->tick_ns;
+
+    while (tw->now < target) {
+        /* Skip ahead over empty turns of level 0 when nothing is pending */
+        if (tw->num_pending == 0) {
+            tw->now = target;
+            break;
+        }
+
+        tw->now++;
+
+        /* At the start of each turn of a level, cascade the next level */
+        unsigned int level = 1;
+        while (level < TW_LEVELS && ((tw->now >> (TW_BITS * (level - 1))) & TW_MASK) == 0) {
+            tw_cascade(tw, level);
+            level++;
+        }
+
+        tw_timer **slot = &tw->slots[0][tw->now & TW_MASK];
+        tw_timer *t;
+        while ((t = *slot) != NULL) {
+            tw_unlink(t);
+            tw->num_pending--;
+            expire(t, arg);
+        }
+    }
+}
+
+/* Expire all pending timers at once, e.g. on shutdown */
+void
+tw_expire_all(timer_wheel *tw, void (*expire)(tw_timer *t, void *arg), void *arg)
+{
+    unsigned int level, i;
+    for (level = 0; level < TW_LEVELS; level++) {
+        for (i = 0; i < TW_SLOTS; i++) {
+            tw_timer *t;
+            while ((t = tw->slots[level][i]) != NULL) {
+                tw_unlink(t);
+                tw->num_pending--;
+                expire(t, arg);
+            }
+        }
+    }
+}
+
+/* Return the time in milliseconds until tw_advance() should next be called,
+   or -1 if no timer is pending. May be early (at the next cascade), never late. */
+int
+tw_next_timeout_ms(const timer_wheel *tw, uint64_t now_ns)
+{
+    if (tw->num_pending == 0)
+        return -1;
+
+    /* Next non-empty slot of level 0 before the end of its turn */
+    uint64_t tick = tw->now + 1;
+    do {
+        if (tw->slots[0][tick & TW_MASK] != NULL)
+            break;
+        tick++;
+    } while ((tick & TW_MASK) != 0);
+
+    uint64_t due_ns = tick * tw->tick_ns;
+    if (due_ns <= now_ns)
+        return 0;
+    return (int) ((due_ns - now_ns + 999999) / 1000000);
+}
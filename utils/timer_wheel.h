@@ -0,0 +1,48 @@
+/* timer_wheel.h
+
+   Header file for timer_wheel.c
+*/
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/* Hierarchical timer wheel: TW_LEVELS wheels of TW_SLOTS slots, each slot of
+ * a level spanning a whole turn of the level below. With a 10 ms tick the
+ * wheels cover 64^4 ticks, about 46 hours; later timers expire then. */
+#define TW_BITS     6
+#define TW_SLOTS    (1 << TW_BITS)
+#define TW_LEVELS   4
+
+/* Timer, embedded in the structure it times out */
+typedef struct tw_timer {
+    struct tw_timer *next;
+    struct tw_timer **pprev;    /* Link pointing to this timer, or NULL if not pending */
+    uint64_t expires;           /* Tick at which the timer expires */
+} tw_timer;
+
+typedef struct {
+    uint64_t tick_ns;
+    uint64_t now;               /* Last tick processed */
+    uint64_t num_pending;
+    tw_timer *slots[TW_LEVELS][TW_SLOTS];
+} timer_wheel;
+
+void tw_init(timer_wheel *tw, uint64_t tick_ns, uint64_t now_ns);
+
+void tw_timer_init(tw_timer *t);
+
+void tw_add(timer_wheel *tw, tw_timer *t, uint64_t expires_ns);
+
+void tw_cancel(timer_wheel *tw, tw_timer *t);
+
+int tw_pending(const tw_timer *t);
+
+void tw_advance(timer_wheel *tw, uint64_t now_ns, void (*expire)(tw_timer *t, void *arg), void *arg);
+
+void tw_expire_all(timer_wheel *tw, void (*expire)(tw_timer *t, void *arg), void *arg);
+
+int tw_next_timeout_ms(const timer_wheel *tw, uint64_t now_ns);
+
+#endif
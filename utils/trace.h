@@ -0,0 +1,47 @@
+/* trace.h
+
+   Static tracepoints (USDT probes) of the "http_server" provider
+
+   Where <sys/sdt.h> (systemtap-sdt-dev) is available, each TRACE() site
+   compiles to a single nop plus an ELF note describing the probe and the
+   location of its arguments, so the probes cost nothing until a tracer
+   attaches, e.g.
+
+       bpftrace -e 'usdt:./http-server:http_server:send_done { @[arg1] = count(); }'
+       perf buildid-cache --add ./http-server && perf list sdt_http_server:*
+
+   Without <sys/sdt.h>, or if built with -DTRACE_DISABLE, the probes compile
+   to nothing. Up to 6 arguments, which must be integers or pointers.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#if defined(__has_include) && !defined(TRACE_DISABLE)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_ENABLED 1
+#endif
+#endif
+
+#ifdef TRACE_ENABLED
+
+#define TRACE0(name)                    DTRACE_PROBE(http_server, name)
+#define TRACE1(name, a)                 DTRACE_PROBE1(http_server, name, a)
+#define TRACE2(name, a, b)              DTRACE_PROBE2(http_server, name, a, b)
+#define TRACE3(name, a, b, c)           DTRACE_PROBE3(http_server, name, a, b, c)
+#define TRACE4(name, a, b, c, d)        DTRACE_PROBE4(http_server, name, a, b, c, d)
+
+#else
+
+/* Arguments are still evaluated (and type checked) so that variables used
+   only by probes do not trigger unused warnings */
+#define TRACE0(name)                    do { } while (0)
+#define TRACE1(name, a)                 do { (void) (a); } while (0)
+#define TRACE2(name, a, b)              do { (void) (a); (void) (b); } while (0)
+#define TRACE3(name, a, b, c)           do { (void) (a); (void) (b); (void) (c); } while (0)
+#define TRACE4(name, a, b, c, d)        do { (void) (a); (void) (b); (void) (c); (void) (d); } while (0)
+
+#endif
+
+#endif
@@ -15,6 +15,9 @@
 #include "tlpi_hdr.h"
 #include "utils.h"
 #include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 
 /* read_line.c
@@ -143,19 +146,81 @@ writen(int fd, const void *buffer, size_t n)
 /*
    Buffered read functions
 
-   Implementations of readBufInit(), readBuf(), readLineFromBuf(), readnFromBuf().
+   Implementations of readBufAlloc(), readBufInit(), readBufFill(), readBuf(), readLineFromBuf(), readnFromBuf().
 */
 
+/* Allocate a bookkeeping data structure with an intermediary buffer of
+   'size' bytes for reading from 'fd'. Returns NULL on error. Free with free(). */
+
+rbuf_t *
+readBufAlloc(int fd, size_t size)
+{
+    rbuf_t *rb = (rbuf_t *) malloc(sizeof(*rb) + size);
+    if (rb == NULL)
+        return NULL;
+    rb->size = size;
+    readBufInit(fd, rb);
+    return rb;
+}
+
 /* Initialize the bookkeeping data structure pointed to by 'rb' */
 
 void
 readBufInit(int fd, rbuf_t *rb)
 {
     rb->fd = fd;
+    rb->deadline_ns = 0;
     rb->cnt = 0;
     rb->bufptr = rb->buf;
 }
 
+/* Read from the socket 'rb->fd', waiting for data no later than
+   'rb->deadline_ns'. Fails with ETIMEDOUT once the deadline has passed. */
+
+static ssize_t
+readBufDeadline(rbuf_t *rb)
+{
+    for (;;) {
+        ssize_t n = recv(rb->fd, rb->buf, rb->size, MSG_DONTWAIT);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return n;
+
+        uint64_t now = get_monotonic_ns();
+        if (now >= rb->deadline_ns) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        struct pollfd pfd = { .fd = rb->fd, .events = POLLIN };
+        int timeout_ms = (rb->deadline_ns - now + 999999) / 1000000;
+        if (poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR)
+            return -1;
+    }
+}
+
+/* Read from the socket 'rb->fd' without blocking, appending to the unread
+   bytes, which are first moved to the start of the intermediary buffer. The
+   buffer must not be full. Returns the number of bytes read, 0 on EOF, or -1
+   on error, with errno set to EAGAIN if no data is available. */
+
+ssize_t
+readBufFill(rbuf_t *rb)
+{
+    if (rb->cnt <= 0)
+        rb->cnt = 0;
+    else if (rb->bufptr != rb->buf)
+        memmove(rb->buf, rb->bufptr, rb->cnt);
+    rb->bufptr = rb->buf;
+
+    ssize_t n;
+    do {
+        n = recv(rb->fd, rb->buf + rb->cnt, rb->size - rb->cnt, MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0)
+        rb->cnt += n;
+    return n;
+}
+
 /* This is a wrapper function for the Unix read() function that
    transfers min(n, rb->cnt) bytes from our intermediary userspace
    buffer to the user buffer, where 'n' is the number of bytes requested by
@@ -168,7 +233,10 @@ static ssize_t
 readBuf(rbuf_t *rb, void *buffer, size_t n)
 {
     while (rb->cnt <= 0) {          /* Refill intermediary buffer if empty */
-        rb->cnt = read(rb->fd, rb->buf, sizeof(rb->buf));
+        if (rb->deadline_ns != 0)
+            rb->cnt = readBufDeadline(rb);
+        else
+            rb->cnt = read(rb->fd, rb->buf, rb->size);
 
         if (rb->cnt == -1) {
             if (errno != EINTR)     /* Continue/restart read() if interrupted by a signal */
@@ -348,4 +416,12 @@ const char *get_filename_ext(const char *filename) {
     const char *dot = strrchr(filename, '.');
     if(!dot || dot == filename) return "";
     return dot + 1;
-}
\ No newline at end of file
+}
+
+
+// Returns the current time of the monotonic clock in nanoseconds.
+uint64_t get_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -6,6 +6,8 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
+
 ssize_t readLine(int fd, void *buffer, size_t n);
 
 ssize_t readn(int fd, void *buffer, size_t n);
@@ -14,17 +16,24 @@ ssize_t writen(int fd, const void *buffer, size_t n);
 
 /* Bookkeeping data structure containing an intermediary
  * userspace buffer for buffered reads so that we can avoid
- * multiple read() system calls */
-#define BUF_SIZE 8192       /* Specify the (block) size of our intermediary buffer */
+ * multiple read() system calls. The size of the buffer is set
+ * when it is allocated with readBufAlloc(). */
+#define BUF_SIZE 8192       /* Default size of our intermediary buffer, and longest line read */
 typedef struct {
     int fd;                 /* File descriptor of the I/O resource to read from */
+    uint64_t deadline_ns;   /* Reads fail with ETIMEDOUT after this time (CLOCK_MONOTONIC). 0 for none */
     int cnt;                /* Unread bytes in the intermediary buffer */
     char *bufptr;           /* Next unread byte in the intermediary buffer */
-    char buf[BUF_SIZE];     /* Intermediary userspace buffer */
+    size_t size;            /* Size of the intermediary buffer */
+    char buf[];             /* Intermediary userspace buffer */
 } rbuf_t;
 
+rbuf_t *readBufAlloc(int fd, size_t size);
+
 void readBufInit(int fd, rbuf_t *rb);
 
+ssize_t readBufFill(rbuf_t *rb);
+
 ssize_t readLineFromBuf(rbuf_t *rb, void *buffer, size_t n);
 
 ssize_t readnFromBuf(rbuf_t *rb, void *buffer, size_t n);
@@ -41,4 +50,6 @@ size_t trimwhitespace_copy(char *out, size_t len, const char *str);
 
 const char *get_filename_ext(const char *filename);
 
+uint64_t get_monotonic_ns(void);
+
 #endif